@@ -111,7 +111,20 @@ struct ploop_functions {
 	int (*tg_init)(const char *dev, const char *tg, unsigned int tg_blocksize, struct ploop_tg_data *out);
 	int (*get_mnt_info)(const char *partname, struct ploop_mnt_info *info);
 	int (*compact)(struct ploop_compact_param *param);
-	void *padding[52];
+	int (*dedup)(struct ploop_disk_images_data *di[], int n, struct ploop_dedup_param *param, struct ploop_dedup_stat *stat);
+	int (*get_image_alloc_stat)(const char *image, struct ploop_alloc_stat *st);
+	int (*compact_online)(struct ploop_disk_images_data *di, struct ploop_online_compact_param *param);
+	int (*image_linearize)(const char *image, unsigned int max_moves);
+	int (*compact_many)(const char **paths, int n, const struct ploop_compact_param *config, const struct ploop_compact_sched_param *sp);
+	int (*image_reader_open)(struct ploop_disk_images_data *di, const char *guid, struct ploop_image_reader **out);
+	void (*image_reader_close)(struct ploop_image_reader *r);
+	__u64 (*image_reader_get_size)(struct ploop_image_reader *r);
+	ssize_t (*image_reader_pread)(struct ploop_image_reader *r, void *buf, size_t size, off_t pos);
+	ssize_t (*image_reader_preadv)(struct ploop_image_reader *r, const struct iovec *iov, int iovcnt, off_t pos);
+	void (*timing_start)(struct ploop_timing *t);
+	void (*timing_stop)(void);
+	int (*mount_many)(struct ploop_disk_images_data **di, struct ploop_mount_param *param, int n, int *result, const struct ploop_mount_many_param *mp);
+	void *padding[39];
 }; /* struct ploop_functions */
 
 __attribute__ ((visibility("default")))
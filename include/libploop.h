@@ -76,6 +76,16 @@ struct ploop_mount_param {
 	char dummy[32];
 };
 
+struct ploop_mount_many_param {
+	int max_jobs;		/* concurrent mounts, 0 - number of CPUs */
+	const volatile int *stop;	/* do not start more mounts if set */
+	/* called on completion of each image, serialized */
+	void (*complete)(int idx, int ret, struct ploop_mount_param *param,
+			void *data);
+	void *data;
+	char dummy[32];
+};
+
 /* Bit values for ploop_create_param.flags */
 enum ploop_create_flags {
 	PLOOP_CREATE_NOLAZY		= 1 << 0, /* do NOT use lazy init */
@@ -135,6 +145,8 @@ struct ploop_snapshot_data {
 };
 
 struct ploop_disk_images_runtime_data;
+struct ploop_image_reader;
+struct iovec;
 
 struct encryption_data {
 	char *keyid;
@@ -205,13 +217,20 @@ struct ploop_snapshot_switch_param {
 	char dummy[32];
 };
 
+/* Bit values for ploop_merge_param.flags */
+enum ploop_merge_flags {
+	/* do not rewrite clusters identical to ones in the parent delta */
+	PLOOP_MERGE_SKIP_IDENTICAL	= 1 << 0,
+};
+
 struct ploop_merge_param {
 	int unused1;
 	int merge_all;
 	const char *guid;
 	const char *unused2;
 	const char *new_delta;
-	char dummy[32];
+	int flags;
+	char dummy[28];
 };
 
 struct ploop_discard_param {
@@ -330,6 +349,63 @@ struct ploop_compact_param {
 	char dummy[32];
 };
 
+struct ploop_compact_sched_param {
+	int max_jobs;		/* concurrent compactions, 0 - number of CPUs */
+	int nice;		/* CPU priority of compaction threads */
+	int ioprio;		/* best-effort I/O priority 1..7, 0 - inherit */
+	int timeout;		/* seconds to stop after, 0 - no limit */
+	__u64 max_reclaim;	/* bytes to reclaim, 0 - no limit */
+	volatile int *stop;
+	char dummy[32];
+};
+
+struct ploop_online_compact_param {
+	__u64 rate;		/* relocation rate, bytes per second, 0 - unlimited */
+	const volatile int *stop;
+	int top;		/* compact the top delta too */
+	char dummy[28];
+};
+
+struct ploop_alloc_stat {
+	__u64 size;		/* image file size */
+	__u64 allocated;	/* bytes in clusters mapped by BAT */
+	__u64 free;		/* bytes in unused clusters inside the image */
+	__u64 tail_free;	/* unused bytes right before the end of data */
+	__u32 free_runs[16];	/* number of unused runs by log2 of length */
+	int cached;		/* taken from the image allocation summary */
+	__u32 fragments;	/* contiguous runs of clusters in virtual order,
+				   1 for a linear image */
+	char dummy[28];
+};
+
+struct ploop_dedup_param {
+	const char *index;	/* cluster hash index file, optional */
+	int dry;		/* only count duplicates */
+	char dummy[32];
+};
+
+struct ploop_dedup_stat {
+	__u64 clusters;		/* allocated clusters scanned */
+	__u64 dup_clusters;	/* clusters with a duplicate */
+	__u64 dedup_bytes;	/* bytes shared by the filesystem */
+};
+
+#define PLOOP_TIMING_MAX_PHASES	32
+
+struct ploop_timing_phase {
+	char name[32];
+	__u64 start_us;		/* since ploop_timing_start() */
+	__u64 duration_us;
+};
+
+struct ploop_timing {
+	__u64 total_us;
+	int nr_phases;
+	int dropped;		/* phases which did not fit */
+	struct ploop_timing_phase phases[PLOOP_TIMING_MAX_PHASES];
+	char dummy[32];
+};
+
 /* Constants for ploop_set_verbose_level(): */
 #define PLOOP_LOG_NOCONSOLE	-2	/* disable all console logging */
 #define PLOOP_LOG_NOSTDOUT	-1	/* disable all but errors to stderr */
@@ -361,6 +437,9 @@ int ploop_init_image(struct ploop_disk_images_data *di, struct ploop_create_para
 int ploop_init_device(const char *device, struct ploop_create_param *param);
 int ploop_mount_image(struct ploop_disk_images_data *di, struct ploop_mount_param *param);
 int ploop_mount_snapshot(struct ploop_disk_images_data *di, struct ploop_mount_param *param);
+int ploop_mount_many(struct ploop_disk_images_data **di,
+		struct ploop_mount_param *param, int n, int *result,
+		const struct ploop_mount_many_param *mp);
 int ploop_umount(const char *device, struct ploop_disk_images_data *di);
 int ploop_umount_image(struct ploop_disk_images_data *di);
 int ploop_replace_image(struct ploop_disk_images_data *di, struct ploop_replace_param *param);
@@ -400,6 +479,9 @@ void ploop_set_verbose_level(int level);
 
 /* Cancelation API */
 void ploop_cancel_operation(void);
+/* Phase timing API, records phases of the calling thread operations */
+void ploop_timing_start(struct ploop_timing *t);
+void ploop_timing_stop(void);
 /* pcopy routines */
 int ploop_copy_receiver(struct ploop_copy_receive_param *arg);
 
@@ -409,6 +491,21 @@ int ploop_discard(struct ploop_disk_images_data *di,
 			struct ploop_discard_param *param);
 
 int ploop_compact(struct ploop_compact_param *param);
+int ploop_compact_many(const char **paths, int n,
+		const struct ploop_compact_param *config,
+		const struct ploop_compact_sched_param *sp);
+int ploop_get_image_alloc_stat(const char *image, struct ploop_alloc_stat *st);
+int ploop_dedup(struct ploop_disk_images_data *di[], int n,
+		struct ploop_dedup_param *param, struct ploop_dedup_stat *stat);
+/* Offline reader of the virtual disk of snapshot guid (NULL - top) */
+int ploop_image_reader_open(struct ploop_disk_images_data *di,
+		const char *guid, struct ploop_image_reader **out);
+void ploop_image_reader_close(struct ploop_image_reader *r);
+__u64 ploop_image_reader_get_size(struct ploop_image_reader *r);
+ssize_t ploop_image_reader_pread(struct ploop_image_reader *r, void *buf,
+		size_t size, off_t pos);
+ssize_t ploop_image_reader_preadv(struct ploop_image_reader *r,
+		const struct iovec *iov, int iovcnt, off_t pos);
 int ploop_open_dd(struct ploop_disk_images_data **di, const char *fname);
 void ploop_close_dd(struct ploop_disk_images_data *di);
 int ploop_create_dd(const char *ddxml, struct ploop_create_param *param);
@@ -430,6 +527,9 @@ void ploop_free_dm_message(char *msg);
 int ploop_suspend_device(const char *devname);
 int ploop_resume_device(const char *devname);
 int ploop_image_defrag(const char *image, int flags);
+int ploop_image_linearize(const char *image, unsigned int max_moves);
+int ploop_compact_online(struct ploop_disk_images_data *di,
+		struct ploop_online_compact_param *param);
 int ploop_get_mnt_info(const char *partname, struct ploop_mnt_info *info);
 
 int ploop_tg_init(const char *dev, const char *tg, unsigned int tg_blocksize, struct ploop_tg_data *out);
@@ -50,6 +50,8 @@
 #define EXT_FLAGS_NECESSARY 0x1
 #define EXT_FLAGS_TRANSIT   0x2
 #define EXT_MAGIC_DIRTY_BITMAP 0x20385FAE252CB34AULL
+#define EXT_MAGIC_ALLOC_SUMMARY 0x6D6D7553636F6C41ULL
+#define ALLOC_SUMMARY_BUCKETS 16
 
 #pragma pack(push,1)
 /*
@@ -110,6 +112,20 @@ struct ploop_pvd_dirty_bitmap_raw
 	__u32 m_L1Size;
 	__u64 m_L1[0]; // array of m_L1Size elements
 };
+
+/*
+ * Allocation summary, valid while the image size is m_FileSize
+ */
+struct ploop_pvd_alloc_summary_raw
+{
+	__u64 m_FileSize;	/* image size incl. format extension */
+	__u32 m_AllocHead;	/* end of data, in clusters */
+	__u32 m_Allocated;	/* clusters mapped by BAT */
+	__u32 m_Free;		/* unused clusters below m_AllocHead */
+	__u32 m_TailFree;	/* unused clusters just before m_AllocHead */
+	__u32 m_FreeRuns[ALLOC_SUMMARY_BUCKETS]; /* unused runs by log2(len) */
+	__u32 m_Fragments;	/* contiguous runs in virtual order */
+};
 #pragma pack(pop)
 
 /* Compressed disk (version 1) */
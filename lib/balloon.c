@@ -35,8 +35,14 @@
 #include <sys/time.h>
 #include <linux/types.h>
 #include <linux/fs.h>
+#include <linux/posix_types.h>
+#include <linux/fsmap.h>
 #include <string.h>
 #include <sys/sysmacros.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "ploop.h"
 #include "ploop_if.h"
@@ -148,40 +154,122 @@ __u32 *alloc_reverse_map(__u32 len)
 	return reverse_map;
 }
 
-static int do_truncate(int fd, off_t old_size, off_t new_size)
+/* Default size of one balloon change step */
+#define BALLOON_STEP		(1ULL << 30)
+
+struct balloon_ctx {
+	struct timeval start;
+	off_t step;
+	__u64 done;
+	__u64 total;
+	const struct ploop_balloon_param *param;
+};
+
+/* Account a step, report progress and keep the rate.
+ * Returns non-zero if the operation has to be stopped.
+ */
+static int balloon_step_done(struct balloon_ctx *ctx, __u64 len)
+{
+	const struct ploop_balloon_param *param = ctx->param;
+	struct timeval now;
+	__u64 elapsed, expected;
+
+	ctx->done += len;
+	if (param->progress)
+		param->progress(ctx->done, ctx->total, param->data);
+
+	if (param->rate && ctx->done < ctx->total) {
+		gettimeofday(&now, NULL);
+		elapsed = (now.tv_sec - ctx->start.tv_sec) * 1000000ULL +
+			now.tv_usec - ctx->start.tv_usec;
+		expected = ctx->done * 1000000ULL / param->rate;
+		if (expected > elapsed)
+			usleep(expected - elapsed);
+	}
+
+	return (param->stop && *param->stop) || is_operation_cancelled();
+}
+
+static int do_truncate(int fd, off_t old_size, off_t new_size,
+		struct balloon_ctx *ctx)
 {
 	int ret;
+	off_t size = old_size, step = ctx->step;
 
 	if (new_size == old_size) {
 		ploop_log(0, "Nothing to do: new_size == old_size");
-	} else if (ftruncate(fd, new_size)) {
-		ploop_err(errno, "Can't truncate hidden balloon");
-		fsync_balloon(fd);
-		return(SYSEXIT_FTRUNCATE);
-	} else {
-		ret = fsync_balloon(fd);
-		if (ret)
-			return ret;
-		ploop_log(0, "Successfully truncated balloon from %llu to %llu bytes",
-			(unsigned long long)old_size, (unsigned long long)new_size);
+		return 0;
+	}
+
+	/* release space step by step from the end */
+	while (size > new_size) {
+		off_t len = MIN(size - new_size, step);
+
+		if (ftruncate(fd, size - len)) {
+			ploop_err(errno, "Can't truncate hidden balloon");
+			fsync_balloon(fd);
+			return(SYSEXIT_FTRUNCATE);
+		}
+		size -= len;
+
+		if (size > new_size && balloon_step_done(ctx, len)) {
+			ploop_log(0, "Truncating balloon is cancelled at %llu bytes",
+					(unsigned long long)size);
+			fsync_balloon(fd);
+			return SYSEXIT_ABORT;
+		}
 	}
+
+	ret = fsync_balloon(fd);
+	if (ret)
+		return ret;
+	if (ctx->param->progress)
+		ctx->param->progress(ctx->total, ctx->total, ctx->param->data);
+	ploop_log(0, "Successfully truncated balloon from %llu to %llu bytes",
+			(unsigned long long)old_size, (unsigned long long)new_size);
 	return 0;
 }
 
-static int do_inflate(int fd, off_t old_size, off_t *new_size)
+static int do_inflate(int fd, off_t old_size, off_t *new_size,
+		struct balloon_ctx *ctx)
 {
 	struct stat st;
-	int err;
+	int err = 0, ret = SYSEXIT_FALLOCATE;
+	off_t size = old_size, step = ctx->step;
+
+	/* fill the holes below the old size too, as a single fallocate
+	 * of the whole balloon did; it is cheap if there are none
+	 */
+	if (old_size > 0) {
+		err = sys_fallocate(fd, 0, 0, old_size);
+		if (err)
+			ploop_err(errno, "Can't fallocate balloon");
+	}
 
-	err = sys_fallocate(fd, 0, 0, *new_size);
-	if (err)
-		ploop_err(errno, "Can't fallocate balloon");
+	/* allocate step by step, so the allocator is not held for long */
+	while (!err && size < *new_size) {
+		off_t len = MIN(*new_size - size, step);
+
+		err = sys_fallocate(fd, 0, size, len);
+		if (err) {
+			ploop_err(errno, "Can't fallocate balloon");
+			break;
+		}
+		size += len;
+
+		if (size < *new_size && balloon_step_done(ctx, len)) {
+			ploop_log(0, "Inflating balloon is cancelled");
+			err = 1;
+			ret = SYSEXIT_ABORT;
+			break;
+		}
+	}
 
 	if (fstat(fd, &st)) {
 		ploop_err(errno, "Can't stat balloon (2)");
 		if (ftruncate(fd, old_size))
 			ploop_err(errno, "Can't revert old_size back");
-		return(err ? SYSEXIT_FALLOCATE : SYSEXIT_FSTAT);
+		return(err ? ret : SYSEXIT_FSTAT);
 	}
 
 	if (err) {
@@ -189,7 +277,7 @@ static int do_inflate(int fd, off_t old_size, off_t *new_size)
 			if (ftruncate(fd, old_size))
 				ploop_err(errno, "Can't revert old_size back (2)");
 		}
-		return(SYSEXIT_FALLOCATE);
+		return ret;
 	}
 
 	if (st.st_size < *new_size) {
@@ -206,16 +294,21 @@ static int do_inflate(int fd, off_t old_size, off_t *new_size)
 	if (err)
 		return err;
 
+	if (ctx->param->progress)
+		ctx->param->progress(ctx->total, ctx->total, ctx->param->data);
 	ploop_log(0, "Successfully inflated balloon from %llu to %llu bytes",
 			(unsigned long long)old_size, (unsigned long long)*new_size);
 	return 0;
 }
 
-int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
+int ploop_balloon_change_size_ex(const char *device, int balloonfd,
+		off_t new_size, const struct ploop_balloon_param *param)
 {
 	int    ret;
 	off_t  old_size;
 	struct stat st;
+	struct ploop_balloon_param def = {};
+	struct balloon_ctx ctx = {};
 
 	if (fstat(balloonfd, &st)) {
 		ploop_err(errno, "Can't get balloon file size");
@@ -228,19 +321,38 @@ int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
 	ploop_log(0, "Changing balloon size old_size=%ld new_size=%ld",
 			(long)old_size, (long)new_size);
 
+	if (param == NULL)
+		param = &def;
+	ctx.param = param;
+	ctx.step = param->step ? param->step : BALLOON_STEP;
+	/* keep steps aligned to the fs block */
+	ctx.step = (ctx.step + st.st_blksize - 1) & ~(st.st_blksize - 1);
+	ctx.total = old_size > new_size ? old_size - new_size : new_size - old_size;
+	gettimeofday(&ctx.start, NULL);
+
 	if (old_size >= new_size)
-		ret = do_truncate(balloonfd, old_size, new_size);
+		ret = do_truncate(balloonfd, old_size, new_size, &ctx);
 	else
-		ret = do_inflate(balloonfd, old_size, &new_size);
+		ret = do_inflate(balloonfd, old_size, &new_size, &ctx);
 
 	return ret;
 }
 
+int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size)
+{
+	return ploop_balloon_change_size_ex(device, balloonfd, new_size, NULL);
+}
 
-static volatile int trim_stop = 0;
+/* SIGUSR1 interrupts FITRIM of the thread it is delivered to */
+static __thread volatile sig_atomic_t trim_signalled;
 static void stop_trim_handler(int sig)
 {
-	trim_stop = 1;
+	trim_signalled = 1;
+}
+
+static int is_trim_stopped(const volatile int *stop)
+{
+	return trim_signalled || (stop != NULL && *stop);
 }
 
 static int get_discard_granularity(struct ploop_disk_images_data *di,
@@ -320,50 +432,204 @@ static int get_discard_granularity(struct ploop_disk_images_data *di,
 
 /* The fragmentation of such blocks doesn't affect the speed of w/r */
 #define MAX_DISCARD_CLU 32
+#define FSMAP_NR_RECS	1024
 
-static int ploop_trim(struct ploop_disk_images_data *di,
-		const char *devname, const char *mount_point, __u64 minlen_b)
+struct trim_range {
+	__u64 start;
+	__u64 len;
+};
+
+static int cmp_trim_range(const void *a, const void *b)
 {
-	struct fstrim_range range = {};
-	int fd, ret = -1, last = 0;
-	off_t size;
-	__u64 trim_minlen;
-	__u64 discard_granularity;
-	__u32 cluster;
-	struct sigaction sa = {
-		.sa_handler     = stop_trim_handler,
-	};
-	sigemptyset(&sa.sa_mask);
+	const struct trim_range *x = a, *y = b;
 
-	ret = get_image_param_online(di, devname, NULL, &size, &cluster, NULL, NULL);
+	return x->start < y->start ? -1 : (x->start > y->start ? 1 : 0);
+}
+
+/* Walk the free space map of the file system once and call fn() for the
+ * cluster aligned part of every free extent not shorter than minlen.
+ * Offsets passed to fn() are in file system space, dev_start is the
+ * offset of the file system on the ploop device.
+ * Returns -1 if GETFSMAP is not supported.
+ */
+static int walk_free_clusters(int fd, __u64 dev_start, __u32 cluster,
+		__u64 minlen, int (*fn)(void *data, __u64 start, __u64 len),
+		void *data)
+{
+	struct fsmap_head *head;
+	int i, ret = 0;
+
+	head = calloc(1, fsmap_sizeof(FSMAP_NR_RECS));
+	if (head == NULL)
+		return SYSEXIT_MALLOC;
+
+	head->fmh_count = FSMAP_NR_RECS;
+	head->fmh_keys[1].fmr_device = UINT_MAX;
+	head->fmh_keys[1].fmr_physical = ULLONG_MAX;
+	head->fmh_keys[1].fmr_owner = ULLONG_MAX;
+	head->fmh_keys[1].fmr_offset = ULLONG_MAX;
+	head->fmh_keys[1].fmr_flags = UINT_MAX;
+
+	while (1) {
+		if (ioctl(fd, FS_IOC_GETFSMAP, head)) {
+			if (errno == EOPNOTSUPP || errno == ENOTTY ||
+					errno == EINVAL) {
+				ploop_log(1, "GETFSMAP is not supported");
+				ret = -1;
+			} else {
+				ploop_err(errno, "Can't get file system free space map");
+				ret = SYSEXIT_SYS;
+			}
+			break;
+		}
+
+		if (head->fmh_entries == 0)
+			break;
+
+		for (i = 0; i < head->fmh_entries; i++) {
+			struct fsmap *m = &head->fmh_recs[i];
+			__u64 s, e;
+
+			if (m->fmr_owner != FMR_OWN_FREE)
+				continue;
+
+			s = (m->fmr_physical + dev_start + cluster - 1) /
+				cluster * cluster;
+			e = (m->fmr_physical + m->fmr_length + dev_start) /
+				cluster * cluster;
+			if (e <= s || e - s < minlen)
+				continue;
+
+			ret = fn(data, s - dev_start, e - s);
+			if (ret)
+				goto out;
+		}
+
+		if (head->fmh_recs[head->fmh_entries - 1].fmr_flags & FMR_OF_LAST)
+			break;
+		fsmap_advance(head);
+	}
+
+out:
+	free(head);
+
+	return ret;
+}
+
+static int get_fs_dev_start(int fd, __u64 *dev_start)
+{
+	struct stat st;
+	__u32 start;
+	int ret;
+
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can't stat mount point");
+		return SYSEXIT_SYS;
+	}
+
+	ret = dev_num2dev_start(st.st_dev, &start);
 	if (ret)
 		return ret;
-	cluster = S2B(cluster);
 
-	ret = get_discard_granularity(di, cluster, &discard_granularity);
+	*dev_start = S2B((__u64)start);
+
+	return 0;
+}
+
+struct trim_plan {
+	struct trim_range *r;
+	int n;
+	int alloc;
+	const volatile int *stop;
+};
+
+static int add_trim_range(void *data, __u64 start, __u64 len)
+{
+	struct trim_plan *p = data;
+
+	if (is_trim_stopped(p->stop))
+		return -2;
+
+	if (p->n == p->alloc) {
+		struct trim_range *t;
+
+		p->alloc = p->alloc ? p->alloc * 2 : 1024;
+		t = realloc(p->r, p->alloc * sizeof(struct trim_range));
+		if (t == NULL)
+			return SYSEXIT_MALLOC;
+		p->r = t;
+	}
+	p->r[p->n].start = start;
+	p->r[p->n++].len = len;
+
+	return 0;
+}
+
+/* Discard fully free clusters. The ranges are merged where they touch and
+ * trimmed in ascending order, so each FITRIM covers as much as possible and
+ * the image is discarded front to back.
+ */
+static int trim_planned(int fd, __u32 cluster, __u64 minlen_b,
+		const volatile int *stop)
+{
+	struct trim_plan p = {.stop = stop};
+	struct trim_range *r;
+	__u64 dev_start;
+	int i, j, n, ret;
+
+	ret = get_fs_dev_start(fd, &dev_start);
 	if (ret)
 		return ret;
 
-	if (sigaction(SIGUSR1, &sa, NULL)) {
-		ploop_err(errno, "Can't set signal handler");
-		return -1;
+	ret = walk_free_clusters(fd, dev_start, cluster, minlen_b,
+			add_trim_range, &p);
+	if (ret) {
+		free(p.r);
+		return ret == -2 ? 0 : ret;
 	}
-
-	fd = open(mount_point, O_RDONLY|O_CLOEXEC);
-	if (fd < 0) {
-		ploop_err(errno, "Can't open mount point %s", mount_point);
-		return -1;
+	r = p.r;
+	n = p.n;
+
+	qsort(r, n, sizeof(struct trim_range), cmp_trim_range);
+	for (i = 1, j = 0; i < n; i++) {
+		if (r[i].start <= r[j].start + r[j].len) {
+			if (r[i].start + r[i].len > r[j].start + r[j].len)
+				r[j].len = r[i].start + r[i].len - r[j].start;
+		} else
+			r[++j] = r[i];
+	}
+	if (n)
+		n = j + 1;
+
+	ploop_log(1, "Call FITRIM for %d planned ranges", n);
+	for (i = 0; i < n && !is_trim_stopped(stop); i++) {
+		struct fstrim_range range = {
+			.start = r[i].start,
+			.len = r[i].len,
+			.minlen = minlen_b,
+		};
+
+		if (ioctl(fd, FITRIM, &range) < 0) {
+			if (!is_trim_stopped(stop)) {
+				ploop_err(errno, "Can't trim file system");
+				ret = SYSEXIT_SYS;
+			}
+			break;
+		}
 	}
 
-	sys_syncfs(fd);
+	free(r);
 
-	if (minlen_b < cluster)
-		minlen_b = cluster;
-	else
-		minlen_b = (minlen_b + cluster - 1) / cluster * cluster;
+	return ret;
+}
+
+static int trim_by_minlen(int fd, __u32 cluster, __u64 minlen_b,
+		const volatile int *stop)
+{
+	struct fstrim_range range = {};
+	int ret = 0, last = 0;
+	__u64 trim_minlen;
 
-	if (minlen_b < discard_granularity)
-		minlen_b = discard_granularity;
 	range.minlen = MAX(MAX_DISCARD_CLU * cluster, minlen_b);
 
 	for (; range.minlen >= minlen_b; range.minlen /= 2) {
@@ -374,7 +640,7 @@ static int ploop_trim(struct ploop_disk_images_data *di,
 		trim_minlen = range.minlen;
 		ret = ioctl(fd, FITRIM, &range);
 		if (ret < 0) {
-			if (trim_stop)
+			if (is_trim_stopped(stop))
 				ret = 0;
 			else
 				ploop_err(errno, "Can't trim file system");
@@ -394,6 +660,57 @@ static int ploop_trim(struct ploop_disk_images_data *di,
 		}
 	}
 
+	return ret;
+}
+
+static int ploop_trim(struct ploop_disk_images_data *di,
+		const char *devname, const char *mount_point, __u64 minlen_b,
+		const volatile int *stop)
+{
+	int fd, ret = -1;
+	off_t size;
+	__u64 discard_granularity;
+	__u32 cluster;
+	struct sigaction sa = {
+		.sa_handler     = stop_trim_handler,
+	};
+	sigemptyset(&sa.sa_mask);
+
+	ret = get_image_param_online(di, devname, NULL, &size, &cluster, NULL, NULL);
+	if (ret)
+		return ret;
+	cluster = S2B(cluster);
+
+	ret = get_discard_granularity(di, cluster, &discard_granularity);
+	if (ret)
+		return ret;
+
+	trim_signalled = 0;
+	if (sigaction(SIGUSR1, &sa, NULL)) {
+		ploop_err(errno, "Can't set signal handler");
+		return -1;
+	}
+
+	fd = open(mount_point, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		ploop_err(errno, "Can't open mount point %s", mount_point);
+		return -1;
+	}
+
+	sys_syncfs(fd);
+
+	if (minlen_b < cluster)
+		minlen_b = cluster;
+	else
+		minlen_b = (minlen_b + cluster - 1) / cluster * cluster;
+
+	if (minlen_b < discard_granularity)
+		minlen_b = discard_granularity;
+
+	ret = trim_planned(fd, cluster, minlen_b, stop);
+	if (ret == -1 && !is_trim_stopped(stop))
+		ret = trim_by_minlen(fd, cluster, minlen_b, stop);
+
 	close(fd);
 
 	return ret;
@@ -549,7 +866,7 @@ err:
 int ploop_discard_by_dev(const char *device, const char *mount_point,
 		__u64 minlen_b, __u64 to_free, const volatile int *stop)
 {
-	return ploop_trim(NULL, device, mount_point, minlen_b);
+	return ploop_trim(NULL, device, mount_point, minlen_b, stop);
 }
 
 static void defrag_pidfile(const char *dev, char *out, int size)
@@ -835,7 +1152,7 @@ int ploop_discard(struct ploop_disk_images_data *di,
 		}
 	}
 
-	ret = ploop_trim(di, dev, mnt, 0);
+	ret = ploop_trim(di, dev, mnt, 0, param->stop);
 
 	if (ploop_lock_dd(di) == 0) {
 		if (mounted) {
@@ -994,6 +1311,224 @@ int ploop_compact(struct ploop_compact_param *param)
 	return err;
 }
 
+#ifndef IOPRIO_CLASS_BE
+#define IOPRIO_CLASS_SHIFT	13
+#define IOPRIO_CLASS_BE		2
+#define IOPRIO_WHO_PROCESS	1
+#endif
+
+struct compact_job {
+	char *path;
+	double reclaim;
+};
+
+struct compact_sched {
+	struct compact_job *jobs;
+	int nr_jobs;
+	int next;
+	int running;
+	int stopping;
+	pthread_mutex_t lock;
+	const struct ploop_compact_param *config;
+	const struct ploop_compact_sched_param *sp;
+};
+
+struct compact_worker {
+	pthread_t th;
+	struct compact_sched *s;
+	volatile int stop;
+	volatile dev_t dev;
+	int rc;
+};
+
+static int cmp_reclaim(const void *a, const void *b)
+{
+	const struct compact_job *x = a, *y = b;
+
+	return x->reclaim < y->reclaim ? 1 : (x->reclaim > y->reclaim ? -1 : 0);
+}
+
+/* Get reclaimable space of a disk, 0 if below the threshold */
+static int get_reclaim(const char *path, const struct ploop_compact_param *config,
+		double *reclaim)
+{
+	int ret;
+	double rate;
+	struct ploop_disk_images_data *di;
+	struct ploop_discard_stat pds;
+
+	*reclaim = 0;
+	ret = ploop_open_dd(&di, path);
+	if (ret)
+		return ret;
+
+	ret = ploop_discard_get_stat(di, &pds);
+	ploop_close_dd(di);
+	if (ret)
+		return ret;
+
+	if (pds.ploop_size == 0 || pds.image_size <= pds.data_size)
+		return 0;
+
+	rate = ((double) pds.image_size - pds.data_size) / pds.ploop_size * 100;
+	if (rate >= config->threshold)
+		*reclaim = (double) pds.image_size - pds.data_size;
+
+	return 0;
+}
+
+static void *compact_worker_thread(void *arg)
+{
+	struct compact_worker *w = arg;
+	struct compact_sched *s = w->s;
+	struct ploop_compact_param param;
+	int n, ret;
+
+	if (s->sp->nice)
+		setpriority(PRIO_PROCESS, syscall(SYS_gettid), s->sp->nice);
+	if (s->sp->ioprio)
+		syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, syscall(SYS_gettid),
+				(IOPRIO_CLASS_BE << IOPRIO_CLASS_SHIFT) |
+				(s->sp->ioprio & 7));
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		if (s->stopping || s->next == s->nr_jobs) {
+			s->running--;
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		n = s->next++;
+		pthread_mutex_unlock(&s->lock);
+
+		param = *s->config;
+		param.path = s->jobs[n].path;
+		param.stop = &w->stop;
+		param.compact_dev = &w->dev;
+		ret = ploop_compact(&param);
+		if (ret && w->rc == 0)
+			w->rc = ret;
+	}
+
+	return NULL;
+}
+
+/* Compact disks in order of reclaimable space, up to sp->max_jobs at
+ * once. Stopping (sp->stop or timeout) preempts running compactions.
+ */
+int ploop_compact_many(const char **paths, int n,
+		const struct ploop_compact_param *config,
+		const struct ploop_compact_sched_param *sp)
+{
+	int i, nr_workers, ret = 0;
+	time_t deadline;
+	struct compact_sched s = {
+		.config = config,
+		.sp = sp,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct compact_worker *w = NULL;
+
+	s.jobs = calloc(n, sizeof(struct compact_job));
+	if (s.jobs == NULL)
+		return SYSEXIT_MALLOC;
+
+	deadline = sp->timeout ? time(NULL) + sp->timeout : 0;
+	for (i = 0; i < n; i++) {
+		double reclaim;
+
+		if (sp->stop && *sp->stop)
+			goto out;
+		if (get_reclaim(paths[i], config, &reclaim)) {
+			ploop_log(0, "Skip '%s': can't get discard stat", paths[i]);
+			continue;
+		}
+		if (reclaim == 0)
+			continue;
+
+		s.jobs[s.nr_jobs].path = (char *)paths[i];
+		s.jobs[s.nr_jobs++].reclaim = reclaim;
+	}
+
+	qsort(s.jobs, s.nr_jobs, sizeof(struct compact_job), cmp_reclaim);
+
+	/* keep only the disks which fit into the reclaim budget */
+	if (sp->max_reclaim) {
+		double total = 0;
+
+		for (i = 0; i < s.nr_jobs && total < sp->max_reclaim; i++)
+			total += s.jobs[i].reclaim;
+		s.nr_jobs = i;
+	}
+
+	ploop_log(0, "Compacting %d of %d disks", s.nr_jobs, n);
+	if (s.nr_jobs == 0)
+		goto out;
+
+	nr_workers = sp->max_jobs > 0 ? sp->max_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers <= 0)
+		nr_workers = 1;
+	nr_workers = MIN(nr_workers, s.nr_jobs);
+
+	w = calloc(nr_workers, sizeof(struct compact_worker));
+	if (w == NULL) {
+		ret = SYSEXIT_MALLOC;
+		goto out;
+	}
+
+	/* workers may finish before the others are created */
+	s.running = nr_workers;
+	for (i = 0; i < nr_workers; i++) {
+		w[i].s = &s;
+		if (pthread_create(&w[i].th, NULL, compact_worker_thread, &w[i])) {
+			ploop_err(errno, "Can't create compact thread");
+			ret = SYSEXIT_SYS;
+			break;
+		}
+	}
+	pthread_mutex_lock(&s.lock);
+	s.running -= nr_workers - i;
+	pthread_mutex_unlock(&s.lock);
+	nr_workers = i;
+
+	while (1) {
+		int running, j;
+
+		pthread_mutex_lock(&s.lock);
+		running = s.running;
+		if (!s.stopping && ((sp->stop && *sp->stop) ||
+				(deadline && time(NULL) >= deadline))) {
+			ploop_log(0, "Stop compacting");
+			s.stopping = 1;
+		}
+		pthread_mutex_unlock(&s.lock);
+
+		if (running == 0)
+			break;
+
+		/* ploop_compact() clears stop on start, so keep it set */
+		if (s.stopping)
+			for (j = 0; j < nr_workers; j++)
+				w[j].stop = 1;
+		sleep(1);
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		pthread_join(w[i].th, NULL);
+		if (w[i].rc && ret == 0)
+			ret = w[i].rc;
+	}
+
+	if (ret == 0 && s.stopping)
+		ret = SYSEXIT_ABORT;
+
+out:
+	free(w);
+	free(s.jobs);
+
+	return ret;
+}
+
 int ploop_complete_running_operation(const char *device)
 {
 	return 0;
@@ -1025,6 +1560,137 @@ int complete_running_operation(struct ploop_disk_images_data *di,
 	return 0;
 }
 
+static int sum_free_cluster(void *data, __u64 start, __u64 len)
+{
+	*(__u64 *)data += len;
+
+	return 0;
+}
+
+#define FREE_CLUSTERS_CACHE_SIZE	16
+#define FREE_CLUSTERS_CACHE_TTL		60	/* seconds */
+
+struct free_clusters_cache {
+	dev_t dev;		/* file system device */
+	time_t time;		/* monotonic time of the walk */
+	__u64 bfree;		/* free fs blocks at the time of the walk */
+	__u64 size;
+};
+
+static struct free_clusters_cache _s_free_cache[FREE_CLUSTERS_CACHE_SIZE];
+static pthread_mutex_t _s_free_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static time_t get_monotonic_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/* The free space map walk is done once in FREE_CLUSTERS_CACHE_TTL per
+ * file system; in between the cached size is corrected by the change
+ * of the free block count.
+ */
+static int get_cached_free_clusters_size(dev_t dev,
+		const struct statfs *stfs, __u64 *size)
+{
+	int i, ret = -1;
+	__s64 delta;
+	__u64 bfree = stfs->f_bfree * stfs->f_bsize;
+	time_t now = get_monotonic_time();
+
+	pthread_mutex_lock(&_s_free_cache_mutex);
+	for (i = 0; i < FREE_CLUSTERS_CACHE_SIZE; i++) {
+		struct free_clusters_cache *c = &_s_free_cache[i];
+
+		if (c->dev != dev || c->time == 0 ||
+				now - c->time >= FREE_CLUSTERS_CACHE_TTL)
+			continue;
+
+		delta = (__s64)bfree - (__s64)c->bfree;
+		if (delta < 0 && (__u64)-delta > c->size)
+			*size = 0;
+		else
+			*size = MIN(c->size + delta, bfree);
+		ret = 0;
+		break;
+	}
+	pthread_mutex_unlock(&_s_free_cache_mutex);
+
+	return ret;
+}
+
+static void set_cached_free_clusters_size(dev_t dev,
+		const struct statfs *stfs, __u64 size)
+{
+	int i, n = 0;
+	struct free_clusters_cache *c;
+
+	pthread_mutex_lock(&_s_free_cache_mutex);
+	for (i = 0; i < FREE_CLUSTERS_CACHE_SIZE; i++) {
+		c = &_s_free_cache[i];
+		if (c->dev == dev) {
+			n = i;
+			break;
+		}
+		if (c->time < _s_free_cache[n].time)
+			n = i;
+	}
+	c = &_s_free_cache[n];
+	c->dev = dev;
+	c->time = get_monotonic_time();
+	c->bfree = stfs->f_bfree * stfs->f_bsize;
+	c->size = size;
+	pthread_mutex_unlock(&_s_free_cache_mutex);
+}
+
+/* Size of fully free clusters, i.e. the space compaction can reclaim.
+ * Returns -1 if the free space map is not available.
+ */
+static int get_free_clusters_size(const char *device, const char *mount_point,
+		const struct statfs *stfs, __u64 *size)
+{
+	int fd, ret;
+	off_t dev_size;
+	__u32 cluster;
+	__u64 dev_start;
+	struct stat st;
+
+	if (stat(mount_point, &st)) {
+		ploop_err(errno, "Can't stat %s", mount_point);
+		return SYSEXIT_FSTAT;
+	}
+
+	if (get_cached_free_clusters_size(st.st_dev, stfs, size) == 0)
+		return 0;
+
+	ret = get_image_param_online(NULL, device, NULL, &dev_size, &cluster,
+			NULL, NULL);
+	if (ret)
+		return ret;
+
+	fd = open(mount_point, O_RDONLY|O_CLOEXEC);
+	if (fd < 0) {
+		ploop_err(errno, "Can't open mount point %s", mount_point);
+		return SYSEXIT_OPEN;
+	}
+
+	ret = get_fs_dev_start(fd, &dev_start);
+	if (ret == 0) {
+		*size = 0;
+		ret = walk_free_clusters(fd, dev_start, S2B(cluster), 0,
+				sum_free_cluster, size);
+	}
+	close(fd);
+
+	if (ret == 0)
+		set_cached_free_clusters_size(st.st_dev, stfs, *size);
+
+	return ret;
+}
+
 int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 		struct ploop_discard_stat *pd_stat)
 {
@@ -1032,6 +1698,7 @@ int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 	struct statfs	stfs;
 	struct stat	st, balloon_stat;
 	off_t		ploop_size;
+	__u64		free_size;
 	char		image[PATH_MAX];
 
 	err = get_balloon(mount_point, &balloon_stat, NULL);
@@ -1058,9 +1725,15 @@ int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 		return 1;
 	}
 
+	err = get_free_clusters_size(device, mount_point, &stfs, &free_size);
+	if (err == -1)
+		free_size = stfs.f_bfree * stfs.f_bsize;
+	else if (err)
+		return 1;
+
 	pd_stat->ploop_size = S2B(ploop_size) - balloon_stat.st_size;
 	pd_stat->image_size = st.st_blocks * 512;
-	pd_stat->data_size = pd_stat->ploop_size - stfs.f_bfree * stfs.f_bsize;
+	pd_stat->data_size = pd_stat->ploop_size - free_size;
 	pd_stat->balloon_size = balloon_stat.st_size;
 	pd_stat->native_discard = 1;
 
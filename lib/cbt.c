@@ -30,6 +30,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <uuid/uuid.h>
 #include <openssl/md5.h>
 
@@ -81,6 +82,13 @@ struct cbt_data {
 	struct blk_user_cbt_info info;
 };
 
+struct cbt_writer {
+	pthread_t th;
+	struct delta *delta;
+	struct cbt_data *data;
+	int ret;
+};
+
 #define BLKCBTSTART _IOR(0x12,200, struct blk_user_cbt_info)
 #define BLKCBTSTOP _IO(0x12,201)
 #define BLKCBTGET _IOWR(0x12,202, struct blk_user_cbt_info)
@@ -244,90 +252,110 @@ int cbt_stop(int devfd)
 	return 0;
 }
 
-static int cbt_set_dirty_bitmap_part(int devfd, const __u8 *uuid, void *buf,
-		__u64 size, __u64 offset, __u32 byte_granularity)
+/* Extents to be sent with BLKCBTSET. Adjacent extents are merged, so
+ * a bitmap is pushed as the minimal number of runs, and the kernel is
+ * called only when CBT_MAX_EXTENTS (the kernel limit) are collected.
+ */
+struct cbt_set_batch {
+	int devfd;
+	struct blk_user_cbt_info *info;
+};
+
+static int cbt_set_batch_init(struct cbt_set_batch *b, int devfd,
+		const __u8 *uuid)
 {
-	int ret = 0;
-	size_t s = sizeof(struct blk_user_cbt_info) + CBT_MAX_EXTENTS * sizeof(struct blk_user_cbt_extent);
-	struct blk_user_cbt_info *info = (struct blk_user_cbt_info *)malloc(s);
-	struct blk_user_cbt_extent *cur, *end;
-	__s64 bit;
-	if (info == NULL)
+	size_t s = sizeof(struct blk_user_cbt_info) +
+		CBT_MAX_EXTENTS * sizeof(struct blk_user_cbt_extent);
+
+	b->devfd = devfd;
+	b->info = malloc(s);
+	if (b->info == NULL)
 		return SYSEXIT_MALLOC;
 
-	memset(info, 0, s);
-	memcpy(info->ci_uuid, uuid, sizeof(info->ci_uuid));
-	cur = info->ci_extents;
-	end = info->ci_extents + CBT_MAX_EXTENTS;
+	memset(b->info, 0, s);
+	memcpy(b->info->ci_uuid, uuid, sizeof(b->info->ci_uuid));
 
-	for (bit = BitFindNextSet64(buf, size, 0);
-			bit != -1;
-			bit = BitFindNextSet64(buf, size, bit + 1))
-	{
-		cur->ce_physical = (bit + offset) * byte_granularity;
-		bit = BitFindNextClear64(buf, size, bit + 1);
-		if (bit == -1)
-			bit = size;
-		cur->ce_length = (bit + offset) * byte_granularity - cur->ce_physical;
-
-		info->ci_extent_count++;
-
-		if (++cur == end) {
-			info->ci_mapped_extents = info->ci_extent_count;
-			if (ioctl(devfd, BLKCBTSET, info)) {
-				ploop_err(errno, "BLKCBTSET");
-				ret = SYSEXIT_DEVIOC;
-				goto out;
-			}
-			info->ci_extent_count = 0;
-			cur = info->ci_extents;
-		}
+	return 0;
+}
+
+static int cbt_set_batch_flush(struct cbt_set_batch *b)
+{
+	if (b->info->ci_extent_count == 0)
+		return 0;
+
+	b->info->ci_mapped_extents = b->info->ci_extent_count;
+	if (ioctl(b->devfd, BLKCBTSET, b->info)) {
+		ploop_err(errno, "BLKCBTSET");
+		return SYSEXIT_DEVIOC;
 	}
+	b->info->ci_extent_count = 0;
 
-	if (info->ci_extent_count > 0) {
-		info->ci_mapped_extents = info->ci_extent_count;
-		if (ioctl(devfd, BLKCBTSET, info)) {
-			ploop_err(errno, "BLKCBTSET");
-			ret = SYSEXIT_DEVIOC;
-			goto out;
+	return 0;
+}
+
+static int cbt_set_batch_add(struct cbt_set_batch *b, __u64 start, __u64 len)
+{
+	int ret;
+	struct blk_user_cbt_extent *e;
+
+	if (b->info->ci_extent_count) {
+		e = &b->info->ci_extents[b->info->ci_extent_count - 1];
+		if (e->ce_physical + e->ce_length == start) {
+			e->ce_length += len;
+			return 0;
 		}
 	}
 
-out:
-	free(info);
-	return ret;
+	if (b->info->ci_extent_count == CBT_MAX_EXTENTS) {
+		ret = cbt_set_batch_flush(b);
+		if (ret)
+			return ret;
+	}
+
+	e = &b->info->ci_extents[b->info->ci_extent_count++];
+	e->ce_physical = start;
+	e->ce_length = len;
+
+	return 0;
 }
 
-static int cbt_set_dirty_bitmap_const_part(int devfd, const __u8 *uuid, int val,
-		__u64 size, __u64 offset, __u32 byte_granularity)
+static void cbt_set_batch_free(struct cbt_set_batch *b)
 {
-	int ret = 0;
-	size_t s;
-	struct blk_user_cbt_info *info;
-
-	if (val == 0)
-		return 0;
+	free(b->info);
+}
 
-	s = sizeof(struct blk_user_cbt_info) + sizeof(struct blk_user_cbt_extent);
-	info = (struct blk_user_cbt_info *)malloc(s);
-	if (info == NULL)
-		return SYSEXIT_MALLOC;
-	memset(info, 0, s);
+static int cbt_set_dirty_bitmap_part(struct cbt_set_batch *b, void *buf,
+		__u64 size, __u64 offset, __u32 byte_granularity)
+{
+	int ret;
+	__s64 bit, end;
 
-	memcpy(info->ci_uuid, uuid, sizeof(info->ci_uuid));
-	info->ci_extent_count = 1;
-	info->ci_mapped_extents = 1;
-	info->ci_extents[0].ce_physical = offset * byte_granularity;
-	info->ci_extents[0].ce_length = size * byte_granularity;
+	/* BitFind*64 skip whole clear/set words, a run costs O(len / 64) */
+	for (bit = BitFindNextSet64(buf, size, 0);
+			bit != -1;
+			bit = BitFindNextSet64(buf, size, end + 1))
+	{
+		end = BitFindNextClear64(buf, size, bit + 1);
+		if (end == -1)
+			end = size;
 
-	if (ioctl(devfd, BLKCBTSET, info)) {
-		ploop_err(errno, "BLKCBTSET");
-		ret = SYSEXIT_DEVIOC;
+		ret = cbt_set_batch_add(b, (bit + offset) * byte_granularity,
+				(end - bit) * byte_granularity);
+		if (ret)
+			return ret;
 	}
 
-	free(info);
+	return 0;
+}
 
-	return ret;
+static int cbt_set_dirty_bitmap_const_part(struct cbt_set_batch *b, int val,
+		__u64 size, __u64 offset, __u32 byte_granularity)
+{
+	if (val == 0)
+		return 0;
+
+	return cbt_set_batch_add(b, offset * byte_granularity,
+			size * byte_granularity);
 }
 
 static int cbt_get_dirty_bitmap_part(int devfd, void *buf, __u64 size,
@@ -350,7 +378,8 @@ static int cbt_get_dirty_bitmap_part(int devfd, void *buf, __u64 size,
 	info->ci_length = size * byte_granularity;
 	ci_end = info->ci_start + info->ci_length;
 
-	do {
+	/* devfd == -1: the bitmap was captured in advance, use or_data only */
+	while (devfd != -1) {
 		struct blk_user_cbt_extent *last;
 		info->ci_mapped_extents = 0;
 		if (ioctl(devfd, BLKCBTGET, info)) {
@@ -368,10 +397,13 @@ static int cbt_get_dirty_bitmap_part(int devfd, void *buf, __u64 size,
 			BMAP_SET_BLOCK(buf, first - offset, last - first + 1);
 		}
 
+		if (info->ci_mapped_extents != info->ci_extent_count)
+			break;
+
 		last = end - 1;
 		info->ci_start = last->ce_physical + last->ce_length;
 		info->ci_length = ci_end - info->ci_start;
-	} while (info->ci_mapped_extents == info->ci_extent_count);
+	}
 
 	if (or_cbt != NULL) {
 		cur = or_cbt->info.ci_extents;
@@ -454,6 +486,9 @@ int cbt_get_and_clear(int devfd, void **data)
 			return SYSEXIT_DEVIOC;
 		}
 
+		/* keep metadata to be able to store the bitmap without device */
+		memcpy(info->ci_uuid, info_kern->ci_uuid, sizeof(info->ci_uuid));
+		info->ci_blksize = info_kern->ci_blksize;
 		memcpy(&info->ci_extents[info->ci_mapped_extents], info_kern->ci_extents,
 			   info_kern->ci_mapped_extents * sizeof(info_kern->ci_extents[0]));
 		info->ci_mapped_extents += info_kern->ci_mapped_extents;
@@ -520,6 +555,7 @@ out:
 int cbt_put(int devfd, void *data, size_t size, off_t pos)
 {
 	struct blk_user_cbt_info *info_kern;
+	__u32 i, n;
 	char x[50];
 
 	if (size < sizeof(struct blk_user_cbt_info)) {
@@ -554,7 +590,24 @@ int cbt_put(int devfd, void *data, size_t size, off_t pos)
 	ploop_log(3, "Save CBT uuid: %s start: %ld size %lu",
 		uuid2str(info_kern->ci_uuid, x), pos, size);
 
-	info_kern->ci_extent_count = info_kern->ci_mapped_extents;
+	/* merge runs split by the sender's packet/block boundaries */
+	for (i = 0, n = 0; i < info_kern->ci_mapped_extents; i++) {
+		struct blk_user_cbt_extent *e = &info_kern->ci_extents[i];
+
+		if (e->ce_length == 0)
+			continue;
+		if (n > 0 && info_kern->ci_extents[n - 1].ce_physical +
+				info_kern->ci_extents[n - 1].ce_length == e->ce_physical)
+			info_kern->ci_extents[n - 1].ce_length += e->ce_length;
+		else
+			info_kern->ci_extents[n++] = *e;
+	}
+
+	if (n == 0)
+		return 0;
+
+	info_kern->ci_mapped_extents = n;
+	info_kern->ci_extent_count = n;
 	info_kern->ci_start = 0;
 	info_kern->ci_length = 0;
 	info_kern->ci_blksize = 0;
@@ -642,7 +695,14 @@ int save_dirty_bitmap(int devfd, struct delta *delta, off_t offset,
 	vh = (struct ploop_pvd_header *)delta->hdr0;
 
 	/* granularity and uuid */
-	if ((ret = cbt_get_dirty_bitmap_metadata(devfd, raw->m_Id, &raw->m_Granularity)))
+	if (devfd == -1) {
+		struct cbt_data *cbt = (struct cbt_data *)or_data;
+
+		if (cbt == NULL || cbt->info.ci_blksize == 0)
+			return SYSEXIT_PARAM;
+		memcpy(raw->m_Id, cbt->info.ci_uuid, sizeof(raw->m_Id));
+		raw->m_Granularity = cbt->info.ci_blksize;
+	} else if ((ret = cbt_get_dirty_bitmap_metadata(devfd, raw->m_Id, &raw->m_Granularity)))
 		return ret;
 	raw->m_Granularity /= SECTOR_SIZE;
 
@@ -738,6 +798,87 @@ static int save_dirty_bitmap_from_raw(struct ploop_pvd_dirty_bitmap_raw *in_raw,
 	return 0;
 }
 
+static int calc_alloc_summary(struct delta *delta, __u32 alloc_head,
+		struct ploop_pvd_alloc_summary_raw *s)
+{
+	int rc, nr_clusters = 0;
+	__u32 size, clu, end, len;
+	__s64 n;
+	__u64 *hole_bitmap = NULL;
+
+	rc = build_hole_bitmap(delta, &hole_bitmap, &size, &nr_clusters);
+	if (rc)
+		goto out;
+
+	memset(s, 0, sizeof(*s));
+	s->m_AllocHead = alloc_head;
+	s->m_Allocated = nr_clusters;
+	rc = calc_fragmentation(delta, &s->m_Fragments);
+	if (rc)
+		goto out;
+
+	/* clusters past the hole bitmap can not be mapped */
+	if (size > alloc_head)
+		size = alloc_head;
+	for (clu = delta->l1_size; clu < alloc_head; clu = end) {
+		if (clu < size) {
+			n = BitFindNextSet64(hole_bitmap, size, clu);
+			clu = (n == -1) ? size : n;
+		}
+		if (clu >= alloc_head)
+			break;
+
+		n = (clu < size) ? BitFindNextClear64(hole_bitmap, size, clu) : -1;
+		end = (n == -1) ? alloc_head : n;
+
+		len = end - clu;
+		s->m_Free += len;
+		s->m_FreeRuns[MIN(ALLOC_SUMMARY_BUCKETS - 1, 31 - __builtin_clz(len))]++;
+		if (end == alloc_head)
+			s->m_TailFree = len;
+	}
+
+out:
+	free(hole_bitmap);
+	return rc;
+}
+
+
+/* Write the format extension block at the end of the image */
+static int write_ext_block(struct delta *delta, __u8 *block, size_t block_size,
+		struct ploop_pvd_alloc_summary_raw *summary)
+{
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+	struct ploop_pvd_ext_block_check *hc = (struct ploop_pvd_ext_block_check *)block;
+	struct stat stat;
+
+	if (fstat(delta->fd, &stat)) {
+		ploop_err(errno, "fstat");
+		return SYSEXIT_READ;
+	}
+
+	vh->m_DiskInUse = SIGNATURE_DISK_CLOSED_V21;
+	vh->m_FormatExtensionOffset = (stat.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (PWRITE(delta, vh, sizeof(*vh), 0)) {
+		ploop_err(errno, "Can't write header");
+		return SYSEXIT_WRITE;
+	}
+
+	if (summary != NULL)
+		summary->m_FileSize = vh->m_FormatExtensionOffset * SECTOR_SIZE +
+			block_size;
+
+	hc->m_Magic = FORMAT_EXTENSION_MAGIC;
+	md5sum((const unsigned char *)(hc + 1), block_size - sizeof(*hc), hc->m_Md5);
+
+	if (PWRITE(delta, block, block_size, vh->m_FormatExtensionOffset * SECTOR_SIZE)) {
+		ploop_err(errno, "Can't write optional header");
+		return SYSEXIT_WRITE;
+	}
+
+	return 0;
+}
+
 int delta_save_optional_header(int devfd, struct delta *delta,
 		void *or_data, struct ploop_pvd_dirty_bitmap_raw *raw)
 {
@@ -748,12 +889,17 @@ int delta_save_optional_header(int devfd, struct delta *delta,
 	struct ploop_pvd_ext_block_element_header *h;
 	__u8 *block = NULL, *data;
 	struct stat stat;
+	off_t data_end;
 
-	/* save from device or from raw */
-	if ((devfd == -1 ) == (raw == NULL))
+	/* save from device, from captured or_data or from raw */
+	if (devfd != -1 && raw != NULL)
+		return SYSEXIT_PARAM;
+	if (devfd == -1 && raw == NULL && or_data == NULL)
 		return SYSEXIT_PARAM;
 
-	/* or_data may be used only when saving from device */
+	/* or_data is the bitmap captured from the device, either to be
+	 * saved alone (devfd == -1) or with the device; never with raw
+	 */
 	if (raw != NULL && or_data != NULL)
 		return SYSEXIT_PARAM;
 
@@ -769,18 +915,22 @@ int delta_save_optional_header(int devfd, struct delta *delta,
 	h = (struct ploop_pvd_ext_block_element_header *)(hc + 1);
 	data = (__u8 *)(h + 1);
 
+	/* do not leave the summary block behind the dirty bitmap */
+	delta_drop_alloc_summary(delta);
+
+	if (fstat(delta->fd, &stat)) {
+		ploop_err(errno, "fstat");
+		ret = SYSEXIT_READ;
+		goto out;
+	}
+	data_end = stat.st_size;
+
 	h->magic = EXT_MAGIC_DIRTY_BITMAP;
 	if (raw == NULL) {
-		if (fstat(delta->fd, &stat)) {
-			ploop_err(errno, "fstat");
-			ret = SYSEXIT_READ;
-			goto out;
-		}
-
-		ret = save_dirty_bitmap(devfd, delta, stat.st_size, data,
+		ret = save_dirty_bitmap(devfd, delta, data_end, data,
 			&h->size, or_data, NULL, NULL);
 		if (ret) {
-			/* no we have no extensions except dirty bitmap extension, so, if
+			/* dirty bitmap is the mandatory extension here, so if
 			 * there are no cbt it is the end (but not an error) */
 			if (ret == SYSEXIT_NOCBT)
 				ret = 0;
@@ -792,31 +942,257 @@ int delta_save_optional_header(int devfd, struct delta *delta,
 		}
 	}
 
+	ret = write_ext_block(delta, block, block_size, NULL);
+
+out:
+	free(block);
+	return ret;
+}
+
+/* Store the summary s as the format extension of an offline image.
+ * An older summary is replaced, an extension with the dirty bitmap
+ * is left as is.
+ */
+static int save_alloc_summary(struct delta *delta,
+		const struct ploop_pvd_alloc_summary_raw *s)
+{
+	int ret;
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+	struct ploop_pvd_ext_block_element_header *h;
+	struct ploop_pvd_alloc_summary_raw *summary;
+	size_t block_size;
+	__u8 *block;
+
+	if (vh->m_DiskInUse == SIGNATURE_DISK_IN_USE ||
+			delta_drop_alloc_summary(delta))
+		return 0;
+
+	block_size = vh->m_Sectors * SECTOR_SIZE;
+	if (p_memalign((void **)&block, 4096, block_size))
+		return SYSEXIT_MALLOC;
+	memset(block, 0, block_size);
+
+	h = (struct ploop_pvd_ext_block_element_header *)
+		(block + sizeof(struct ploop_pvd_ext_block_check));
+	summary = (struct ploop_pvd_alloc_summary_raw *)(h + 1);
+	/* keep room for the terminating element */
+	if ((__u8 *)(summary + 1) + sizeof(*h) > block + block_size) {
+		free(block);
+		return 0;
+	}
+	h->magic = EXT_MAGIC_ALLOC_SUMMARY;
+	h->size = sizeof(*summary);
+	memcpy(summary, s, sizeof(*summary));
+
+	ret = write_ext_block(delta, block, block_size, summary);
+
+	free(block);
+
+	return ret;
+}
+
+int delta_save_alloc_summary(struct delta *delta)
+{
+	struct ploop_pvd_alloc_summary_raw s;
+	struct stat stat;
+
 	if (fstat(delta->fd, &stat)) {
 		ploop_err(errno, "fstat");
-		ret = SYSEXIT_READ;
-		goto out;
+		return SYSEXIT_READ;
 	}
 
-	vh->m_DiskInUse = SIGNATURE_DISK_CLOSED_V21;
-	vh->m_FormatExtensionOffset = (stat.st_size + SECTOR_SIZE - 1) / SECTOR_SIZE;
+	if (calc_alloc_summary(delta, stat.st_size / S2B(delta->blocksize), &s)) {
+		ploop_log(0, "Warning: can't calculate allocation summary");
+		return 0;
+	}
+
+	return save_alloc_summary(delta, &s);
+}
+
+/* Read the format extension block of a closed image.
+ * Returns the block or NULL if there is no valid one.
+ */
+static __u8 *read_ext_block(struct delta *delta, size_t *block_size)
+{
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+	struct ploop_pvd_ext_block_check *hc;
+	unsigned char hash[16];
+	__u8 *block;
+
+	if (vh->m_DiskInUse != SIGNATURE_DISK_CLOSED_V21 ||
+			vh->m_FormatExtensionOffset == 0)
+		return NULL;
+
+	*block_size = vh->m_Sectors * SECTOR_SIZE;
+	if (p_memalign((void **)&block, 4096, *block_size))
+		return NULL;
+
+	if (PREAD(delta, block, *block_size, vh->m_FormatExtensionOffset * SECTOR_SIZE))
+		goto err;
+
+	hc = (struct ploop_pvd_ext_block_check *)block;
+	if (hc->m_Magic != FORMAT_EXTENSION_MAGIC)
+		goto err;
+
+	md5sum((const unsigned char *)(hc + 1), *block_size - sizeof(*hc), hash);
+	if (memcmp(hash, hc->m_Md5, 16) != 0)
+		goto err;
+
+	return block;
+
+err:
+	free(block);
+	return NULL;
+}
+
+#define for_each_ext_element(h, block, end)				\
+	for (h = (struct ploop_pvd_ext_block_element_header *)		\
+			((struct ploop_pvd_ext_block_check *)block + 1);	\
+		(__u8 *)(h + 1) <= end && h->magic != 0 &&		\
+			(__u8 *)(h + 1) + h->size <= end;		\
+		h = (struct ploop_pvd_ext_block_element_header *)	\
+			((__u8 *)(h + 1) + h->size))
+
+/* Returns 0 if the image has a summary which is valid for its current
+ * state, -1 otherwise.
+ */
+static int read_alloc_summary(struct delta *delta,
+		struct ploop_pvd_alloc_summary_raw *out)
+{
+	int ret = -1;
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+	struct ploop_pvd_ext_block_element_header *h;
+	struct ploop_pvd_alloc_summary_raw *s;
+	size_t block_size;
+	__u8 *block;
+	struct stat stat;
+
+	if (fstat(delta->fd, &stat))
+		return -1;
+
+	block = read_ext_block(delta, &block_size);
+	if (block == NULL)
+		return -1;
+
+	for_each_ext_element(h, block, block + block_size) {
+		if (h->magic != EXT_MAGIC_ALLOC_SUMMARY || h->size < sizeof(*s))
+			continue;
+
+		s = (struct ploop_pvd_alloc_summary_raw *)(h + 1);
+		/* anything written after the summary changes the size */
+		if (s->m_FileSize != stat.st_size ||
+				(__u64)s->m_AllocHead * S2B(delta->blocksize) >
+				vh->m_FormatExtensionOffset * SECTOR_SIZE)
+			break;
+
+		memcpy(out, s, sizeof(*s));
+		ret = 0;
+		break;
+	}
+
+	free(block);
+	return ret;
+}
+
+/* The summary is derived from BAT, so an extension which carries nothing
+ * else can be dropped to let the image be truncated.
+ * Returns 0 if the image has no format extension anymore.
+ */
+int delta_drop_alloc_summary(struct delta *delta)
+{
+	int ret = -1;
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+	struct ploop_pvd_ext_block_element_header *h;
+	size_t block_size;
+	off_t offset;
+	__u8 *block;
+
+	if (!(vh->m_DiskInUse == SIGNATURE_DISK_CLOSED_V21 &&
+				vh->m_FormatExtensionOffset != 0))
+		return 0;
+
+	block = read_ext_block(delta, &block_size);
+	if (block == NULL)
+		return -1;
+
+	for_each_ext_element(h, block, block + block_size)
+		if (h->magic != EXT_MAGIC_ALLOC_SUMMARY)
+			goto out;
+
+	offset = vh->m_FormatExtensionOffset * SECTOR_SIZE;
+	vh->m_DiskInUse = SIGNATURE_DISK_CLOSED_V20;
+	vh->m_FormatExtensionOffset = 0;
 	if (PWRITE(delta, vh, sizeof(*vh), 0)) {
 		ploop_err(errno, "Can't write header");
-		ret = SYSEXIT_WRITE;
 		goto out;
 	}
+	if (fsync(delta->fd)) {
+		ploop_err(errno, "fsync");
+		goto out;
+	}
+	if (ftruncate(delta->fd, offset)) {
+		ploop_err(errno, "ftruncate to %llu", (unsigned long long)offset);
+		goto out;
+	}
+	delta->alloc_head = offset / S2B(delta->blocksize);
+	ret = 0;
 
-	hc->m_Magic = FORMAT_EXTENSION_MAGIC;
-	md5sum((const unsigned char *)(hc + 1), block_size - sizeof(*hc), hc->m_Md5);
+out:
+	free(block);
+	return ret;
+}
 
-	if (PWRITE(delta, block, block_size, vh->m_FormatExtensionOffset * SECTOR_SIZE)) {
-		ploop_err(errno, "Can't write optional header");
-		ret = SYSEXIT_WRITE;
+/* A query never changes the image: the summary is stored only by the
+ * offline defrag and linearize which rewrite the image anyway.
+ */
+int ploop_get_image_alloc_stat(const char *image, struct ploop_alloc_stat *st)
+{
+	int i, ret = 0;
+	__u32 alloc_head;
+	__u64 cluster;
+	struct delta d = {};
+	struct ploop_pvd_header *vh;
+	struct ploop_pvd_alloc_summary_raw s;
+	struct stat stat;
+
+	if (open_delta(&d, image, O_RDONLY, OD_ALLOW_DIRTY))
+		return SYSEXIT_OPEN;
+
+	memset(st, 0, sizeof(*st));
+	if (read_alloc_summary(&d, &s) == 0) {
+		st->cached = 1;
+	} else {
+		vh = (struct ploop_pvd_header *)d.hdr0;
+		alloc_head = d.alloc_head;
+		/* do not count the format extension as data */
+		if (vh->m_DiskInUse == SIGNATURE_DISK_CLOSED_V21 &&
+				vh->m_FormatExtensionOffset != 0)
+			alloc_head = MIN(alloc_head, S2B(vh->m_FormatExtensionOffset) /
+					S2B(d.blocksize));
+
+		ret = calc_alloc_summary(&d, alloc_head, &s);
+		if (ret)
+			goto out;
+	}
+
+	if (fstat(d.fd, &stat)) {
+		ploop_err(errno, "fstat %s", image);
+		ret = SYSEXIT_FSTAT;
 		goto out;
 	}
 
+	cluster = S2B(d.blocksize);
+	st->size = stat.st_size;
+	st->allocated = s.m_Allocated * cluster;
+	st->free = s.m_Free * cluster;
+	st->tail_free = s.m_TailFree * cluster;
+	for (i = 0; i < ALLOC_SUMMARY_BUCKETS; i++)
+		st->free_runs[i] = s.m_FreeRuns[i];
+	st->fragments = s.m_Fragments;
+
 out:
-	free(block);
+	close_delta(&d);
+
 	return ret;
 }
 
@@ -950,6 +1326,7 @@ int send_dirty_bitmap_to_kernel(struct ext_context *ctx, const char *devname,
 	__u32 byte_granularity;
 	struct ploop_pvd_dirty_bitmap_raw *raw = NULL;
 	struct delta delta = {};
+	struct cbt_set_batch batch = {};
 	int devfd;
 
 	if (ctx == NULL)
@@ -976,6 +1353,9 @@ int send_dirty_bitmap_to_kernel(struct ext_context *ctx, const char *devname,
 
 	block_size = vh->m_Sectors * SECTOR_SIZE;
 
+	if ((ret = cbt_set_batch_init(&batch, devfd, raw->m_Id)))
+		goto out;
+
 	byte_granularity = raw->m_Granularity * SECTOR_SIZE;
 	bits = ((raw->m_Size + raw->m_Granularity - 1) / raw->m_Granularity);
 	bytes = (bits + 7) >> 3;
@@ -986,18 +1366,21 @@ int send_dirty_bitmap_to_kernel(struct ext_context *ctx, const char *devname,
 
 		if (*p <= 1) {
 			if ((ret = cbt_set_dirty_bitmap_const_part(
-					devfd, raw->m_Id, *p, cur_size * 8, offset * 8, byte_granularity)))
+					&batch, *p, cur_size * 8, offset * 8, byte_granularity)))
 				goto out;
 		} else {
 			if ((ret = cbt_set_dirty_bitmap_part(
-					devfd, raw->m_Id, (void *)*p, cur_size * 8, offset * 8, byte_granularity)))
+					&batch, (void *)*p, cur_size * 8, offset * 8, byte_granularity)))
 				goto out;
 			free((void *)*p);
 			*p = 0;
 		}
 	}
 
+	ret = cbt_set_batch_flush(&batch);
+
 out:
+	cbt_set_batch_free(&batch);
 	close_delta(&delta);
 	close(devfd);
 	return ret;
@@ -1313,6 +1696,58 @@ out:
 	return ret;
 }
 
+static void *cbt_writer_thread(void *arg)
+{
+	struct cbt_writer *w = (struct cbt_writer *)arg;
+
+	w->ret = delta_save_optional_header(-1, w->delta, w->data, NULL);
+
+	return NULL;
+}
+
+/* Store a bitmap captured by cbt_get_and_clear() to the delta in
+ * background. The delta must not be touched until cbt_write_wait().
+ * The ownership of data is passed to the writer.
+ */
+int cbt_write_async(struct delta *delta, void *data, struct cbt_writer **out)
+{
+	struct cbt_writer *w;
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL) {
+		free(data);
+		return SYSEXIT_MALLOC;
+	}
+
+	w->delta = delta;
+	w->data = (struct cbt_data *)data;
+	if (pthread_create(&w->th, NULL, cbt_writer_thread, w)) {
+		ploop_err(errno, "Can't create cbt writer thread");
+		free(w->data);
+		free(w);
+		return SYSEXIT_SYS;
+	}
+
+	*out = w;
+
+	return 0;
+}
+
+int cbt_write_wait(struct cbt_writer *w)
+{
+	int ret;
+
+	if (w == NULL)
+		return 0;
+
+	pthread_join(w->th, NULL);
+	ret = w->ret;
+	free(w->data);
+	free(w);
+
+	return ret;
+}
+
 int cbt_snapshot_prepare(int lfd, const unsigned char *cbt_uuid,
 		void **or_data)
 {
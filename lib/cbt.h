@@ -28,6 +28,7 @@
 #define CBT_DEFAULT_BLKSIZE 65536
 
 struct ext_context;
+struct cbt_writer;
 
 void free_ext_context(struct ext_context *ctx);
 struct ext_context *create_ext_context(void);
@@ -37,6 +38,8 @@ int write_empty_cbt_to_image(const char *fname, const char *prev_fname,
                 const __u8 *cbt_u);
 int delta_save_optional_header(int devfd, struct delta *delta,
                 void *or_data, struct ploop_pvd_dirty_bitmap_raw *raw);
+int delta_save_alloc_summary(struct delta *delta);
+int delta_drop_alloc_summary(struct delta *delta);
 int send_dirty_bitmap_to_kernel(struct ext_context *ctx, const char *devname,
 		const char *img_name);
 int save_dirty_bitmap(int devfd, struct delta *delta, off_t offcet, void *buf,
@@ -45,6 +48,8 @@ int cbt_start(int devfd, const __u8 *uuid, __u32 blksize);
 int cbt_stop(int devfd);
 int cbt_get_dirty_bitmap_metadata(int devfd, __u8 *uuid, __u32 *blksize);
 int cbt_get_and_clear(int devfd, void **data);
+int cbt_write_async(struct delta *delta, void *data, struct cbt_writer **out);
+int cbt_write_wait(struct cbt_writer *w);
 int cbt_get(int devfd, writer_fn wr, void *data);
 int cbt_put(int devfd, void *data, size_t size, off_t pos);
 int cbt_set_uuid(int devfd, const __u8 *uuid);
@@ -27,6 +27,8 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/vfs.h>
+#include <sys/xattr.h>
+#include <pthread.h>
 #include <linux/types.h>
 #include <string.h>
 #include <linux/fs.h>
@@ -738,11 +740,141 @@ done:
 	return ret;
 }
 
+/* A read-only delta which passed the check is stamped with its size,
+ * mtime and header hash, so the next check can be skipped while the
+ * stamp matches. Any write to the image changes its mtime.
+ */
+#define CHECK_STAMP_XATTR	"user.ploop.checked"
+#define CHECK_STAMP_MAGIC	0x31504d5453484350ULL	/* PCHSTMP1 */
+#define CHECK_THREADS		8
+
+struct check_stamp {
+	__u64 magic;
+	__u64 size;
+	__u64 ino;
+	__u64 mtime_sec;
+	__u64 mtime_nsec;
+	unsigned char hdr_md5[16];
+};
+
+static int get_check_stamp(const char *img, struct check_stamp *stamp,
+		__u32 *blocksize)
+{
+	struct ploop_pvd_header vh;
+	struct stat st;
+	int fd, ret = -1;
+
+	fd = open(img, O_RDONLY|O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+
+	if (fstat(fd, &st) ||
+			pread(fd, &vh, sizeof(vh), 0) != sizeof(vh))
+		goto out;
+
+	/* only clean ploop1 images can be stamped */
+	if (ploop1_version(&vh) == PLOOP_FMT_ERROR ||
+			vh.m_DiskInUse == SIGNATURE_DISK_IN_USE)
+		goto out;
+
+	memset(stamp, 0, sizeof(*stamp));
+	stamp->magic = CHECK_STAMP_MAGIC;
+	stamp->size = st.st_size;
+	stamp->ino = st.st_ino;
+	stamp->mtime_sec = st.st_mtim.tv_sec;
+	stamp->mtime_nsec = st.st_mtim.tv_nsec;
+	md5sum((const unsigned char *)&vh, sizeof(vh), stamp->hdr_md5);
+	if (blocksize != NULL)
+		*blocksize = vh.m_Sectors;
+	ret = 0;
+out:
+	close(fd);
+	return ret;
+}
+
+static int is_check_stamp_valid(const char *img, __u32 *blocksize)
+{
+	struct check_stamp cur, saved;
+
+	if (getxattr(img, CHECK_STAMP_XATTR, &saved, sizeof(saved)) != sizeof(saved))
+		return 0;
+
+	if (get_check_stamp(img, &cur, blocksize))
+		return 0;
+
+	return memcmp(&cur, &saved, sizeof(cur)) == 0;
+}
+
+static void set_check_stamp(const char *img)
+{
+	struct check_stamp stamp;
+
+	if (get_check_stamp(img, &stamp, NULL))
+		return;
+
+	if (setxattr(img, CHECK_STAMP_XATTR, &stamp, sizeof(stamp), 0) &&
+			errno != ENOTSUP)
+		ploop_log(1, "Can't stamp %s: %m", img);
+}
+
+struct check_job {
+	const char *img;
+	int flags;
+	__u32 blocksize;
+	int cbt_allowed;
+	int ret;
+};
+
+struct check_pool {
+	struct check_job *jobs;
+	int n;
+	int next;
+	pthread_mutex_t lock;
+};
+
+static void do_check_job(struct check_job *j)
+{
+	int stamp = (j->flags & CHECK_READONLY) &&
+		!(j->flags & (CHECK_RAW | CHECK_LIVE | CHECK_FORCE));
+
+	if (stamp && is_check_stamp_valid(j->img, &j->blocksize)) {
+		ploop_log(3, "%s: verified clean, check is skipped", j->img);
+		j->cbt_allowed = 1;
+		j->ret = 0;
+		return;
+	}
+
+	j->ret = ploop_check(j->img, j->flags, &j->blocksize, &j->cbt_allowed);
+	if (j->ret == 0 && stamp)
+		set_check_stamp(j->img);
+}
+
+static void *check_thread(void *arg)
+{
+	struct check_pool *p = arg;
+	int i;
+
+	while (1) {
+		pthread_mutex_lock(&p->lock);
+		i = p->next++;
+		pthread_mutex_unlock(&p->lock);
+		if (i >= p->n)
+			break;
+		do_check_job(&p->jobs[i]);
+	}
+
+	return NULL;
+}
+
 int check_deltas(struct ploop_disk_images_data *di, char **images,
 		int raw, __u32 *blocksize, int *cbt_allowed, int flags)
 {
-	int i, f;
+	int i, f, n, nr_threads;
 	int ret = 0;
+	struct check_pool pool = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	pthread_t th[CHECK_THREADS];
 
 	if (cbt_allowed != NULL)
 		*cbt_allowed = 1;
@@ -750,11 +882,17 @@ int check_deltas(struct ploop_disk_images_data *di, char **images,
 	f = flags | CHECK_DETAILED | CHECK_REPAIR_SPARSE |
 		(di ? CHECK_DROPINUSE : 0);
 
-	for (i = 0; images[i] != NULL; i++) {
+	n = get_list_size(images);
+	pool.jobs = calloc(n, sizeof(struct check_job));
+	if (pool.jobs == NULL) {
+		ploop_err(ENOMEM, "Can't allocate check jobs");
+		return SYSEXIT_MALLOC;
+	}
+	pool.n = n;
+
+	for (i = 0; i < n; i++) {
 		int raw_delta = (raw && i == 0);
 		int ro = (images[i+1] != NULL);
-		int delta_cbt_allowed;
-		__u32 cur_blocksize = raw_delta ? *blocksize : 0;
 
 		if (!(flags & CHECK_READONLY)) {
 			if (ro)
@@ -767,27 +905,51 @@ int check_deltas(struct ploop_disk_images_data *di, char **images,
 		else
 			f &= ~CHECK_RAW;
 
-		ret = ploop_check(images[i], f, &cur_blocksize,
-				&delta_cbt_allowed);
+		pool.jobs[i].img = images[i];
+		pool.jobs[i].flags = f;
+		pool.jobs[i].blocksize = raw_delta ? *blocksize : 0;
+	}
+
+	/* deltas are independent, check them concurrently */
+	nr_threads = MIN(n, CHECK_THREADS) - 1;
+	for (i = 0; i < nr_threads; i++) {
+		int err = pthread_create(&th[i], NULL, check_thread, &pool);
+
+		if (err) {
+			ploop_err(err, "Can't create check thread");
+			break;
+		}
+	}
+	nr_threads = i;
+	check_thread(&pool);
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(th[i], NULL);
+
+	for (i = 0; i < n; i++) {
+		struct check_job *j = &pool.jobs[i];
+
+		ret = j->ret;
 		if (ret) {
 			ploop_err(0, "%s : irrecoverable errors (%s)",
-					images[i], ro ? "ro" : "rw");
+					images[i], images[i+1] ? "ro" : "rw");
 			break;
 		}
 
-		if (cbt_allowed != NULL && !delta_cbt_allowed)
+		if (cbt_allowed != NULL && !j->cbt_allowed)
 			*cbt_allowed = 0;
 
 		if (*blocksize == 0)
-			*blocksize = cur_blocksize;
-		if (cur_blocksize != *blocksize) {
+			*blocksize = j->blocksize;
+		if (j->blocksize != *blocksize) {
 			ploop_err(0, "Incorrect blocksize %s bs=%d [current bs=%d]",
-					images[i], *blocksize, cur_blocksize);
+					images[i], *blocksize, j->blocksize);
 			ret = SYSEXIT_PARAM;
 			break;
 		}
 	}
 
+	free(pool.jobs);
+
 	return ret;
 }
 
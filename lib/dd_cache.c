@@ -0,0 +1,351 @@
+/*
+ *  Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Binary cache of the parsed DiskDescriptor.xml.
+ *
+ * The cache is stored next to the descriptor and is valid as long as
+ * the descriptor file identity (device, inode, size, mtime and ctime)
+ * and its directory are the same as at the time the cache was written.
+ * DiskDescriptor.xml remains the only source of truth: the cache is
+ * never updated on its own, a stale or broken one is just ignored and
+ * rewritten by the next XML parse.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define DD_CACHE_MAGIC		0x43444450	/* PDDC */
+#define DD_CACHE_VERSION	2
+#define DD_CACHE_MAX_SIZE	(16 << 20)
+
+struct dd_cache_hdr {
+	__u32 magic;
+	__u32 version;
+	__u32 len;		/* payload length */
+	__u32 crc;		/* payload crc32 */
+	__u32 xml_crc;		/* descriptor crc32 to match the journal */
+	__u32 pad;
+	__u64 dev;
+	__u64 ino;
+	__u64 size;
+	__u64 mtime_sec;
+	__u64 mtime_nsec;
+	__u64 ctime_sec;
+	__u64 ctime_nsec;
+};
+
+struct dd_cache_buf {
+	char *data;
+	__u32 len;
+	__u32 pos;
+	int err;
+};
+
+static void get_dd_cache_fname(const char *xml_fname, char *out, int size)
+{
+	snprintf(out, size, "%s.cache", xml_fname);
+}
+
+static void fill_hdr(struct dd_cache_hdr *h, const struct stat *st)
+{
+	h->magic = DD_CACHE_MAGIC;
+	h->version = DD_CACHE_VERSION;
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->size = st->st_size;
+	h->mtime_sec = st->st_mtim.tv_sec;
+	h->mtime_nsec = st->st_mtim.tv_nsec;
+	h->ctime_sec = st->st_ctim.tv_sec;
+	h->ctime_nsec = st->st_ctim.tv_nsec;
+}
+
+static void put(struct dd_cache_buf *b, const void *data, __u32 len)
+{
+	char *t;
+
+	if (b->err)
+		return;
+
+	if (b->pos + len > b->len) {
+		__u32 n = MAX(b->len * 2, b->pos + len + 4096);
+
+		t = realloc(b->data, n);
+		if (t == NULL) {
+			b->err = 1;
+			return;
+		}
+		b->data = t;
+		b->len = n;
+	}
+	memcpy(b->data + b->pos, data, len);
+	b->pos += len;
+}
+
+static void put_u64(struct dd_cache_buf *b, __u64 v)
+{
+	put(b, &v, sizeof(v));
+}
+
+/* NULL is stored as the length of ~0 */
+static void put_str(struct dd_cache_buf *b, const char *s)
+{
+	__u32 len = s ? strlen(s) : ~0U;
+
+	put(b, &len, sizeof(len));
+	if (s)
+		put(b, s, len);
+}
+
+static int get(struct dd_cache_buf *b, void *data, __u32 len)
+{
+	if (b->err || len > b->len - b->pos) {
+		b->err = 1;
+		return -1;
+	}
+	memcpy(data, b->data + b->pos, len);
+	b->pos += len;
+
+	return 0;
+}
+
+static __u64 get_u64(struct dd_cache_buf *b)
+{
+	__u64 v = 0;
+
+	get(b, &v, sizeof(v));
+
+	return v;
+}
+
+/* Returns out or NULL */
+static const char *get_str(struct dd_cache_buf *b, char *out, int size)
+{
+	__u32 len;
+
+	if (get(b, &len, sizeof(len)) || len == ~0U)
+		return NULL;
+	if (len >= size) {
+		b->err = 1;
+		return NULL;
+	}
+	if (get(b, out, len))
+		return NULL;
+	out[len] = '\0';
+
+	return out;
+}
+
+static char *dup_str(struct dd_cache_buf *b)
+{
+	char s[PATH_MAX];
+
+	return get_str(b, s, sizeof(s)) ? strdup(s) : NULL;
+}
+
+static void serialize_dd(struct dd_cache_buf *b,
+		struct ploop_disk_images_data *di, const char *basedir)
+{
+	int i;
+
+	put_str(b, basedir);
+	put_u64(b, di->size);
+	put_u64(b, di->max_delta_size);
+	put_u64(b, di->cylinders);
+	put_u64(b, di->heads);
+	put_u64(b, di->sectors);
+	put_u64(b, di->blocksize);
+	put_u64(b, di->mode);
+	put_str(b, di->top_guid);
+	put_str(b, di->enc ? di->enc->keyid : NULL);
+
+	put_u64(b, di->vol != NULL);
+	if (di->vol) {
+		put_str(b, di->vol->parent);
+		put_str(b, di->vol->snap_guid);
+		put_u64(b, di->vol->ro);
+	}
+
+	put_u64(b, di->nimages);
+	for (i = 0; i < di->nimages; i++) {
+		put_str(b, di->images[i]->file);
+		put_str(b, di->images[i]->guid);
+	}
+
+	put_u64(b, di->nsnapshots);
+	for (i = 0; i < di->nsnapshots; i++) {
+		put_str(b, di->snapshots[i]->guid);
+		put_str(b, di->snapshots[i]->parent_guid);
+		put_u64(b, di->snapshots[i]->temporary);
+	}
+}
+
+static int deserialize_dd(struct dd_cache_buf *b,
+		struct ploop_disk_images_data *di, const char *basedir)
+{
+	char s1[PATH_MAX], s2[PATH_MAX];
+	const char *p1, *p2;
+	__u64 i, n;
+
+	p1 = get_str(b, s1, sizeof(s1));
+	if (p1 == NULL || strcmp(p1, basedir))
+		return -1;
+
+	di->size = get_u64(b);
+	di->max_delta_size = get_u64(b);
+	di->cylinders = get_u64(b);
+	di->heads = get_u64(b);
+	di->sectors = get_u64(b);
+	di->blocksize = get_u64(b);
+	di->mode = get_u64(b);
+	di->top_guid = dup_str(b);
+
+	p1 = get_str(b, s1, sizeof(s1));
+	if (p1 != NULL && set_encryption_keyid(di, p1))
+		return -1;
+
+	if (get_u64(b)) {
+		di->vol = calloc(1, sizeof(struct volume_data));
+		if (di->vol == NULL)
+			return -1;
+		di->vol->parent = dup_str(b);
+		di->vol->snap_guid = dup_str(b);
+		di->vol->ro = get_u64(b);
+	}
+
+	n = get_u64(b);
+	for (i = 0; i < n && !b->err; i++) {
+		p1 = get_str(b, s1, sizeof(s1));
+		p2 = get_str(b, s2, sizeof(s2));
+		if (p1 == NULL || p2 == NULL ||
+				ploop_add_image_entry(di, p1, p2))
+			return -1;
+	}
+
+	n = get_u64(b);
+	for (i = 0; i < n && !b->err; i++) {
+		int temporary;
+
+		p1 = get_str(b, s1, sizeof(s1));
+		p2 = get_str(b, s2, sizeof(s2));
+		temporary = get_u64(b);
+		if (p1 == NULL || p2 == NULL ||
+				ploop_add_snapshot_entry(di, p1, p2, temporary))
+			return -1;
+	}
+
+	return b->err || b->pos != b->len ? -1 : 0;
+}
+
+/* Fill di from the cache of the descriptor with stat st.
+ * Returns 0 on success, -1 if there is no valid cache.
+ */
+int read_dd_cache(struct ploop_disk_images_data *di, const struct stat *st,
+		const char *basedir, __u32 *xml_crc)
+{
+	char fname[PATH_MAX];
+	struct dd_cache_hdr h, cur = {};
+	struct dd_cache_buf b = {};
+	int fd, ret = -1;
+
+	get_dd_cache_fname(di->runtime->xml_fname, fname, sizeof(fname));
+	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	fill_hdr(&cur, st);
+	if (read(fd, &h, sizeof(h)) != sizeof(h) ||
+			h.len > DD_CACHE_MAX_SIZE)
+		goto out;
+
+	cur.len = h.len;
+	cur.crc = h.crc;
+	cur.xml_crc = h.xml_crc;
+	if (memcmp(&h, &cur, sizeof(h)))
+		goto out;
+
+	b.data = malloc(h.len);
+	if (b.data == NULL)
+		goto out;
+	b.len = h.len;
+	if (read(fd, b.data, b.len) != b.len ||
+			ploop_crc32((unsigned char *)b.data, b.len) != h.crc)
+		goto out;
+
+	ret = deserialize_dd(&b, di, basedir);
+	if (ret) {
+		ploop_clear_dd(di);
+	} else {
+		*xml_crc = h.xml_crc;
+		ploop_log(3, "Read %s from cache", di->runtime->xml_fname);
+	}
+out:
+	free(b.data);
+	close(fd);
+
+	return ret;
+}
+
+/* Store the parsed descriptor, errors are not fatal */
+void write_dd_cache(struct ploop_disk_images_data *di, const struct stat *st,
+		const char *basedir, __u32 xml_crc)
+{
+	char fname[PATH_MAX], tmp[PATH_MAX + 16];
+	struct dd_cache_hdr h = {};
+	struct dd_cache_buf b = {};
+	int fd;
+
+	serialize_dd(&b, di, basedir);
+	if (b.err || b.pos > DD_CACHE_MAX_SIZE)
+		goto out;
+
+	fill_hdr(&h, st);
+	h.len = b.pos;
+	h.crc = ploop_crc32((unsigned char *)b.data, b.pos);
+	h.xml_crc = xml_crc;
+
+	get_dd_cache_fname(di->runtime->xml_fname, fname, sizeof(fname));
+	snprintf(tmp, sizeof(tmp), "%s.%d", fname, getpid());
+	fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd == -1)
+		goto out;
+
+	if (write(fd, &h, sizeof(h)) != sizeof(h) ||
+			write(fd, b.data, b.pos) != b.pos) {
+		close(fd);
+		unlink(tmp);
+		goto out;
+	}
+	close(fd);
+
+	/* no fsync: a torn cache fails the crc check */
+	if (rename(tmp, fname))
+		unlink(tmp);
+out:
+	free(b.data);
+}
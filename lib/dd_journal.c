@@ -0,0 +1,545 @@
+/*
+ *  Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Journal of DiskDescriptor.xml changes.
+ *
+ * With PLOOP_DD_JOURNAL set in the environment, snapshot create and
+ * switch append a record of their changes to DiskDescriptor.xml.journal
+ * instead of rewriting the whole XML, and read_dd() replays the records
+ * on top of the parsed XML. The record space is reserved before the
+ * images are changed, so only the append and fdatasync follow. An
+ * existing journal is replayed regardless of the variable. The journal
+ * header holds the size and crc32 of the XML it is based on, so the
+ * journal is void as soon as the XML is stored in full by any other
+ * path: store_diskdescriptor() writes a unique generation comment on
+ * every store, so even a byte-identical descriptor gets a new crc, and
+ * drops the journal once the descriptor itself is replaced. Every
+ * DD_JOURNAL_MAX records it is compacted into the XML.
+ *
+ *	PLOOP_JOURNAL <version> <xml size> <xml crc32>
+ *	<op>
+ *	...
+ *	commit <crc32 of the record op lines>
+ *
+ * where op is one of
+ *	chg <guid> <new guid>
+ *	tmp <guid>
+ *	del <guid>
+ *	add <guid> <parent guid> <image>
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+#define DD_JOURNAL_MAGIC	"PLOOP_JOURNAL"
+#define DD_JOURNAL_VERSION	1
+#define DD_JOURNAL_MAX		32
+#define DD_JOURNAL_MAX_SIZE	(1 << 20)
+
+static void get_dd_journal_fname(const char *xml_fname, char *out, int size)
+{
+	snprintf(out, size, "%s.journal", xml_fname);
+}
+
+void drop_dd_journal(const char *xml_fname)
+{
+	char fname[PATH_MAX];
+
+	get_dd_journal_fname(xml_fname, fname, sizeof(fname));
+	if (unlink(fname) && errno != ENOENT)
+		ploop_err(errno, "Can't unlink %s", fname);
+}
+
+static void journal_add(struct dd_journal_rec *rec, const char *fmt, ...)
+{
+	va_list ap;
+	int n, len = sizeof(rec->buf) - rec->len;
+
+	if (rec->err)
+		return;
+
+	va_start(ap, fmt);
+	n = vsnprintf(rec->buf + rec->len, len, fmt, ap);
+	va_end(ap);
+	if (n < 0 || n >= len) {
+		rec->err = 1;
+		return;
+	}
+	rec->len += n;
+}
+
+void journal_change_guid(struct dd_journal_rec *rec, const char *guid,
+		const char *new_guid)
+{
+	journal_add(rec, "chg %s %s\n", guid, new_guid);
+}
+
+void journal_set_temporary(struct dd_journal_rec *rec, const char *guid)
+{
+	journal_add(rec, "tmp %s\n", guid);
+}
+
+void journal_remove_image(struct dd_journal_rec *rec, const char *guid)
+{
+	journal_add(rec, "del %s\n", guid);
+}
+
+void journal_add_image(struct dd_journal_rec *rec,
+		struct ploop_disk_images_data *di, const char *fname,
+		const char *guid, const char *parent_guid)
+{
+	char conf[PATH_MAX];
+	char basedir[PATH_MAX];
+	char image[PATH_MAX];
+
+	if (strchr(fname, '\n') != NULL) {
+		rec->err = 1;
+		return;
+	}
+
+	/* relative to the descriptor as in the XML */
+	get_disk_descriptor_fname(di, conf, sizeof(conf));
+	get_basedir(conf, basedir, sizeof(basedir));
+	if (basedir[0] != '\0')
+		normalize_image_name(basedir, fname, image, sizeof(image));
+	else
+		snprintf(image, sizeof(image), "%s", fname);
+
+	journal_add(rec, "add %s %s %s\n", guid, parent_guid, image);
+}
+
+static int apply_op(struct ploop_disk_images_data *di, const char *basedir,
+		const char *op)
+{
+	char guid[64], parent[64];
+	char image[PATH_MAX];
+	int n;
+
+	if (sscanf(op, "chg %63s %63s", guid, parent) == 2) {
+		if (find_snapshot_by_guid(di, guid) == -1)
+			return -1;
+		ploop_di_change_guid(di, guid, parent);
+	} else if (sscanf(op, "tmp %63s", guid) == 1) {
+		if (find_snapshot_by_guid(di, guid) == -1)
+			return -1;
+		ploop_di_set_temporary(di, guid);
+	} else if (sscanf(op, "del %63s", guid) == 1) {
+		if (ploop_di_remove_image(di, guid, 0, NULL))
+			return -1;
+	} else if (sscanf(op, "add %63s %63s %n", guid, parent, &n) == 2) {
+		if (op[n] == '/')
+			snprintf(image, sizeof(image), "%s", op + n);
+		else
+			snprintf(image, sizeof(image), "%s%s", basedir, op + n);
+		if (ploop_di_add_image(di, image, guid, parent))
+			return -1;
+	} else
+		return -1;
+
+	return 0;
+}
+
+static int apply_record(struct ploop_disk_images_data *di,
+		const char *basedir, const char *p, const char *end)
+{
+	char op[PATH_MAX + 160];
+	const char *e;
+
+	for (; p < end; p = e + 1) {
+		e = memchr(p, '\n', end - p);
+		if (e - p >= sizeof(op))
+			return -1;
+		memcpy(op, p, e - p);
+		op[e - p] = '\0';
+		if (apply_op(di, basedir, op)) {
+			ploop_err(0, "Can't apply journal record '%s'", op);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/* Returns the first record or NULL if the journal is not based on the XML */
+static char *check_journal_header(char *buf, __u64 xml_size, __u32 xml_crc)
+{
+	char *e;
+	unsigned long long size;
+	unsigned int version, crc;
+
+	e = strchr(buf, '\n');
+	if (e == NULL || sscanf(buf, DD_JOURNAL_MAGIC " %u %llu %u",
+				&version, &size, &crc) != 3)
+		return NULL;
+
+	if (version != DD_JOURNAL_VERSION || size != xml_size || crc != xml_crc)
+		return NULL;
+
+	return e + 1;
+}
+
+/* Walk the committed records and apply them to di if it is not NULL.
+ * The walk stops at the first torn record, end is set to its offset.
+ */
+static int walk_journal(char *buf, size_t len, char *p,
+		struct ploop_disk_images_data *di, const char *basedir,
+		int *nr, size_t *end)
+{
+	char *rec = p, *e;
+	unsigned int crc;
+
+	*nr = 0;
+	*end = p - buf;
+	while ((e = memchr(p, '\n', len - (p - buf))) != NULL) {
+		if (strncmp(p, "commit ", 7) == 0) {
+			if (sscanf(p + 7, "%u", &crc) != 1 ||
+					ploop_crc32((unsigned char *)rec, p - rec) != crc)
+				break;
+
+			if (di != NULL && apply_record(di, basedir, rec, p))
+				return -1;
+
+			(*nr)++;
+			rec = e + 1;
+			*end = rec - buf;
+		}
+		p = e + 1;
+	}
+
+	return 0;
+}
+
+static int read_journal(int fd, const char *fname, char **buf, size_t *len)
+{
+	struct stat st;
+
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can't stat %s", fname);
+		return -1;
+	}
+
+	if (st.st_size > DD_JOURNAL_MAX_SIZE) {
+		ploop_err(0, "Journal %s is too big", fname);
+		return -1;
+	}
+
+	*buf = malloc(st.st_size + 1);
+	if (*buf == NULL) {
+		ploop_err(ENOMEM, "Can't read %s", fname);
+		return -1;
+	}
+
+	if (read_safe(fd, *buf, st.st_size, 0, "read journal")) {
+		free(*buf);
+		*buf = NULL;
+		return -1;
+	}
+	(*buf)[st.st_size] = '\0';
+	*len = st.st_size;
+
+	return 0;
+}
+
+/* Apply the journal of the XML with size and crc to the parsed di */
+int replay_dd_journal(struct ploop_disk_images_data *di, const char *basedir,
+		__u64 xml_size, __u32 xml_crc)
+{
+	char fname[PATH_MAX];
+	char *buf = NULL, *p;
+	size_t len, end;
+	int fd, nr, ret;
+
+	get_dd_journal_fname(di->runtime->xml_fname, fname, sizeof(fname));
+	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		ploop_err(errno, "Can't open %s", fname);
+		return -1;
+	}
+
+	ret = read_journal(fd, fname, &buf, &len);
+	close(fd);
+	if (ret)
+		return ret;
+
+	p = check_journal_header(buf, xml_size, xml_crc);
+	if (p != NULL) {
+		ret = walk_journal(buf, len, p, di, basedir, &nr, &end);
+		if (ret == 0 && nr)
+			ploop_log(3, "Replayed %d records of %s", nr, fname);
+	}
+	free(buf);
+
+	return ret;
+}
+
+static int get_dd_crc(const char *fname, __u64 *size, __u32 *crc)
+{
+	char *buf;
+	size_t len;
+	int fd, ret;
+
+	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", fname);
+		return -1;
+	}
+
+	ret = read_journal(fd, fname, &buf, &len);
+	close(fd);
+	if (ret)
+		return ret;
+
+	*size = len;
+	*crc = ploop_crc32((unsigned char *)buf, len);
+	free(buf);
+
+	return 0;
+}
+
+static int create_journal(const char *fname, __u64 xml_size, __u32 xml_crc)
+{
+	char tmp[PATH_MAX + 4];
+	char hdr[128];
+	int fd, n;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fd = open(tmp, O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0600);
+	if (fd == -1) {
+		ploop_err(errno, "Can't create %s", tmp);
+		return -1;
+	}
+
+	n = snprintf(hdr, sizeof(hdr), DD_JOURNAL_MAGIC " %d %llu %u\n",
+			DD_JOURNAL_VERSION, (unsigned long long)xml_size, xml_crc);
+	if (write(fd, hdr, n) != n || fsync(fd)) {
+		ploop_err(errno, "Can't write %s", tmp);
+		goto err;
+	}
+
+	if (rename(tmp, fname)) {
+		ploop_err(errno, "Can't rename %s to %s", tmp, fname);
+		goto err;
+	}
+
+	return fd;
+
+err:
+	close(fd);
+	unlink(tmp);
+
+	return -1;
+}
+
+/* The journal is opt-in: older ploop versions and external tools reading
+ * DiskDescriptor.xml directly don't know about it and would miss the
+ * journaled records.
+ */
+static int dd_journal_enabled(void)
+{
+	return getenv("PLOOP_DD_JOURNAL") != NULL;
+}
+
+/* Open the journal for the record append and reserve the space for it */
+static int open_journal(struct dd_journal_rec *rec, const char *conf)
+{
+	char fname[PATH_MAX];
+	char *buf = NULL, *p = NULL;
+	size_t len, end = 0;
+	__u64 xml_size;
+	__u32 xml_crc;
+	int fd, nr = 0, ret = -1;
+
+	if (get_dd_crc(conf, &xml_size, &xml_crc))
+		return -1;
+
+	get_dd_journal_fname(conf, fname, sizeof(fname));
+	fd = open(fname, O_RDWR|O_CLOEXEC);
+	if (fd != -1) {
+		if (read_journal(fd, fname, &buf, &len))
+			goto err;
+
+		p = check_journal_header(buf, xml_size, xml_crc);
+		if (p != NULL)
+			walk_journal(buf, len, p, NULL, NULL, &nr, &end);
+	} else if (errno != ENOENT) {
+		ploop_err(errno, "Can't open %s", fname);
+		return -1;
+	}
+
+	if (nr >= DD_JOURNAL_MAX) {
+		ploop_log(0, "Compacting %s", fname);
+		goto err;
+	}
+
+	journal_add(rec, "commit %u\n",
+			ploop_crc32((unsigned char *)rec->buf, rec->len));
+	if (rec->err)
+		goto err;
+
+	if (p == NULL) {
+		/* no journal or it is based on another XML */
+		if (fd != -1)
+			close(fd);
+		fd = create_journal(fname, xml_size, xml_crc);
+		if (fd == -1)
+			goto err;
+		end = lseek(fd, 0, SEEK_END);
+	} else if (end != len && ftruncate(fd, end)) {
+		/* cut the torn tail of an interrupted append */
+		ploop_err(errno, "Can't truncate %s", fname);
+		goto err;
+	}
+
+	/* so that the append after the image switch can't run out of space */
+	if (fallocate(fd, FALLOC_FL_KEEP_SIZE, end, rec->len) &&
+			errno != EOPNOTSUPP) {
+		ploop_err(errno, "Can't allocate %s", fname);
+		goto err;
+	}
+
+	rec->fd = fd;
+	rec->end = end;
+	fd = -1;
+	ret = 0;
+
+err:
+	if (fd != -1)
+		close(fd);
+	free(buf);
+
+	return ret;
+}
+
+static int store_dd_tmp(struct ploop_disk_images_data *di, const char *conf)
+{
+	char conf_tmp[PATH_MAX + 4];
+	int ret;
+
+	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
+	ret = ploop_store_diskdescriptor(conf_tmp, di);
+	if (ret && unlink(conf_tmp) && errno != ENOENT)
+		ploop_err(errno, "Can't unlink %s", conf_tmp);
+
+	return ret;
+}
+
+static int rename_dd_tmp(const char *conf)
+{
+	char conf_tmp[PATH_MAX + 4];
+
+	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
+	if (rename(conf_tmp, conf)) {
+		ploop_err(errno, "Can't rename %s %s", conf_tmp, conf);
+		if (unlink(conf_tmp))
+			ploop_err(errno, "Can't unlink %s", conf_tmp);
+		return SYSEXIT_RENAME;
+	}
+
+	/* it is void now as the XML has changed */
+	drop_dd_journal(conf);
+
+	return 0;
+}
+
+/* Prepare the commit of the descriptor changes recorded in rec and already
+ * applied to di. Everything that may fail for lack of space is done here:
+ * the journal is opened and the space for the record is reserved, or the
+ * whole descriptor is stored into a tmp file if the journal can't be used
+ * or is due for compaction. Call it before the changes hit the images,
+ * then commit_dd_journal() or abort_dd_journal().
+ */
+int prepare_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec)
+{
+	char conf[PATH_MAX];
+
+	rec->fd = -1;
+	get_disk_descriptor_fname(di, conf, sizeof(conf));
+	/* volumes share their descriptors with parents and children */
+	if (!rec->err && di->vol == NULL && dd_journal_enabled() &&
+			open_journal(rec, conf) == 0)
+		return 0;
+
+	return store_dd_tmp(di, conf);
+}
+
+/* Append the prepared record, or replace the XML by the tmp one */
+int commit_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec)
+{
+	char conf[PATH_MAX];
+	char fname[PATH_MAX];
+	int ret;
+
+	get_disk_descriptor_fname(di, conf, sizeof(conf));
+	if (rec->fd == -1)
+		return rename_dd_tmp(conf);
+
+	get_dd_journal_fname(conf, fname, sizeof(fname));
+	ploop_log(0, "Storing %s", fname);
+	if (pwrite(rec->fd, rec->buf, rec->len, rec->end) == rec->len &&
+			fdatasync(rec->fd) == 0) {
+		close(rec->fd);
+		rec->fd = -1;
+		return 0;
+	}
+
+	ploop_err(errno, "Can't write %s", fname);
+	if (ftruncate(rec->fd, rec->end))
+		ploop_err(errno, "Can't truncate %s", fname);
+	close(rec->fd);
+	rec->fd = -1;
+
+	/* last resort, the images are already changed */
+	ret = store_dd_tmp(di, conf);
+	if (ret)
+		return ret;
+
+	return rename_dd_tmp(conf);
+}
+
+void abort_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec)
+{
+	char conf[PATH_MAX];
+	char conf_tmp[PATH_MAX + 4];
+
+	if (rec->fd != -1) {
+		close(rec->fd);
+		rec->fd = -1;
+		return;
+	}
+
+	get_disk_descriptor_fname(di, conf, sizeof(conf));
+	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
+	if (unlink(conf_tmp) && errno != ENOENT)
+		ploop_err(errno, "Can't unlink %s", conf_tmp);
+}
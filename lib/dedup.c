@@ -0,0 +1,619 @@
+/*
+ *  Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+#include <string.h>
+
+#include "ploop.h"
+#include "cleanup.h"
+
+#ifndef FIDEDUPERANGE
+#define FILE_DEDUPE_RANGE_SAME		0
+#define FILE_DEDUPE_RANGE_DIFFERS	1
+
+struct file_dedupe_range_info {
+	__s64 dest_fd;
+	__u64 dest_offset;
+	__u64 bytes_deduped;
+	__s32 status;
+	__u32 reserved;
+};
+
+struct file_dedupe_range {
+	__u64 src_offset;
+	__u64 src_length;
+	__u16 dest_count;
+	__u16 reserved1;
+	__u32 reserved2;
+	struct file_dedupe_range_info info[0];
+};
+
+#define FIDEDUPERANGE	_IOWR(0x94, 54, struct file_dedupe_range)
+#endif
+
+/* On-disk index layout:
+ *	struct dedup_index_hdr
+ *	struct dedup_index_file[nr_files]
+ *	struct dedup_entry[nr_entries]
+ */
+#define DEDUP_INDEX_MAGIC	0x3158444450444c50ULL	/* "PLDDPDX1" */
+#define DEDUP_EMPTY		((__u32)-1)
+
+struct dedup_index_hdr {
+	__u64 magic;
+	__u32 nr_files;
+	__u32 cluster;
+	__u64 nr_entries;
+};
+
+struct dedup_index_file {
+	__u64 dev;
+	__u64 ino;
+	__u64 size;
+	__u64 mtime_sec;
+	__u64 mtime_nsec;
+};
+
+struct dedup_entry {
+	__u8 md5[16];
+	__u32 file;
+	__u32 iblk;
+};
+
+struct dedup_file {
+	char *fname;
+	struct dedup_index_file id;
+	int cached;
+};
+
+struct dedup_ctx {
+	struct dedup_file *files;
+	int nr_files;
+	__u32 cluster;
+	struct dedup_entry *table;
+	__u64 table_size;
+	__u64 table_used;
+	int src_fd;
+	int src_file;
+	struct ploop_dedup_param *param;
+	struct ploop_dedup_stat *stat;
+};
+
+static __u64 entry_hash(const __u8 *md5)
+{
+	__u64 h;
+
+	memcpy(&h, md5, sizeof(h));
+
+	return h;
+}
+
+static struct dedup_entry *table_find(struct dedup_ctx *ctx, const __u8 *md5)
+{
+	__u64 mask = ctx->table_size - 1;
+	__u64 i = entry_hash(md5) & mask;
+
+	while (ctx->table[i].file != DEDUP_EMPTY) {
+		if (memcmp(ctx->table[i].md5, md5, 16) == 0)
+			return &ctx->table[i];
+		i = (i + 1) & mask;
+	}
+
+	return NULL;
+}
+
+static void table_put(struct dedup_entry *table, __u64 size,
+		const struct dedup_entry *e)
+{
+	__u64 i = entry_hash(e->md5) & (size - 1);
+
+	while (table[i].file != DEDUP_EMPTY)
+		i = (i + 1) & (size - 1);
+	table[i] = *e;
+}
+
+static int table_resize(struct dedup_ctx *ctx, __u64 size)
+{
+	__u64 i;
+	struct dedup_entry *t;
+
+	t = malloc(size * sizeof(struct dedup_entry));
+	if (t == NULL) {
+		ploop_err(ENOMEM, "Can't allocate dedup table");
+		return SYSEXIT_MALLOC;
+	}
+	for (i = 0; i < size; i++)
+		t[i].file = DEDUP_EMPTY;
+
+	for (i = 0; i < ctx->table_size; i++)
+		if (ctx->table[i].file != DEDUP_EMPTY)
+			table_put(t, size, &ctx->table[i]);
+
+	free(ctx->table);
+	ctx->table = t;
+	ctx->table_size = size;
+
+	return 0;
+}
+
+static int table_add(struct dedup_ctx *ctx, const struct dedup_entry *e)
+{
+	int rc;
+
+	if ((ctx->table_used + 1) * 2 > ctx->table_size) {
+		rc = table_resize(ctx, ctx->table_size * 2);
+		if (rc)
+			return rc;
+	}
+
+	table_put(ctx->table, ctx->table_size, e);
+	ctx->table_used++;
+
+	return 0;
+}
+
+static int add_file(struct dedup_ctx *ctx, const char *fname)
+{
+	int i;
+	struct stat st;
+	struct dedup_file *f;
+
+	if (stat(fname, &st)) {
+		ploop_err(errno, "Can't stat %s", fname);
+		return SYSEXIT_FSTAT;
+	}
+
+	/* the same delta can be shared by several volumes */
+	for (i = 0; i < ctx->nr_files; i++)
+		if (ctx->files[i].id.dev == st.st_dev &&
+				ctx->files[i].id.ino == st.st_ino)
+			return 0;
+
+	f = realloc(ctx->files, (ctx->nr_files + 1) * sizeof(*f));
+	if (f == NULL) {
+		ploop_err(ENOMEM, "realloc");
+		return SYSEXIT_MALLOC;
+	}
+	ctx->files = f;
+	f += ctx->nr_files;
+	memset(f, 0, sizeof(*f));
+	f->fname = strdup(fname);
+	if (f->fname == NULL) {
+		ploop_err(ENOMEM, "strdup");
+		return SYSEXIT_MALLOC;
+	}
+	f->id.dev = st.st_dev;
+	f->id.ino = st.st_ino;
+	f->id.size = st.st_size;
+	f->id.mtime_sec = st.st_mtim.tv_sec;
+	f->id.mtime_nsec = st.st_mtim.tv_nsec;
+	ctx->nr_files++;
+
+	return 0;
+}
+
+static int add_images(struct dedup_ctx *ctx, struct ploop_disk_images_data *di)
+{
+	int i, rc, mounted;
+	char dev[64];
+	const char *top = NULL;
+
+	rc = ploop_find_dev_by_dd(di, dev, sizeof(dev));
+	if (rc == -1)
+		return SYSEXIT_SYS;
+	mounted = (rc == 0);
+	/* top delta of a running image is being changed, skip it */
+	if (mounted)
+		top = find_image_by_guid(di, di->top_guid);
+
+	for (i = 0; i < di->nimages; i++) {
+		if (top != NULL && strcmp(di->images[i]->file, top) == 0) {
+			ploop_log(0, "Skip top delta %s: image is mounted", top);
+			continue;
+		}
+
+		rc = add_file(ctx, di->images[i]->file);
+		if (rc)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* Use hashes of deltas which were not changed since the index was
+ * stored, so unchanged lower deltas are not read again.
+ */
+static int load_index(struct dedup_ctx *ctx, const char *fname)
+{
+	int fd, rc = 0, *map = NULL;
+	__u32 i, j;
+	__u64 n;
+	struct dedup_index_hdr hdr;
+	struct dedup_index_file id;
+	struct dedup_entry e;
+	FILE *fp;
+
+	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		ploop_err(errno, "Can't open %s", fname);
+		return SYSEXIT_OPEN;
+	}
+
+	fp = fdopen(fd, "r");
+	if (fp == NULL) {
+		ploop_err(errno, "fdopen %s", fname);
+		close(fd);
+		return SYSEXIT_OPEN;
+	}
+
+	if (fread(&hdr, sizeof(hdr), 1, fp) != 1 ||
+			hdr.magic != DEDUP_INDEX_MAGIC) {
+		ploop_log(0, "Ignore invalid dedup index %s", fname);
+		goto out;
+	}
+
+	if (hdr.cluster != ctx->cluster) {
+		ploop_log(0, "Ignore dedup index %s: cluster size mismatch",
+				fname);
+		goto out;
+	}
+
+	map = malloc(hdr.nr_files * sizeof(int));
+	if (map == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		rc = SYSEXIT_MALLOC;
+		goto out;
+	}
+
+	for (i = 0; i < hdr.nr_files; i++) {
+		if (fread(&id, sizeof(id), 1, fp) != 1) {
+			ploop_err(0, "Short read %s", fname);
+			goto out;
+		}
+		map[i] = -1;
+		for (j = 0; j < ctx->nr_files; j++) {
+			if (memcmp(&ctx->files[j].id, &id, sizeof(id)) == 0) {
+				ctx->files[j].cached = 1;
+				map[i] = j;
+				break;
+			}
+		}
+	}
+
+	for (n = 0; n < hdr.nr_entries; n++) {
+		if (fread(&e, sizeof(e), 1, fp) != 1) {
+			ploop_err(0, "Short read %s", fname);
+			break;
+		}
+		if (e.file >= hdr.nr_files || map[e.file] == -1)
+			continue;
+		if (table_find(ctx, e.md5) != NULL)
+			continue;
+		e.file = map[e.file];
+		rc = table_add(ctx, &e);
+		if (rc)
+			break;
+	}
+
+out:
+	free(map);
+	fclose(fp);
+
+	return rc;
+}
+
+static int store_index(struct dedup_ctx *ctx, const char *fname)
+{
+	int i, rc = 0;
+	__u64 n;
+	char tmp[PATH_MAX];
+	struct dedup_index_hdr hdr = {
+		.magic = DEDUP_INDEX_MAGIC,
+		.nr_files = ctx->nr_files,
+		.cluster = ctx->cluster,
+		.nr_entries = ctx->table_used,
+	};
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fp = fopen(tmp, "we");
+	if (fp == NULL) {
+		ploop_err(errno, "Can't create %s", tmp);
+		return SYSEXIT_CREAT;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1)
+		goto err;
+
+	for (i = 0; i < ctx->nr_files; i++)
+		if (fwrite(&ctx->files[i].id, sizeof(ctx->files[i].id), 1, fp) != 1)
+			goto err;
+
+	for (n = 0; n < ctx->table_size; n++)
+		if (ctx->table[n].file != DEDUP_EMPTY &&
+				fwrite(&ctx->table[n], sizeof(ctx->table[n]), 1, fp) != 1)
+			goto err;
+
+	if (fflush(fp) || fsync(fileno(fp)))
+		goto err;
+
+	if (fclose(fp)) {
+		fp = NULL;
+		goto err;
+	}
+
+	if (rename(tmp, fname)) {
+		ploop_err(errno, "Can't rename %s %s", tmp, fname);
+		unlink(tmp);
+		return SYSEXIT_RENAME;
+	}
+
+	return 0;
+
+err:
+	ploop_err(errno, "Can't write %s", tmp);
+	rc = SYSEXIT_WRITE;
+	if (fp != NULL)
+		fclose(fp);
+	unlink(tmp);
+
+	return rc;
+}
+
+static int get_src_fd(struct dedup_ctx *ctx, __u32 file)
+{
+	if (ctx->src_file == file)
+		return ctx->src_fd;
+
+	if (ctx->src_fd != -1)
+		close(ctx->src_fd);
+	ctx->src_file = -1;
+	ctx->src_fd = open(ctx->files[file].fname, O_RDONLY|O_CLOEXEC);
+	if (ctx->src_fd == -1) {
+		ploop_err(errno, "Can't open %s", ctx->files[file].fname);
+		return -1;
+	}
+	ctx->src_file = file;
+
+	return ctx->src_fd;
+}
+
+static int dedupe_cluster(struct dedup_ctx *ctx, struct dedup_entry *src,
+		int dst_fd, off_t dst_off)
+{
+	int fd;
+	struct {
+		struct file_dedupe_range r;
+		struct file_dedupe_range_info info;
+	} req = {};
+
+	fd = get_src_fd(ctx, src->file);
+	if (fd == -1)
+		return SYSEXIT_OPEN;
+
+	req.r.src_offset = (__u64)src->iblk * ctx->cluster;
+	req.r.src_length = ctx->cluster;
+	req.r.dest_count = 1;
+	req.info.dest_fd = dst_fd;
+	req.info.dest_offset = dst_off;
+
+	if (ioctl(fd, FIDEDUPERANGE, &req)) {
+		ploop_err(errno, "FIDEDUPERANGE %s",
+				ctx->files[src->file].fname);
+		return SYSEXIT_DEVIOC;
+	}
+
+	if (req.info.status == FILE_DEDUPE_RANGE_SAME)
+		ctx->stat->dedup_bytes += req.info.bytes_deduped;
+	else if (req.info.status < 0)
+		ploop_log(1, "Warning: dedupe of %s offset %llu failed: %d",
+				ctx->files[src->file].fname,
+				(unsigned long long)req.r.src_offset,
+				req.info.status);
+
+	return 0;
+}
+
+static int dedup_delta(struct dedup_ctx *ctx, __u32 file, void *buf)
+{
+	int rc = 0;
+	__u32 clu, n;
+	off_t off;
+	struct delta d = {};
+	struct dedup_entry e, *src;
+
+	if (open_delta(&d, ctx->files[file].fname, O_RDONLY, OD_ALLOW_DIRTY))
+		return SYSEXIT_OPEN;
+
+	if (S2B(d.blocksize) != ctx->cluster) {
+		ploop_err(0, "Cluster size of %s differs from other deltas",
+				ctx->files[file].fname);
+		rc = SYSEXIT_PARAM;
+		goto out;
+	}
+
+	n = ctx->cluster / sizeof(__u32);
+	for (clu = 0; clu < d.l2_size; clu++) {
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
+		__u32 l2_slot = (clu + PLOOP_MAP_OFFSET) % n;
+
+		if (d.l2_cache != l2_cluster) {
+			if (PREAD(&d, d.l2, ctx->cluster, (off_t)l2_cluster * ctx->cluster)) {
+				rc = SYSEXIT_READ;
+				goto out;
+			}
+			d.l2_cache = l2_cluster;
+		}
+
+		if (d.l2[l2_slot] == 0)
+			continue;
+
+		if (is_operation_cancelled()) {
+			rc = SYSEXIT_ABORT;
+			goto out;
+		}
+
+		off = S2B(ploop_ioff_to_sec(d.l2[l2_slot], d.blocksize, d.version));
+		if (PREAD(&d, buf, ctx->cluster, off)) {
+			rc = SYSEXIT_READ;
+			goto out;
+		}
+		ctx->stat->clusters++;
+
+		md5sum(buf, ctx->cluster, e.md5);
+		src = table_find(ctx, e.md5);
+		if (src == NULL) {
+			e.file = file;
+			e.iblk = off / ctx->cluster;
+			rc = table_add(ctx, &e);
+			if (rc)
+				goto out;
+			continue;
+		}
+
+		ctx->stat->dup_clusters++;
+		if (ctx->param->dry)
+			continue;
+
+		rc = dedupe_cluster(ctx, src, d.fd, off);
+		if (rc)
+			goto out;
+	}
+
+out:
+	close_delta(&d);
+
+	return rc;
+}
+
+static int get_cluster(struct ploop_disk_images_data **di, int n, __u32 *cluster)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if (di[i]->blocksize == 0 ||
+				(i > 0 && di[i]->blocksize != di[0]->blocksize)) {
+			ploop_err(0, "Images with different cluster size can not be deduplicated");
+			return SYSEXIT_PARAM;
+		}
+	}
+	*cluster = S2B(di[0]->blocksize);
+
+	return 0;
+}
+
+int ploop_dedup(struct ploop_disk_images_data *di[], int n,
+		struct ploop_dedup_param *param, struct ploop_dedup_stat *stat)
+{
+	int i, rc, locked = 0;
+	void *buf = NULL;
+	struct dedup_ctx ctx = {
+		.src_fd = -1,
+		.src_file = -1,
+		.param = param,
+		.stat = stat,
+	};
+
+	if (n <= 0)
+		return SYSEXIT_PARAM;
+
+	memset(stat, 0, sizeof(*stat));
+	for (locked = 0; locked < n; locked++) {
+		if (ploop_lock_dd(di[locked])) {
+			rc = SYSEXIT_LOCK;
+			goto err;
+		}
+	}
+
+	rc = get_cluster(di, n, &ctx.cluster);
+	if (rc)
+		goto err;
+
+	for (i = 0; i < n; i++) {
+		if (di[i]->runtime->image_fmt != PLOOP_FMT) {
+			ploop_err(0, "Only ploop images can be deduplicated");
+			rc = SYSEXIT_PARAM;
+			goto err;
+		}
+		rc = add_images(&ctx, di[i]);
+		if (rc)
+			goto err;
+	}
+
+	rc = table_resize(&ctx, 1024);
+	if (rc)
+		goto err;
+
+	if (param->index != NULL) {
+		rc = load_index(&ctx, param->index);
+		if (rc)
+			goto err;
+	}
+
+	if (p_memalign(&buf, 4096, ctx.cluster)) {
+		rc = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	for (i = 0; i < ctx.nr_files; i++) {
+		if (ctx.files[i].cached) {
+			ploop_log(0, "Use cached hashes of %s", ctx.files[i].fname);
+			continue;
+		}
+
+		ploop_log(0, "Deduplicate %s", ctx.files[i].fname);
+		rc = dedup_delta(&ctx, i, buf);
+		if (rc)
+			goto err;
+	}
+
+	if (param->index != NULL) {
+		rc = store_index(&ctx, param->index);
+		if (rc)
+			goto err;
+	}
+
+	ploop_log(0, "Deduplication: clusters scanned: %llu duplicated: %llu"
+			" shared: %llu bytes",
+			(unsigned long long)stat->clusters,
+			(unsigned long long)stat->dup_clusters,
+			(unsigned long long)stat->dedup_bytes);
+
+err:
+	for (i = 0; i < locked; i++)
+		ploop_unlock_dd(di[i]);
+	for (i = 0; i < ctx.nr_files; i++)
+		free(ctx.files[i].fname);
+	free(ctx.files);
+	free(ctx.table);
+	free(buf);
+	if (ctx.src_fd != -1)
+		close(ctx.src_fd);
+
+	return rc;
+}
@@ -26,13 +26,18 @@
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/vfs.h>
+#include <sys/time.h>
+#include <stddef.h>
 #include <linux/types.h>
 #include <string.h>
+#include <pthread.h>
 #include <linux/fs.h>
 #include <linux/fiemap.h>
 
 #include "bit_ops.h"
 #include "ploop.h"
+#include "cbt.h"
+#include "cleanup.h"
 
 #ifndef copy_file_range
 ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out,
@@ -43,6 +48,19 @@ ssize_t copy_file_range(int fd_in, loff_t *off_in, int fd_out,
 }
 #endif
 
+/* Number of clusters moved between two commits */
+#define DEFRAG_BATCH		1024
+#define DEFRAG_THREADS		4
+#define BAT_PAGE_SIZE		4096
+
+struct defrag_copy {
+	pthread_t th;
+	struct delta *delta;
+	struct defrag_move *moves;
+	int n;
+	int rc;
+};
+
 static int update_bat(struct delta *delta, __u32 clu, __u32 old, __u32 new)
 {
 	off_t off = sizeof(struct ploop_pvd_header) + (clu * sizeof(__u32));
@@ -54,10 +72,8 @@ static int update_bat(struct delta *delta, __u32 clu, __u32 old, __u32 new)
 			"Cannot update BAT");
 }
 
-static int reallocate_cluster(struct delta *delta, __u32 clu,
-		 __u32 src, __u32 dst)
+static int copy_cluster(struct delta *delta, __u32 clu, __u32 src, __u32 dst)
 {
-	int rc;
 	off_t s, d;
 	__u32 cluster = S2B(delta->blocksize);
 	int len = cluster;
@@ -65,7 +81,7 @@ static int reallocate_cluster(struct delta *delta, __u32 clu,
 	s = (off_t)src * cluster;
 	d = (off_t)dst * cluster;
 
-	ploop_log(0, "Reallocate cluster #%d data from %u/off: %lu to %u/off: %lu",
+	ploop_log(3, "Reallocate cluster #%d data from %u/off: %lu to %u/off: %lu",
 			clu, src, s, dst, d);
 	while (len) {
 		int r = copy_file_range(delta->fd, &s, delta->fd, &d, len, 0);
@@ -78,6 +94,18 @@ static int reallocate_cluster(struct delta *delta, __u32 clu,
 		d += r;
 	}
 
+	return 0;
+}
+
+static int reallocate_cluster(struct delta *delta, __u32 clu,
+		 __u32 src, __u32 dst)
+{
+	int rc;
+
+	rc = copy_cluster(delta, clu, src, dst);
+	if (rc)
+		return rc;
+
 	rc = update_bat(delta, clu, src, dst);
 	if (rc)
 		return rc;
@@ -85,23 +113,157 @@ static int reallocate_cluster(struct delta *delta, __u32 clu,
 	return fsync_safe(delta->fd);
 }
 
+static void *copy_thread(void *arg)
+{
+	int i;
+	struct defrag_copy *c = arg;
+
+	for (i = 0; i < c->n; i++) {
+		c->rc = copy_cluster(c->delta, c->moves[i].clu,
+				c->moves[i].src, c->moves[i].dst);
+		if (c->rc)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Copy the batch data by DEFRAG_THREADS threads, the last slice is
+ * copied by the caller.
+ */
+static int copy_batch(struct delta *delta, struct defrag_move *moves, int n)
+{
+	int i, nr_threads, per_thread, rc = 0;
+	struct defrag_copy c[DEFRAG_THREADS] = {};
+
+	nr_threads = MIN(DEFRAG_THREADS, n);
+	per_thread = (n + nr_threads - 1) / nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		c[i].delta = delta;
+		c[i].moves = moves + i * per_thread;
+		c[i].n = MIN(per_thread, n - i * per_thread);
+	}
+
+	for (i = 0; i < nr_threads - 1; i++) {
+		if (pthread_create(&c[i].th, NULL, copy_thread, &c[i])) {
+			ploop_err(errno, "Can't create copy thread");
+			/* copy the rest of the slices in this thread */
+			break;
+		}
+	}
+	nr_threads = i;
+
+	for (; i < DEFRAG_THREADS && c[i].delta != NULL; i++) {
+		copy_thread(&c[i]);
+		if (c[i].rc)
+			rc = c[i].rc;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(c[i].th, NULL);
+		if (c[i].rc)
+			rc = c[i].rc;
+	}
+
+	return rc;
+}
+
+/* Write the batch BAT entries, one write per modified BAT page */
+static int commit_bat(struct delta *delta, struct defrag_move *moves, int n)
+{
+	int i, rc = 0;
+	off_t off, page = -1;
+	__u32 *buf;
+
+	if (p_memalign((void **)&buf, BAT_PAGE_SIZE, BAT_PAGE_SIZE))
+		return SYSEXIT_MALLOC;
+
+	for (i = 0; i < n; i++) {
+		off = sizeof(struct ploop_pvd_header) + moves[i].clu * sizeof(__u32);
+		if (page != (off & ~(off_t)(BAT_PAGE_SIZE - 1))) {
+			if (page != -1 && write_safe(delta->fd, buf, BAT_PAGE_SIZE,
+						page, "Cannot update BAT")) {
+				rc = SYSEXIT_WRITE;
+				goto out;
+			}
+			page = off & ~(off_t)(BAT_PAGE_SIZE - 1);
+			if (read_safe(delta->fd, buf, BAT_PAGE_SIZE, page,
+						"Cannot read BAT")) {
+				rc = SYSEXIT_READ;
+				goto out;
+			}
+		}
+		buf[(off - page) / sizeof(__u32)] = ploop_sec_to_ioff(
+				(off_t)moves[i].dst * delta->blocksize,
+				delta->blocksize, delta->version);
+	}
+
+	if (page != -1 && write_safe(delta->fd, buf, BAT_PAGE_SIZE, page,
+				"Cannot update BAT"))
+		rc = SYSEXIT_WRITE;
+
+out:
+	free(buf);
+	return rc;
+}
+
+/* A batch is crash safe without a journal: the data is copied to free
+ * clusters and made durable before BAT points to it, and source clusters
+ * are not reused until the BAT update is durable too. After a crash
+ * each BAT entry refers either to the old or to the new copy.
+ */
+int move_batch(struct delta *delta, struct defrag_move *moves, int n)
+{
+	int rc;
+
+	rc = copy_batch(delta, moves, n);
+	if (rc)
+		return rc;
+
+	if (fsync_safe(delta->fd))
+		return SYSEXIT_FSYNC;
+
+	rc = commit_bat(delta, moves, n);
+	if (rc)
+		return rc;
+
+	if (fsync_safe(delta->fd))
+		return SYSEXIT_FSYNC;
+
+	return 0;
+}
+
 static int do_defrag(struct delta *delta,__u64 *hole_bitmap,
 		int hole_bitmap_size, int nr_clusters)
 
 {
-	unsigned int i, rc, dst = 0, n = 0, log;
+	unsigned int i, rc = 0, n = 0, log;
+	__s64 dst = 0;
 	__u32 cluster, off;
 	struct ploop_pvd_header *hdr = (struct ploop_pvd_header *) delta->hdr0;
+	struct defrag_move *moves;
+	int nr_moves = 0;
+
+	moves = malloc(DEFRAG_BATCH * sizeof(struct defrag_move));
+	if (moves == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		return SYSEXIT_MALLOC;
+	}
 
 	log = ploop_fmt_log(delta->version);
 	cluster = S2B(delta->blocksize);
 
+	/* the BAT is read in full before a batch is committed, moved
+	 * clusters are never visited again
+	 */
 	for (i = 0; i < hdr->m_Size; i++) {
 		int l2_cluster = (i + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
 		__u32 l2_slot  = (i + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
 		if (delta->l2_cache != l2_cluster) {
-			if (PREAD(delta, delta->l2, cluster, (off_t)l2_cluster * cluster))
-				return -1;
+			if (PREAD(delta, delta->l2, cluster, (off_t)l2_cluster * cluster)) {
+				rc = SYSEXIT_READ;
+				goto out;
+			}
 			delta->l2_cache = l2_cluster;
 		}
 
@@ -119,19 +281,42 @@ static int do_defrag(struct delta *delta,__u64 *hole_bitmap,
 		}
 		if (dst > off) 
 			continue;
-		rc = reallocate_cluster(delta, i, off, dst);
-		if (rc)
-			return rc;
-		
+
+		moves[nr_moves].clu = i;
+		moves[nr_moves].src = off;
+		moves[nr_moves].dst = dst;
+		if (++nr_moves == DEFRAG_BATCH) {
+			rc = move_batch(delta, moves, nr_moves);
+			if (rc)
+				goto out;
+			n += nr_moves;
+			nr_moves = 0;
+			ploop_log(0, "cluster defragmentation: reallocated: %d", n);
+			if (is_operation_cancelled()) {
+				rc = SYSEXIT_ABORT;
+				goto out;
+			}
+		}
+
 		dst++;
-		n++;
 	}
 
+	if (nr_moves) {
+		rc = move_batch(delta, moves, nr_moves);
+		if (rc)
+			goto out;
+		n += nr_moves;
+	}
+
+out:
+	delta->l2_cache = -1;
+	free(moves);
+
 	if (n)
 		ploop_log(0, "cluster defragmentation: total: %d allocated: %d reallocated: %d",
 				hdr->m_Size, nr_clusters, n);
 
-	return 0;
+	return rc;
 }
 
 int build_hole_bitmap(struct delta *delta, __u64 **hole_bitmap,
@@ -221,16 +406,64 @@ int build_alloc_bitmap(struct delta *delta, __u64 **bitmap,
 	return 0;
 }
 
+/* Number of physically contiguous runs met while reading allocated
+ * clusters in virtual order, 1 for a linear image.
+ */
+int calc_fragmentation(struct delta *delta, __u32 *runs)
+{
+	__u32 clu, cluster, off, prev = 0;
+	int log = ploop_fmt_log(delta->version);
+
+	*runs = 0;
+	cluster = S2B(delta->blocksize);
+	for (clu = 0; clu < delta->l2_size; clu++) {
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
+		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+		if (delta->l2_cache != l2_cluster) {
+			if (PREAD(delta, delta->l2, cluster, (off_t)l2_cluster * cluster))
+				return SYSEXIT_READ;
+			delta->l2_cache = l2_cluster;
+		}
+
+		off = delta->l2[l2_slot] >> log;
+		if (off == 0)
+			continue;
+		if (prev == 0 || off != prev + 1)
+			(*runs)++;
+		prev = off;
+	}
+	delta->l2_cache = -1;
+
+	return 0;
+}
+
+/* Format extension blocks are not mapped by BAT but are not free */
+static void mask_ext_blocks(struct delta *delta, __u64 *hole_bitmap,
+		__u32 hole_bitmap_size)
+{
+	__u32 clu;
+	struct ploop_pvd_header *vh = (struct ploop_pvd_header *)delta->hdr0;
+
+	if (vh->m_DiskInUse != SIGNATURE_DISK_CLOSED_V21 ||
+			vh->m_FormatExtensionOffset == 0)
+		return;
+
+	for (clu = vh->m_FormatExtensionOffset / delta->blocksize;
+			clu < hole_bitmap_size; clu++)
+		BMAP_CLR(hole_bitmap, clu);
+}
+
 int image_defrag(struct delta *delta)
 {
-	int rc = 0, nr_clusters;
+	int rc = 0, nr_clusters = 0;
 	__u32 hole_bitmap_size;
-	__u64 *hole_bitmap;
+	__u64 *hole_bitmap = NULL;
 
 	rc = build_hole_bitmap(delta, &hole_bitmap,
 			&hole_bitmap_size, &nr_clusters);
 	if (rc || nr_clusters == 0)
 		goto err;
+	mask_ext_blocks(delta, hole_bitmap, hole_bitmap_size);
 	rc = do_defrag(delta, hole_bitmap, hole_bitmap_size, nr_clusters);
 err:
 	free(hole_bitmap);
@@ -248,6 +481,247 @@ int ploop_image_defrag(const char *image, int flags)
 		return rc;
 
 	rc = image_defrag(&d);
+	if (rc == 0 && delta_save_alloc_summary(&d))
+		ploop_err(0, "Warning: saving allocation summary failed");
+	close_delta(&d);
+
+	return rc;
+}
+
+struct linearize_ctx {
+	struct delta *delta;
+	__u64 *hole_bitmap;
+	__u32 hole_bitmap_size;
+	__u32 *map;		/* virtual -> image cluster */
+	__u32 *rmap;		/* image cluster -> virtual + 1 */
+	__u32 rmap_size;
+	__u32 tail;		/* first cluster past the image end */
+};
+
+static int linearize_set_rmap(struct linearize_ctx *ctx, __u32 clu, __u32 val)
+{
+	if (clu >= ctx->rmap_size) {
+		__u32 n = MAX(clu + 1, ctx->rmap_size * 2);
+		__u32 *p = realloc(ctx->rmap, n * sizeof(__u32));
+
+		if (p == NULL) {
+			ploop_err(ENOMEM, "realloc");
+			return SYSEXIT_MALLOC;
+		}
+		memset(p + ctx->rmap_size, 0, (n - ctx->rmap_size) * sizeof(__u32));
+		ctx->rmap = p;
+		ctx->rmap_size = n;
+	}
+	ctx->rmap[clu] = val;
+
+	if (clu < ctx->hole_bitmap_size) {
+		if (val)
+			BMAP_CLR(ctx->hole_bitmap, clu);
+		else
+			BMAP_SET(ctx->hole_bitmap, clu);
+	}
+
+	return 0;
+}
+
+static int linearize_move(struct linearize_ctx *ctx, struct defrag_move *m,
+		__u32 clu, __u32 dst)
+{
+	int rc;
+	__u32 src = ctx->map[clu];
+
+	m->clu = clu;
+	m->src = src;
+	m->dst = dst;
+	ctx->map[clu] = dst;
+
+	rc = linearize_set_rmap(ctx, dst, clu + 1);
+	if (rc)
+		return rc;
+
+	return linearize_set_rmap(ctx, src, 0);
+}
+
+/* Place allocated clusters at l1_size, l1_size + 1, ... in virtual order.
+ * Targets are processed in windows of DEFRAG_BATCH: clusters occupying
+ * the targets are evicted into holes past the window and committed, then
+ * the window is filled and committed, so a batch only writes to clusters
+ * which were free when it started. At most max_moves clusters are moved,
+ * 0 means no limit.
+ */
+static int do_linearize(struct linearize_ctx *ctx, __u32 max_moves,
+		__u32 *moved)
+{
+	int rc = 0, i, n, nr_evict;
+	__u32 v = 0, t, occ, *pending, *target;
+	__s64 hole;
+	struct delta *delta = ctx->delta;
+	struct defrag_move *evict, *place;
+
+	pending = malloc(DEFRAG_BATCH * sizeof(__u32));
+	target = malloc(DEFRAG_BATCH * sizeof(__u32));
+	evict = malloc(DEFRAG_BATCH * sizeof(struct defrag_move));
+	place = malloc(DEFRAG_BATCH * sizeof(struct defrag_move));
+	if (pending == NULL || target == NULL || evict == NULL || place == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		rc = SYSEXIT_MALLOC;
+		goto out;
+	}
+
+	*moved = 0;
+	t = delta->l1_size;
+	while (v < delta->l2_size) {
+		/* collect the window, each target may cost two moves */
+		for (n = 0; v < delta->l2_size && n < DEFRAG_BATCH; v++) {
+			if (ctx->map[v] == 0)
+				continue;
+			if (ctx->map[v] != t) {
+				if (max_moves && *moved + 2 * (n + 1) > max_moves)
+					break;
+				pending[n] = v;
+				target[n++] = t;
+			}
+			t++;
+		}
+		if (n == 0) {
+			if (v < delta->l2_size)
+				break;	/* out of budget */
+			continue;
+		}
+
+		nr_evict = 0;
+		for (i = 0; i < n; i++) {
+			occ = target[i] < ctx->rmap_size ? ctx->rmap[target[i]] : 0;
+			if (occ == 0)
+				continue;
+
+			hole = BitFindNextSet64(ctx->hole_bitmap,
+					ctx->hole_bitmap_size, target[n - 1] + 1);
+			rc = linearize_move(ctx, &evict[nr_evict++], occ - 1,
+					hole == -1 ? ctx->tail++ : (__u32)hole);
+			if (rc)
+				goto out;
+		}
+		if (nr_evict) {
+			rc = move_batch(delta, evict, nr_evict);
+			if (rc)
+				goto out;
+		}
+
+		for (i = 0; i < n; i++) {
+			rc = linearize_move(ctx, &place[i], pending[i], target[i]);
+			if (rc)
+				goto out;
+		}
+		rc = move_batch(delta, place, n);
+		if (rc)
+			goto out;
+
+		*moved += nr_evict + n;
+		ploop_log(0, "linearize: moved %u clusters", *moved);
+		if (is_operation_cancelled()) {
+			rc = SYSEXIT_ABORT;
+			goto out;
+		}
+	}
+
+out:
+	free(pending);
+	free(target);
+	free(evict);
+	free(place);
+
+	return rc;
+}
+
+int ploop_image_linearize(const char *image, unsigned int max_moves)
+{
+	int rc, log, nr_clusters = 0;
+	__u32 clu, off, cluster, moved = 0, runs, data_end;
+	struct delta d = {};
+	struct ploop_pvd_header *vh;
+	struct linearize_ctx ctx = {.delta = &d};
+
+	rc = open_delta(&d, image, O_RDWR, OD_ALLOW_DIRTY);
+	if (rc)
+		return rc;
+
+	vh = (struct ploop_pvd_header *)d.hdr0;
+	if (vh->m_DiskInUse == SIGNATURE_DISK_IN_USE) {
+		ploop_err(0, "Image %s is in use", image);
+		rc = SYSEXIT_PARAM;
+		goto out;
+	}
+	/* the summary is stored anew below, do not keep the tail for it */
+	delta_drop_alloc_summary(&d);
+
+	rc = build_hole_bitmap(&d, &ctx.hole_bitmap, &ctx.hole_bitmap_size,
+			&nr_clusters);
+	if (rc || nr_clusters == 0)
+		goto out;
+	mask_ext_blocks(&d, ctx.hole_bitmap, ctx.hole_bitmap_size);
+	/* clusters past the end are appended at ctx.tail only */
+	for (clu = d.alloc_head; clu < ctx.hole_bitmap_size; clu++)
+		BMAP_CLR(ctx.hole_bitmap, clu);
+
+	ctx.tail = d.alloc_head;
+	ctx.rmap_size = MAX(d.alloc_head, ctx.hole_bitmap_size);
+	ctx.rmap = calloc(ctx.rmap_size, sizeof(__u32));
+	ctx.map = calloc(d.l2_size, sizeof(__u32));
+	if (ctx.rmap == NULL || ctx.map == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		rc = SYSEXIT_MALLOC;
+		goto out;
+	}
+
+	log = ploop_fmt_log(d.version);
+	cluster = S2B(d.blocksize);
+	for (clu = 0; clu < d.l2_size; clu++) {
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
+		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+		if (d.l2_cache != l2_cluster) {
+			if (PREAD(&d, d.l2, cluster, (off_t)l2_cluster * cluster)) {
+				rc = SYSEXIT_READ;
+				goto out;
+			}
+			d.l2_cache = l2_cluster;
+		}
+
+		off = d.l2[l2_slot] >> log;
+		if (off == 0 || off >= ctx.rmap_size)
+			continue;
+		ctx.map[clu] = off;
+		ctx.rmap[off] = clu + 1;
+	}
+	d.l2_cache = -1;
+
+	rc = do_linearize(&ctx, max_moves, &moved);
+	if (rc)
+		goto out;
+
+	/* drop the free tail unless the format extension is kept there */
+	if (!(vh->m_DiskInUse == SIGNATURE_DISK_CLOSED_V21 &&
+				vh->m_FormatExtensionOffset != 0)) {
+		for (data_end = ctx.rmap_size; data_end > d.l1_size &&
+				ctx.rmap[data_end - 1] == 0; data_end--);
+		if (data_end < ctx.tail && ftruncate(d.fd, (off_t)data_end * cluster)) {
+			ploop_err(errno, "Can't truncate %s", image);
+			rc = SYSEXIT_FTRUNCATE;
+			goto out;
+		}
+	}
+
+	if (calc_fragmentation(&d, &runs) == 0)
+		ploop_log(0, "Image %s linearized: moved %u clusters, %u runs",
+				image, moved, runs);
+
+	if (delta_save_alloc_summary(&d))
+		ploop_err(0, "Warning: saving allocation summary failed");
+
+out:
+	free(ctx.map);
+	free(ctx.rmap);
+	free(ctx.hole_bitmap);
 	close_delta(&d);
 
 	return rc;
@@ -300,3 +774,287 @@ err:
 
 	return rc;
 }
+
+/* Clusters moved per update_delta_index message */
+#define TAIL_BATCH		256
+
+static int update_index_batch(const char *dev, int level,
+		struct defrag_move *moves, int n)
+{
+	int i, rc;
+	struct grow_maps gm = {};
+
+	gm.ctl = malloc(offsetof(struct ploop_index_update_ctl, rmap[n]));
+	if (gm.ctl == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		return SYSEXIT_MALLOC;
+	}
+
+	gm.ctl->n_maps = n;
+	for (i = 0; i < n; i++) {
+		gm.ctl->rmap[i].req_cluster = moves[i].clu;
+		gm.ctl->rmap[i].iblk = moves[i].dst;
+	}
+
+	rc = update_delta_index(dev, level, &gm);
+	free(gm.ctl);
+
+	return rc ? SYSEXIT_DEVIOC : 0;
+}
+
+static void throttle(struct timeval *start, __u64 bytes, __u64 rate)
+{
+	struct timeval now;
+	__u64 elapsed, expected;
+
+	if (rate == 0)
+		return;
+
+	gettimeofday(&now, NULL);
+	elapsed = (now.tv_sec - start->tv_sec) * 1000000ULL +
+		now.tv_usec - start->tv_usec;
+	expected = bytes * 1000000ULL / rate;
+	if (expected > elapsed)
+		usleep(expected - elapsed);
+}
+
+/* Move allocated clusters from the tail of a read-only delta of the
+ * running device into holes and truncate the image. The kernel keeps
+ * reading the old copy until update_delta_index switches it, and the
+ * old copy is not overwritten, so the image is consistent at any time.
+ */
+static int compact_delta_tail(const char *dev, int level, const char *image,
+		struct ploop_online_compact_param *param, __u64 *freed)
+{
+	int rc, log, nr_clusters = 0, nr_moves = 0;
+	__u32 clu, off, cluster, size, lo, hi, data_end;
+	__s64 hole;
+	__u32 *rmap = NULL;
+	__u64 *hole_bitmap = NULL, moved = 0;
+	struct defrag_move *moves = NULL;
+	struct delta d = {};
+	struct timeval start;
+
+	rc = open_delta(&d, image, O_RDWR, OD_ALLOW_DIRTY);
+	if (rc)
+		return rc;
+
+	if (delta_drop_alloc_summary(&d)) {
+		ploop_log(0, "Skip %s: image has format extension", image);
+		goto out;
+	}
+
+	rc = build_hole_bitmap(&d, &hole_bitmap, &size, &nr_clusters);
+	if (rc || nr_clusters == 0)
+		goto out;
+
+	data_end = d.alloc_head;
+	rmap = calloc(data_end, sizeof(__u32));
+	moves = malloc(TAIL_BATCH * sizeof(struct defrag_move));
+	if (rmap == NULL || moves == NULL) {
+		ploop_err(ENOMEM, "malloc");
+		rc = SYSEXIT_MALLOC;
+		goto out;
+	}
+
+	/* reverse map: image cluster -> virtual cluster + 1 */
+	log = ploop_fmt_log(d.version);
+	cluster = S2B(d.blocksize);
+	for (clu = 0; clu < d.l2_size; clu++) {
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
+		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+		if (d.l2_cache != l2_cluster) {
+			if (PREAD(&d, d.l2, cluster, (off_t)l2_cluster * cluster)) {
+				rc = SYSEXIT_READ;
+				goto out;
+			}
+			d.l2_cache = l2_cluster;
+		}
+
+		off = d.l2[l2_slot] >> log;
+		if (off != 0 && off < data_end)
+			rmap[off] = clu + 1;
+	}
+	d.l2_cache = -1;
+
+	gettimeofday(&start, NULL);
+	lo = d.l1_size;
+	hi = data_end;
+	while (1) {
+		while (hi > lo && rmap[hi - 1] == 0)
+			hi--;
+
+		hole = BitFindNextSet64(hole_bitmap, size, lo);
+		if (hole == -1 || hole >= hi - 1)
+			break;
+		lo = hole;
+
+		moves[nr_moves].clu = rmap[hi - 1] - 1;
+		moves[nr_moves].src = hi - 1;
+		moves[nr_moves].dst = lo;
+		rmap[lo] = rmap[hi - 1];
+		rmap[hi - 1] = 0;
+		BMAP_CLR(hole_bitmap, lo);
+
+		if (++nr_moves < TAIL_BATCH)
+			continue;
+
+		rc = move_batch(&d, moves, nr_moves);
+		if (rc)
+			goto out;
+		rc = update_index_batch(dev, level, moves, nr_moves);
+		if (rc)
+			goto out;
+		moved += nr_moves;
+		nr_moves = 0;
+
+		if ((param->stop && *param->stop) || is_operation_cancelled()) {
+			rc = SYSEXIT_ABORT;
+			goto out;
+		}
+		throttle(&start, moved * cluster, param->rate);
+	}
+
+	if (nr_moves) {
+		rc = move_batch(&d, moves, nr_moves);
+		if (rc)
+			goto out;
+		rc = update_index_batch(dev, level, moves, nr_moves);
+		if (rc)
+			goto out;
+		moved += nr_moves;
+	}
+
+	while (hi > lo && rmap[hi - 1] == 0)
+		hi--;
+	if (hi == data_end)
+		goto out;
+
+	/* wait for in-flight reads of the old copies */
+	rc = dm_suspend(dev);
+	if (rc)
+		goto out;
+	dm_resume(dev);
+
+	if (ftruncate(d.fd, (off_t)hi * cluster)) {
+		ploop_err(errno, "Can't truncate %s", image);
+		rc = SYSEXIT_FTRUNCATE;
+		goto out;
+	}
+
+	*freed += (__u64)(data_end - hi) * cluster;
+	ploop_log(0, "Compacted %s: relocated %llu clusters, truncated %u clusters",
+			image, (unsigned long long)moved, data_end - hi);
+
+out:
+	free(moves);
+	free(rmap);
+	free(hole_bitmap);
+	close_delta(&d);
+
+	return rc;
+}
+
+/* Returns 1 if a device other than dev may read the delta */
+static int is_delta_shared(const char *dev, const char *base,
+		const char *delta)
+{
+	int i, level, rc;
+	char **devs = NULL;
+
+	rc = find_devs_by_delta(NULL, base, &devs);
+	if (rc == 1)
+		return 0;
+	else if (rc)
+		return 1;
+
+	for (i = 0; devs[i] != NULL; i++) {
+		if (strcmp(devs[i], dev) == 0)
+			continue;
+		if (find_level_by_delta(devs[i], delta, &level) == 0) {
+			rc = 1;
+			break;
+		}
+	}
+	ploop_free_array(devs);
+
+	return rc;
+}
+
+int ploop_compact_online(struct ploop_disk_images_data *di,
+		struct ploop_online_compact_param *param)
+{
+	int i, rc, ret, level;
+	char dev[64];
+	char snap[UUID_SIZE] = "";
+	const char *top, *base;
+	__u64 freed = 0;
+
+	if (ploop_lock_dd(di))
+		return SYSEXIT_LOCK;
+
+	rc = ploop_find_dev_by_dd(di, dev, sizeof(dev));
+	if (rc == -1) {
+		rc = SYSEXIT_SYS;
+		goto out;
+	} else if (rc != 0) {
+		ploop_err(0, "Image is not mounted, use offline defrag");
+		rc = SYSEXIT_PARAM;
+		goto out;
+	}
+
+	/* The kernel allocates in the top delta, only read-only deltas
+	 * may be changed under the running device. The top delta is made
+	 * read-only by a temporary snapshot merged back at the end.
+	 */
+	if (param->top) {
+		rc = ploop_uuid_generate(snap, sizeof(snap));
+		if (rc)
+			goto out;
+		rc = do_create_snapshot(di, snap, NULL, NULL, SNAP_TYPE_TEMPORARY);
+		if (rc)
+			goto out;
+	}
+
+	top = find_image_by_guid(di, di->top_guid);
+	base = find_image_by_guid(di, get_base_delta_uuid(di));
+	for (i = 0; i < di->nimages; i++) {
+		const char *image = di->images[i]->file;
+
+		if (top != NULL && strcmp(image, top) == 0)
+			continue;
+
+		/* deltas of the parent volume are shared by its clones */
+		if (di->images[i]->alien)
+			continue;
+
+		if (base == NULL || is_delta_shared(dev, base, image)) {
+			ploop_log(0, "Skip %s: delta is used by another device",
+					image);
+			continue;
+		}
+
+		rc = find_level_by_delta(dev, image, &level);
+		if (rc)
+			break;
+
+		rc = compact_delta_tail(dev, level, image, param, &freed);
+		if (rc)
+			break;
+	}
+
+	if (snap[0] != '\0' && find_snapshot_by_guid(di, snap) != -1) {
+		ret = ploop_delete_snapshot_by_guid(di, snap, NULL, 0);
+		if (ret && rc == 0)
+			rc = ret;
+	}
+
+	if (rc == 0)
+		ploop_log(0, "Online compaction freed %llu bytes",
+				(unsigned long long)freed);
+
+out:
+	ploop_unlock_dd(di);
+
+	return rc;
+}
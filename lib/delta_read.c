@@ -26,8 +26,10 @@
 #include <malloc.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <linux/falloc.h>
 
 #include "ploop.h"
+#include "cbt.h"
 
 void init_delta_array(struct delta_array * p)
 {
@@ -218,12 +220,18 @@ static int change_delta_state(struct delta * delta, __u32 m_DiskInUse)
 	}
 	if (fsync(delta->fd))
 		return -1;
+	((struct ploop_pvd_header *)delta->hdr0)->m_DiskInUse = m_DiskInUse;
 	return 0;
 }
 
 int dirty_delta(struct delta * delta)
 {
-	int rc = change_delta_state(delta, SIGNATURE_DISK_IN_USE);
+	int rc;
+
+	/* the summary would be stale and its block stranded by appends */
+	delta_drop_alloc_summary(delta);
+
+	rc = change_delta_state(delta, SIGNATURE_DISK_IN_USE);
 
 	if (!rc)
 		delta->dirtied = 2;
@@ -310,34 +318,79 @@ int read_size_from_image(const char *img_name, int raw, off_t * res)
 	return 0;
 }
 
+/* Zero n clusters starting from start, the file is extended if needed */
+int zero_clusters(struct delta *delta, __u32 start, __u32 n)
+{
+	__u64 cluster = S2B(delta->blocksize);
+	void *buf;
+	__u32 i;
+
+	if (n == 0)
+		return 0;
+
+	if (fallocate(delta->fd, FALLOC_FL_ZERO_RANGE, (off_t)start * cluster,
+				(off_t)n * cluster) == 0)
+		return 0;
+
+	if (errno != EOPNOTSUPP) {
+		ploop_err(errno, "Can't zero clusters %u..%u", start, start + n);
+		return SYSEXIT_WRITE;
+	}
+
+	if (p_memalign(&buf, 4096, cluster))
+		return SYSEXIT_MALLOC;
+	memset(buf, 0, cluster);
+
+	for (i = start; i < start + n; i++) {
+		if (WRITE(delta, buf, cluster, (off_t)i * cluster)) {
+			ploop_err(errno, "Can't zero cluster %u", i);
+			free(buf);
+			return SYSEXIT_WRITE;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
+static int cmp_move_clu(const void *a, const void *b)
+{
+	const struct defrag_move *x = a, *y = b;
+
+	return x->clu < y->clu ? -1 : (x->clu > y->clu ? 1 : 0);
+}
+
 /*
+ * Move data blocks [first, last) to the end of the image in one pass:
+ * find their owners with a single index scan, copy them in parallel and
+ * commit the index once.
+ *
  * delta: output delta
- * iblk: iblock number of block to relocate
- * buf: a buffer of S2B(blocksize) bytes
- * map: if not NULL, will be filled with <req_cluster, iblk> of
- *	relocated block
+ * rmap: array of (last - first) entries, filled with owner cluster + 1
+ *	of each block or 0 if the block is not used
+ * map: if not NULL, filled with <req_cluster, iblk> of relocated blocks
  *
- * Returns 0 if requested block not found in L2 table, otherwise 1.
- *	   -1 on error
+ * Returns number of relocated blocks or -1 on error
  */
-static int relocate_block(struct delta *delta, __u32 iblk, void *buf,
-			  struct reloc_map *map)
+static int relocate_blocks(struct delta *delta, __u32 first, __u32 last,
+		__u32 *rmap, struct reloc_map *map)
 {
-	int   l2_cluster = 0;
-	__u32 l2_slot = 0;
-	__u32 clu = 0;
+	struct defrag_move *moves = NULL;
 	__u64 cluster = S2B(delta->blocksize);
+	int n = cluster / sizeof(__u32);
+	__u32 clu, i;
+	int nr = 0;
 
 	assert(cluster);
 
+	memset(rmap, 0, (last - first) * sizeof(__u32));
 	for (clu = 0; clu < delta->l2_size; clu++) {
-		int n = cluster / sizeof(__u32);
-
-		l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
-		l2_slot	   = (clu + PLOOP_MAP_OFFSET) % n;
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
+		__u32 l2_slot = (clu + PLOOP_MAP_OFFSET) % n;
+		__u32 iblk;
 
 		if (l2_cluster >= delta->l1_size) {
-			ploop_err(0, "abort: relocate_block l2_cluster >= delta->l1_size");
+			ploop_err(0, "abort: relocate_blocks l2_cluster >= delta->l1_size");
 			return -1;
 		}
 
@@ -350,53 +403,70 @@ static int relocate_block(struct delta *delta, __u32 iblk, void *buf,
 			delta->l2_cache = l2_cluster;
 		}
 
-		if (delta->l2[l2_slot] == ploop_sec_to_ioff((off_t)iblk * delta->blocksize,
-					delta->blocksize, delta->version))
-			break;
-	}
+		if (delta->l2[l2_slot] == 0)
+			continue;
 
-	if (clu >= delta->l2_size)
-		return 0; /* found nothing */
-
-	if (READ(delta, buf, cluster, S2B(ploop_ioff_to_sec(delta->l2[l2_slot],
-						delta->blocksize, delta->version)))) {
-		ploop_err(errno, "Can't read block to relocate");
-		return -1;
+		iblk = ploop_ioff_to_sec(delta->l2[l2_slot], delta->blocksize,
+				delta->version) / delta->blocksize;
+		if (iblk >= first && iblk < last) {
+			rmap[iblk - first] = clu + 1;
+			nr++;
+		}
 	}
+	delta->l2_cache = -1;
 
-	__u32 o =  delta->l2[l2_slot];
-	delta->l2[l2_slot] = ploop_sec_to_ioff((off_t)delta->alloc_head++ * delta->blocksize,
-			delta->blocksize, delta->version);
+	if (nr == 0)
+		return 0;
 
-	ploop_log(0, "Reallocate block %d -> %d", o, delta->l2[l2_slot]);
-	if (delta->l2[l2_slot] == 0) {
-		ploop_err(0, "relocate_block: delta->l2[l2_slot] == 0");
+	moves = malloc(nr * sizeof(struct defrag_move));
+	if (moves == NULL) {
+		ploop_err(ENOMEM, "Can't allocate relocation map");
 		return -1;
 	}
 
-	if (WRITE(delta, buf, cluster, S2B(ploop_ioff_to_sec(delta->l2[l2_slot],
-						delta->blocksize, delta->version)))) {
-		ploop_err(errno, "Can't write relocate block");
-		return -1;
-	}
+	for (i = first, nr = 0; i < last; i++) {
+		if (rmap[i - first] == 0)
+			continue;
 
-	if (fsync(delta->fd)) {
-		ploop_err(errno, "fsync");
-		return -1;
+		moves[nr].clu = rmap[i - first] - 1;
+		moves[nr].src = i;
+		moves[nr].dst = delta->alloc_head++;
+		ploop_log(0, "Reallocate block %d -> %d", moves[nr].src,
+				moves[nr].dst);
+		if (map) {
+			map[nr].req_cluster = moves[nr].clu;
+			map[nr].iblk = moves[nr].dst;
+		}
+		nr++;
 	}
 
-	if (WRITE(delta, &delta->l2[l2_slot], sizeof(__u32),
-		  (off_t)l2_cluster * cluster + l2_slot * sizeof(__u32))) {
-		ploop_err(errno, "Can't update L2 table");
+	/* copy, sync, update index and sync again */
+	qsort(moves, nr, sizeof(struct defrag_move), cmp_move_clu);
+	if (move_batch(delta, moves, nr)) {
+		free(moves);
 		return -1;
 	}
+	free(moves);
 
-	if (map) {
-		map->req_cluster = l2_slot - PLOOP_MAP_OFFSET;
-		map->iblk = delta->alloc_head - 1;
+	return nr;
+}
+
+/* Zero runs of [first, last) which are not used, see relocate_blocks() */
+static int zero_unused(struct delta *delta, __u32 first, __u32 last,
+		const __u32 *rmap)
+{
+	__u32 i, s;
+
+	for (i = first; i < last; i++) {
+		if (rmap[i - first])
+			continue;
+		for (s = i; i < last && rmap[i - first] == 0; i++)
+			;
+		if (zero_clusters(delta, s, i - s))
+			return SYSEXIT_WRITE;
 	}
 
-	return 1;
+	return 0;
 }
 
 /*
@@ -408,13 +478,13 @@ static int relocate_block(struct delta *delta, __u32 iblk, void *buf,
 int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 	       struct grow_maps *gm)
 {
-	int i, rc;
+	int rc, n;
 	struct ploop_pvd_header vh;
 	struct ploop_pvd_header *ivh = &vh;
 	int i_l1_size;
 	int i_l1_size_sync_alloc = 0;
 	off_t i_l2_size;
-	int map_idx = 0;
+	__u32 i, first, last, *rmap = NULL;
 	__u64 cluster = S2B(odelta->blocksize);
 
 	assert(cluster);
@@ -442,19 +512,19 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 	 */
 	if (odelta->alloc_head < i_l1_size) {
 		i_l1_size_sync_alloc = i_l1_size - odelta->alloc_head;
-		memset(buf, 0, cluster);
-		for (i = odelta->alloc_head; i < i_l1_size; i++)
-			if (WRITE(odelta, buf, cluster,
-				  (off_t)i * cluster)) {
-				ploop_err(errno, "Can't append zero block");
-				return SYSEXIT_WRITE;
-			}
+		if (zero_clusters(odelta, odelta->alloc_head, i_l1_size_sync_alloc)) {
+			ploop_err(errno, "Can't append zero block");
+			return SYSEXIT_WRITE;
+		}
 
 		odelta->alloc_head += i_l1_size_sync_alloc;
 	}
 
+	first = odelta->l1_size;
+	last = i_l1_size - i_l1_size_sync_alloc;
+	n = last > first ? last - first : 0;
+
 	if (gm) {
-		int n = i_l1_size - i_l1_size_sync_alloc - odelta->l1_size;
 		gm->ctl = malloc(offsetof(struct ploop_index_update_ctl,
 					  rmap[n]));
 		gm->zblks = malloc(sizeof(__u32) * n);
@@ -462,30 +532,38 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 			ploop_err(errno, "Can't malloc gm");
 			return SYSEXIT_MALLOC;
 		}
+		gm->ctl->n_maps = 0;
 	}
 
-	for (i = odelta->l1_size; i < i_l1_size - i_l1_size_sync_alloc; i++) {
-		rc = relocate_block(odelta, i, buf,
-				    gm ? &gm->ctl->rmap[map_idx] : NULL);
-		if (rc == -1)
-			return SYSEXIT_RELOC;
-
-		if (rc && gm) {
-			gm->zblks[map_idx] = i;
-			map_idx++;
-		} else {
-			memset(buf, 0, cluster);
+	if (n) {
+		rmap = malloc(n * sizeof(__u32));
+		if (rmap == NULL) {
+			ploop_err(errno, "Can't malloc rmap");
+			return SYSEXIT_MALLOC;
+		}
 
-			if (fsync(odelta->fd)) {
-				ploop_err(errno, "fsync");
-				return SYSEXIT_FSYNC;
-			}
+		rc = relocate_blocks(odelta, first, last, rmap,
+				gm ? gm->ctl->rmap : NULL);
+		if (rc == -1) {
+			free(rmap);
+			return SYSEXIT_RELOC;
+		}
 
-			if (WRITE(odelta, buf, cluster,
-				  (off_t)i * cluster)) {
-				ploop_err(errno, "Can't nullify L2 table");
-				return SYSEXIT_WRITE;
-			}
+		if (gm) {
+			/* relocated blocks are nullified by the caller
+			 * after the kernel switched to the new copies
+			 */
+			gm->ctl->n_maps = rc;
+			for (i = first, rc = 0; i < last; i++)
+				if (rmap[i - first])
+					gm->zblks[rc++] = i;
+			rc = zero_unused(odelta, first, last, rmap);
+		} else
+			rc = zero_clusters(odelta, first, n);
+		free(rmap);
+		if (rc) {
+			ploop_err(errno, "Can't nullify L2 table");
+			return SYSEXIT_WRITE;
 		}
 	}
 
@@ -510,8 +588,6 @@ int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 			ploop_err(errno, "Can't write PVD header");
 			return SYSEXIT_WRITE;
 		}
-	} else {
-		gm->ctl->n_maps = map_idx;
 	}
 
 	odelta->l1_size = i_l1_size;
@@ -21,7 +21,9 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
+#include <sys/param.h>
 #include <fcntl.h>
 #include <unistd.h>
 
@@ -114,6 +116,219 @@ int guidcmp(const char *p1, const char *p2)
 	return strcasecmp(p1, p2);
 }
 
+/*
+ * Lookup index of the images and snapshots tables.
+ *
+ * Open addressing hash tables of image guid, image file, snapshot guid
+ * and parent guid, the latter points to the first child and the other
+ * children of the same parent are linked via next_child in the table
+ * order. The index is built on the first lookup and kept up to date by
+ * ploop_add_image_entry() and ploop_add_snapshot_entry(), the functions
+ * which remove entries or change guids drop it. A hit is always checked
+ * against the tables, so a stale index can't return a wrong entry.
+ */
+enum {
+	IDX_IMAGE_GUID,
+	IDX_IMAGE_FILE,
+	IDX_SNAP_GUID,
+	IDX_SNAP_PARENT,
+	IDX_NR,
+};
+
+struct di_index {
+	int nimages;		/* number of indexed entries */
+	int nsnapshots;
+	int cap;		/* max number of entries */
+	unsigned int mask;	/* number of slots - 1 */
+	int *slot[IDX_NR];	/* entry index + 1, 0 if empty */
+	int *next_child;
+};
+
+static unsigned int hash_key(const char *s, int icase)
+{
+	unsigned int h = 2166136261u;
+
+	for (; *s != '\0'; s++) {
+		h ^= icase ? tolower((unsigned char)*s) : (unsigned char)*s;
+		h *= 16777619;
+	}
+
+	return h;
+}
+
+static const char *index_key(struct ploop_disk_images_data *di, int type,
+		int n)
+{
+	switch (type) {
+	case IDX_IMAGE_GUID:
+		return di->images[n]->guid;
+	case IDX_IMAGE_FILE:
+		return di->images[n]->file;
+	case IDX_SNAP_GUID:
+		return di->snapshots[n]->guid;
+	default:
+		return di->snapshots[n]->parent_guid;
+	}
+}
+
+/* Returns the slot of the entry with the key or the empty one */
+static int *index_slot(struct ploop_disk_images_data *di,
+		struct di_index *idx, int type, const char *key)
+{
+	int *slot = idx->slot[type];
+	unsigned int i;
+
+	i = hash_key(key, type != IDX_IMAGE_FILE) & idx->mask;
+	for (;; i = (i + 1) & idx->mask) {
+		const char *k;
+
+		if (slot[i] == 0)
+			return &slot[i];
+
+		k = index_key(di, type, slot[i] - 1);
+		if (k == NULL)
+			continue;
+		if (type == IDX_IMAGE_FILE ? strcmp(k, key) == 0 :
+				guidcmp(k, key) == 0)
+			return &slot[i];
+	}
+}
+
+static void index_add(struct ploop_disk_images_data *di,
+		struct di_index *idx, int type, int n)
+{
+	const char *key = index_key(di, type, n);
+	int *slot, c;
+
+	if (key == NULL)
+		return;
+
+	slot = index_slot(di, idx, type, key);
+	if (*slot == 0) {
+		*slot = n + 1;
+	} else if (type == IDX_SNAP_PARENT) {
+		for (c = *slot - 1; idx->next_child[c] != -1;
+				c = idx->next_child[c])
+			;
+		idx->next_child[c] = n;
+	}
+	/* else a duplicate, the first entry wins as with a linear scan */
+}
+
+static void drop_index(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx = di->runtime ? di->runtime->index : NULL;
+	int i;
+
+	if (idx == NULL)
+		return;
+
+	for (i = 0; i < IDX_NR; i++)
+		free(idx->slot[i]);
+	free(idx->next_child);
+	free(idx);
+	di->runtime->index = NULL;
+}
+
+static struct di_index *build_index(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx;
+	int i, n = MAX(di->nimages, di->nsnapshots);
+
+	idx = calloc(1, sizeof(struct di_index));
+	if (idx == NULL)
+		return NULL;
+
+	/* leave room to grow, the load factor is kept below 1/2 */
+	for (idx->cap = 16; idx->cap < n * 2; idx->cap <<= 1)
+		;
+	idx->mask = idx->cap * 2 - 1;
+	for (i = 0; i < IDX_NR; i++) {
+		idx->slot[i] = calloc(idx->cap * 2, sizeof(int));
+		if (idx->slot[i] == NULL)
+			goto err;
+	}
+	idx->next_child = malloc(idx->cap * sizeof(int));
+	if (idx->next_child == NULL)
+		goto err;
+
+	di->runtime->index = idx;
+
+	for (i = 0; i < di->nimages; i++) {
+		index_add(di, idx, IDX_IMAGE_GUID, i);
+		index_add(di, idx, IDX_IMAGE_FILE, i);
+	}
+	idx->nimages = di->nimages;
+
+	for (i = 0; i < di->nsnapshots; i++) {
+		idx->next_child[i] = -1;
+		index_add(di, idx, IDX_SNAP_GUID, i);
+		index_add(di, idx, IDX_SNAP_PARENT, i);
+	}
+	idx->nsnapshots = di->nsnapshots;
+
+	return idx;
+
+err:
+	di->runtime->index = idx;
+	drop_index(di);
+
+	return NULL;
+}
+
+/* Returns the up to date index or NULL to fall back to a linear scan */
+static struct di_index *get_index(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx;
+
+	if (di->runtime == NULL)
+		return NULL;
+
+	idx = di->runtime->index;
+	if (idx != NULL && (idx->nimages != di->nimages ||
+				idx->nsnapshots != di->nsnapshots))
+		drop_index(di);
+
+	return di->runtime->index ?: build_index(di);
+}
+
+static void index_add_image(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx = di->runtime ? di->runtime->index : NULL;
+	int n = di->nimages - 1;
+
+	if (idx == NULL)
+		return;
+
+	if (idx->nimages != n || n >= idx->cap) {
+		drop_index(di);
+		return;
+	}
+
+	index_add(di, idx, IDX_IMAGE_GUID, n);
+	index_add(di, idx, IDX_IMAGE_FILE, n);
+	idx->nimages++;
+}
+
+static void index_add_snapshot(struct ploop_disk_images_data *di)
+{
+	struct di_index *idx = di->runtime ? di->runtime->index : NULL;
+	int n = di->nsnapshots - 1;
+
+	if (idx == NULL)
+		return;
+
+	if (idx->nsnapshots != n || n >= idx->cap) {
+		drop_index(di);
+		return;
+	}
+
+	idx->next_child[n] = -1;
+	index_add(di, idx, IDX_SNAP_GUID, n);
+	index_add(di, idx, IDX_SNAP_PARENT, n);
+	idx->nsnapshots++;
+}
+
 int ploop_add_image_entry(struct ploop_disk_images_data *di, const char *fname, const char *guid)
 {
 	struct ploop_image_data **tmp;
@@ -149,6 +364,7 @@ int ploop_add_image_entry(struct ploop_disk_images_data *di, const char *fname,
 
 	di->images[di->nimages] = image;
 	di->nimages++;
+	index_add_image(di);
 
 	return 0;
 }
@@ -204,6 +420,7 @@ int ploop_add_snapshot_entry(struct ploop_disk_images_data *di, const char *guid
 
 	di->snapshots[di->nsnapshots] = data;
 	di->nsnapshots++;
+	index_add_snapshot(di);
 
 	return 0;
 }
@@ -241,6 +458,7 @@ void ploop_di_change_guid(struct ploop_disk_images_data *di, const char *guid, c
 {
 	int i;
 
+	drop_index(di);
 	for (i = 0; i < di->nimages; i++)
 		if (guidcmp(di->images[i]->guid, guid) == 0)
 			strcpy(di->images[i]->guid, new_guid);
@@ -294,6 +512,8 @@ void ploop_clear_dd(struct ploop_disk_images_data *di)
 {
 	int i;
 
+	drop_index(di);
+
 	for (i = 0; i < di->nimages; i++)
 		free_image_data(di->images[i]);
 
@@ -445,6 +665,7 @@ err:
 int find_image_idx_by_file(struct ploop_disk_images_data *di, const char *file)
 {
 	int i;
+	struct di_index *idx;
 	char image[PATH_MAX];
 
 	/* First we need to normalize the image file name
@@ -461,9 +682,23 @@ int find_image_idx_by_file(struct ploop_disk_images_data *di, const char *file)
 		snprintf(image, sizeof(image), "%s", file);
 	}
 
+	idx = get_index(di);
+	if (idx != NULL) {
+		int *slot = index_slot(di, idx, IDX_IMAGE_FILE, image);
+
+		if (*slot != 0)
+			return *slot - 1;
+	}
+
+	/* files are swapped in place on merge and replace, so the file
+	 * index may be stale
+	 */
 	for (i = 0; i < di->nimages; i++) {
-		if (!strcmp(image, di->images[i]->file))
+		if (di->images[i]->file != NULL &&
+				!strcmp(image, di->images[i]->file)) {
+			drop_index(di);
 			return i;
+		}
 	}
 
 	return -1;
@@ -472,6 +707,11 @@ int find_image_idx_by_file(struct ploop_disk_images_data *di, const char *file)
 int find_image_idx_by_guid(struct ploop_disk_images_data *di, const char *guid)
 {
 	int i;
+	struct di_index *idx;
+
+	idx = get_index(di);
+	if (idx != NULL)
+		return *index_slot(di, idx, IDX_IMAGE_GUID, guid) - 1;
 
 	for (i = 0; i < di->nimages; i++) {
 		if (!guidcmp(guid, di->images[i]->guid))
@@ -497,9 +737,15 @@ char *find_image_by_guid(struct ploop_disk_images_data *di, const char *guid)
 int find_snapshot_by_guid(struct ploop_disk_images_data *di, const char *guid)
 {
 	int i;
+	struct di_index *idx;
 
 	if (guid == NULL)
 		return -1;
+
+	idx = get_index(di);
+	if (idx != NULL)
+		return *index_slot(di, idx, IDX_SNAP_GUID, guid) - 1;
+
 	for (i = 0; i < di->nsnapshots; i++)
 		if (guidcmp(di->snapshots[i]->guid, guid) == 0)
 			return i;
@@ -517,6 +763,13 @@ static void remove_data_from_array(void **array, int nelem, int id)
 const char * ploop_get_child_by_uuid(struct ploop_disk_images_data *di, const char *guid)
 {
 	int i;
+	struct di_index *idx;
+
+	idx = get_index(di);
+	if (idx != NULL) {
+		i = *index_slot(di, idx, IDX_SNAP_PARENT, guid) - 1;
+		return i == -1 ? NULL : di->snapshots[i]->guid;
+	}
 
 	for (i = 0; i < di->nsnapshots; i++) {
 		if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0) {
@@ -542,6 +795,15 @@ char *ploop_find_parent_by_guid(struct ploop_disk_images_data *di, const char *g
 int ploop_get_child_count_by_uuid(struct ploop_disk_images_data *di, const char *guid)
 {
 	int i, n = 0;
+	struct di_index *idx;
+
+	idx = get_index(di);
+	if (idx != NULL) {
+		for (i = *index_slot(di, idx, IDX_SNAP_PARENT, guid) - 1;
+				i != -1; i = idx->next_child[i])
+			n++;
+		return n;
+	}
 
 	for (i = 0; i < di->nsnapshots; i++)
 		if (guidcmp(di->snapshots[i]->parent_guid, guid) == 0)
@@ -595,6 +857,7 @@ int ploop_di_remove_image(struct ploop_disk_images_data *di, const char *guid,
 	if (renew_top_uuid && guidcmp(guid, di->top_guid) == 0)
 		ploop_di_change_guid(di, snapshot->parent_guid, TOPDELTA_UUID);
 
+	drop_index(di);
 	remove_data_from_array((void**)di->snapshots, di->nsnapshots, snap_id);
 	di->nsnapshots--;
 	remove_data_from_array((void**)di->images, di->nimages, image_id);
@@ -668,6 +931,7 @@ int ploop_di_delete_snapshot(struct ploop_disk_images_data *di,
 		di->images[image_id]->file = NULL;
 	}
 
+	drop_index(di);
 	/* update parent referrence */
 	strcpy(c->parent_guid, p->parent_guid);
 
@@ -185,7 +185,9 @@ int dm_create(const char *devname, int minor, const char *target,
 		dm_task_set_ro(d);
 	if (minor == 0)
 		sscanf(get_basename(devname), "ploop%d", &minor);
-	dm_task_set_minor(d, minor);
+	/* -1 lets the kernel pick a minor */
+	if (minor != -1)
+		dm_task_set_minor(d, minor);
 	if (!dm_task_set_cookie(d, &cookie, 0))
 		goto err;
 	if (!dm_task_run(d))
@@ -201,6 +203,83 @@ err:
 	return rc;
 }
 
+/* Load the inactive table of a single target, it is activated on resume */
+static int dm_load_table(const char *devname, __u64 size, const char *target,
+		const char *args)
+{
+	struct dm_task *d;
+	int rc = -1;
+
+	ploop_log(1, "DM command: reload %s 0 %llu %s %s", devname,
+			(unsigned long long)size, target, args);
+	d = dm_task_create(DM_DEVICE_RELOAD);
+	if (d == NULL)
+		return SYSEXIT_MALLOC;
+	if (!dm_task_set_name(d, get_basename(devname)))
+		goto err;
+	if (!dm_task_add_target(d, 0, size, target, args))
+		goto err;
+	if (!dm_task_run(d))
+		goto err;
+
+	rc = 0;
+err:
+	if (rc)
+		ploop_err(errno, "Failed to reload %s", devname);
+	dm_task_destroy(d);
+
+	return rc;
+}
+
+static int dm_exists(const char *devname)
+{
+	struct dm_task *d;
+	struct dm_info i;
+	int rc = -1;
+
+	d = dm_task_create(DM_DEVICE_INFO);
+	if (d == NULL)
+		return -1;
+	if (!dm_task_set_name(d, get_basename(devname)))
+		goto err;
+	if (!dm_task_run(d))
+		goto err;
+	if (!dm_task_get_info(d, &i))
+		goto err;
+	rc = i.exists;
+err:
+	dm_task_destroy(d);
+
+	return rc;
+}
+
+/* Map sectors [start, start + size) of dev by a linear device devname,
+ * the table of an existing device is replaced.
+ */
+int dm_set_linear(const char *devname, dev_t dev, __u64 start, __u64 size,
+		int ro)
+{
+	int rc;
+	char args[64];
+
+	snprintf(args, sizeof(args), "%u:%u %llu", major(dev), minor(dev),
+			(unsigned long long)start);
+
+	rc = dm_exists(devname);
+	if (rc == -1) {
+		ploop_err(errno, "Can't get info of %s", devname);
+		return SYSEXIT_SYS;
+	} else if (rc == 0)
+		return dm_create(devname, -1, "linear", 0, size, ro, args) ?
+			SYSEXIT_SYS : 0;
+
+	rc = dm_load_table(devname, size, "linear", args);
+	if (rc)
+		return SYSEXIT_SYS;
+
+	return dm_resume(devname) ? SYSEXIT_SYS : 0;
+}
+
 static const char *get_cmd_name(int cmd)
 {
 	switch(cmd) {
@@ -876,7 +955,6 @@ int do_reload(const char *device, char **images, __u32 blocksize, off_t new_size
 {
 	int rc, *fds, i, j, n = 0;
 	char t[PATH_MAX];
-	char *a[7];
 	char *p, *e;
 
 	if (new_size == 0) {
@@ -889,11 +967,9 @@ int do_reload(const char *device, char **images, __u32 blocksize, off_t new_size
 	fds = alloca(n * sizeof(int));
 	p = t;
 	e = p + sizeof(t);
+	*p = '\0';
 	if (image_fmt == PLOOP_FMT)
-		p += snprintf(p, e-p, "0 %lu ploop %d",
-			new_size, ffs(blocksize)-1);
-	else
-		p += snprintf(p, e-p, "0 %lu qcow2", new_size);
+		p += snprintf(p, e-p, "%d", ffs(blocksize)-1);
 
 	for (i = 0; i < n; i++) {
 		int r = i < n - (flags & RELOAD_RW2 ? 2 : 1);
@@ -905,16 +981,11 @@ int do_reload(const char *device, char **images, __u32 blocksize, off_t new_size
 			rc = SYSEXIT_OPEN;
 			goto err;
 		}
-		p += snprintf(p, e-p, " %d", fds[i]);
+		p += snprintf(p, e-p, p == t ? "%d" : " %d", fds[i]);
 	}
 
-	a[0] = "dmsetup";
-	a[1] = "reload";
-	a[2] = (char *) get_basename(device);
-	a[3] = "--table";
-	a[4] = t;
-	a[5] = NULL;
-	rc = run_prg(a);
+	rc = dm_load_table(device, new_size,
+			image_fmt == PLOOP_FMT ? "ploop" : "qcow2", t);
 err:
 	for (j = 0; j < i; j++)
 		close(fds[j]);
@@ -1019,23 +1090,17 @@ err:
 
 int dm_reload_other(const char *device, const char *drv, off_t size)
 {
-	char t[64];
-	char *a[] = {"dmsetup", "reload", (char *) get_basename(device), "--table", t, NULL};
-
-	snprintf(t, sizeof(t), "0 %lu %s", size, drv);
-
-	return run_prg(a);
+	return dm_load_table(device, size, drv, "");
 }
 
 static int dm_tg_reload(const char *dev, const char *dev2, 
 		const char *tg, off_t size, __u32 blocksize)
 {
 	char t[PATH_MAX];
-	char *a[] = {"dmsetup", "reload", (char *) get_basename(dev), "--table",  t, NULL};
 
-	snprintf(t, sizeof(t), "0 %lu %s %u %s", size, tg, blocksize, dev2);
+	snprintf(t, sizeof(t), "%u %s", blocksize, dev2);
 
-	return run_prg(a);
+	return dm_load_table(dev, size, tg, t);
 }
 
 /*
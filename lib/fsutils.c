@@ -32,8 +32,13 @@
 #include <sys/utsname.h>
 
 #include <blkid/blkid.h>
+#include <ext2fs/ext2_fs.h>
 
 #include "ploop.h"
+#ifndef EXT4_IOC_RESIZE_FS
+#define EXT4_IOC_RESIZE_FS		_IOW('f', 16, __u64)
+#endif
+
 #ifndef EXT4_IOC_SET_RSV_BLOCKS
 #define EXT4_IOC_SET_RSV_BLOCKS         _IOW('f', 44, __u64)
 #endif
@@ -41,7 +46,7 @@
 #define __stringify(x...)	__stringify_1(x)
 
 /* A macro to create a list of versions of an e2fs utility
- * (such as tune2fs, resize2fs or dumpe2fs) to look for,
+ * (such as tune2fs or resize2fs) to look for,
  * ordered by priority:
  *  1 Our own private version from /usr/libexec
  *  2 A version from e4fsprogs (for RHEL5 systems)
@@ -59,7 +64,6 @@ static char * name ## 2fs_progs[] = {			\
 
 GEN_E2FS_PROG(tune)
 GEN_E2FS_PROG(resize)
-GEN_E2FS_PROG(dumpe)
 
 #undef GEN_E2FS_PROG
 
@@ -178,66 +182,6 @@ int sgdisk_mkpart(const char *device,
 	return 0;
 }
 
-int sgdisk_resize_gpt(const char *device, int part_num, off_t part_start)
-{
-	char n[64];
-	char *argv[] = {"sgdisk", "-e", "-d1", "-n", n,  (char *)device, NULL};
-
-	snprintf(n, sizeof(n), "%d:%lu:0", part_num, part_start);
-	if (run_prg(argv)) {
-		ploop_err(0, "Failed to resize GPT partition %d", part_num);
-		return SYSEXIT_SYS;
-	}
-	return 0;
-}
-
-
-#define FOUND_START_SECTOR_BIT 1
-#define FOUND_END_SECTOR_BIT 2
-
-int get_partition_range(const char *device,
-		int part_num,
-		unsigned long long *part_start,
-		unsigned long long *part_end)
-{
-	char cmd[PATH_MAX];
-	char buf[512];
-	FILE *fp;
-	int ret = SYSEXIT_SYS;
-	int found = FOUND_START_SECTOR_BIT | FOUND_END_SECTOR_BIT;
-
-	snprintf(cmd, sizeof(cmd), "LANG=C " DEF_PATH_ENV " sgdisk -i %d %s",
-			part_num, device);
-	fp = popen(cmd, "r");
-	if (fp == NULL) {
-		ploop_err(0, "Failed %s", cmd);
-		return SYSEXIT_SYS;
-	}
-
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if ((found & FOUND_START_SECTOR_BIT) &&
-				sscanf(buf, "First sector: %llu", part_start) == 1)
-			found &= ~FOUND_START_SECTOR_BIT;
-		else if ((found & FOUND_END_SECTOR_BIT) &&
-				sscanf(buf, "Last sector: %llu", part_end) == 1)
-			found &= ~FOUND_END_SECTOR_BIT;
-	}
-
-	if (found) {
-		ploop_err(0, "Can't get a range of partition %d", part_num);
-		goto out;
-	}
-
-	ret = 0;
-out:
-	if (pclose(fp)) {
-		ploop_err(0, "Error in pclose() for %s", cmd);
-		return SYSEXIT_SYS;
-	}
-
-	return ret;
-}
-
 int partprobe(const char *device)
 {
 	char *argv[] = {"partprobe", (char *)device, NULL};
@@ -249,54 +193,6 @@ int partprobe(const char *device)
 	return 0;
 }
 
-int get_last_partition_num(const char *device, int *part_num)
-{
-	char cmd[PATH_MAX];
-	char buf[512];
-	FILE *fp;
-	int ret = SYSEXIT_SYS;
-	int found_title = 0;
-	unsigned long long start = 0;
-	unsigned long long end = 0;
-	int num = 0;
-	int last_part = 0;
-	char title[] = "Number ";
-
-	snprintf(cmd, sizeof(cmd), "LANG=C " DEF_PATH_ENV " parted -s %s unit b print",
-			device);
-	fp = popen(cmd, "r");
-	if (fp == NULL) {
-		ploop_err(0, "Failed %s", cmd);
-		return SYSEXIT_SYS;
-	}
-
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if (!found_title) {
-			if (!strncmp(buf, title, sizeof(title) - 1))
-				found_title = 1;
-			continue;
-		}
-		if (3 != sscanf(buf, "%d %lluB %lluB", &num, &start, &end))
-			continue;
-		last_part = num;
-	}
-
-	if (!last_part) {
-		ploop_err(0, "Can't find the last partition");
-		goto out;
-	}
-
-	*part_num = last_part;
-	ret = 0;
-out:
-	if (pclose(fp)) {
-		ploop_err(0, "Error in pclose() for %s", cmd);
-		return SYSEXIT_SYS;
-	}
-
-	return ret;
-}
-
 static int make_ext4(const char *part_device, const char *fstype, unsigned int fsblocksize,
 		unsigned int flags, const char *fslabel)
 {
@@ -435,11 +331,48 @@ void tune_fs(int balloonfd, const char *device, unsigned long long size_sec)
 	run_prg(argv);
 }
 
+/* Grow a mounted ext4 by the kernel, returns -1 if it can't be done */
+static int resize_ext4_online(const char *device, off_t size_sec)
+{
+	char mnt[PATH_MAX];
+	struct statfs fs;
+	__u64 blocks;
+	int fd, ret;
+
+	if (get_mount_dir(device, 0, mnt, sizeof(mnt)))
+		return -1;
+
+	if (size_sec == 0 && ploop_get_size(device, &size_sec))
+		return -1;
+
+	fd = open(mnt, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	ret = fstatfs(fd, &fs);
+	if (ret == 0) {
+		// align size to 4K
+		blocks = S2B((__u64)size_sec >> 3 << 3) / fs.f_bsize;
+		ploop_log(0, "Resize %s to %llu blocks", mnt,
+				(unsigned long long)blocks);
+		ret = ioctl(fd, EXT4_IOC_RESIZE_FS, &blocks);
+		if (ret)
+			ploop_log(1, "EXT4_IOC_RESIZE_FS %s: %s", mnt,
+					strerror(errno));
+	}
+	close(fd);
+
+	return ret ? -1 : 0;
+}
+
 int resize_ext4(const char *device, off_t size_sec)
 {
 	char *argv[5];
 	char buf[22];
 
+	if (resize_ext4_online(device, size_sec) == 0)
+		return 0;
+
 	argv[0] = get_prog(resize2fs_progs);
 	argv[1] = "-p";
 	argv[2] = (char *)device;
@@ -490,49 +423,36 @@ int resize_fs(const char *partname, off_t size_sec)
 		resize_ext4(partname, size_sec);
 }
 
-enum {
-	BLOCK_COUNT,
-	BLOCK_FREE,
-	BLOCK_SIZE,
-};
-
-#define BLOCK_COUNT_BIT (1 << BLOCK_COUNT)
-#define BLOCK_FREE_BIT (1 << BLOCK_FREE)
-#define BLOCK_SIZE_BIT (1 << BLOCK_SIZE)
+#define EXT4_SB_OFFSET	1024
 
 int dump_ext4(const char *device, struct dump2fs_data *data)
 {
-	char cmd[512];
-	char buf[512];
-	FILE *fp;
-	int found = BLOCK_COUNT_BIT | BLOCK_FREE_BIT | BLOCK_SIZE_BIT;
-	snprintf(cmd, sizeof(cmd), "LANG=C " DEF_PATH_ENV " %s -h %s",
-			get_prog(dumpe2fs_progs), device);
-	fp = popen(cmd, "r");
-	if (fp == NULL) {
-		ploop_err(0, "Failed %s", cmd);
-		return SYSEXIT_SYS;
-	}
+	struct ext2_super_block sb;
+	int fd, ret;
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		if ((found & BLOCK_COUNT_BIT) &&
-				sscanf(buf, "Block count: %" SCNu64, &data->block_count) == 1)
-			found &= ~BLOCK_COUNT_BIT;
-		else if ((found & BLOCK_FREE_BIT) &&
-				sscanf(buf, "Free blocks: %" SCNu64, &data->block_free) == 1)
-			found &= ~BLOCK_FREE_BIT;
-		else if ((found & BLOCK_SIZE_BIT) &&
-				sscanf(buf, "Block size: %u", &data->block_size) == 1)
-			found &= ~BLOCK_SIZE_BIT;
+	fd = open(device, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", device);
+		return SYSEXIT_OPEN;
 	}
 
-	if (pclose(fp)) {
-		ploop_err(0, "failed %s", cmd);
+	ret = read_safe(fd, &sb, sizeof(sb), EXT4_SB_OFFSET,
+			"Failed to read the ext4 superblock");
+	close(fd);
+	if (ret)
+		return ret;
+
+	if (sb.s_magic != EXT2_SUPER_MAGIC) {
+		ploop_err(0, "No ext4 superblock found on %s", device);
 		return SYSEXIT_SYS;
 	}
-	if (found) {
-		ploop_err(0, "Not enough data: %s (0x%x)", cmd, found);
-		return SYSEXIT_SYS;
+
+	data->block_size = EXT2_MIN_BLOCK_SIZE << sb.s_log_block_size;
+	data->block_count = sb.s_blocks_count;
+	data->block_free = sb.s_free_blocks_count;
+	if (sb.s_feature_incompat & EXT4_FEATURE_INCOMPAT_64BIT) {
+		data->block_count |= (uint64_t)sb.s_blocks_count_hi << 32;
+		data->block_free |= (uint64_t)sb.s_free_blocks_hi << 32;
 	}
 
 	return 0;
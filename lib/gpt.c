@@ -19,6 +19,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <ctype.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -27,6 +29,7 @@
 #include <limits.h>
 #include <sys/ioctl.h>
 #include <sys/mount.h>
+#include <sys/sysmacros.h>
 #include <linux/blkpg.h>
 
 #include "ploop.h"
@@ -78,6 +81,16 @@ struct GptEntry
 	__u64 ending_lba;
 };
 
+/* Partition range in logical sectors, end is inclusive */
+struct gpt_part
+{
+	int num;
+	__u64 start;
+	__u64 end;
+};
+
+#define GPT_MAX_PARTS	128
+
 struct MbrPartEntry
 {
 	char active;
@@ -200,6 +213,223 @@ int get_partition_device_name(const char *device, char *out, int size)
 	return get_partition_device_name_by_num(device, 1, out, size);
 }
 
+/* Read the primary GPT, *n is set to -1 if there is no GPT */
+static int read_gpt_parts(int fd, int sector_size, struct gpt_part *parts,
+		int *n)
+{
+	unsigned char buf[GPT_PT_ENTRY_SIZE];
+	struct GptHeader hdr;
+	__u32 crc, i, nr;
+	int ret;
+
+	*n = -1;
+	ret = read_safe(fd, &hdr, sizeof(hdr), sector_size,
+			"Failed to read the GPT header");
+	if (ret)
+		return ret;
+
+	if (hdr.signature != GPT_SIGNATURE)
+		return 0;
+
+	crc = hdr.header_crc32;
+	hdr.header_crc32 = 0;
+	if (hdr.header_size > sizeof(hdr) ||
+			ploop_crc32((unsigned char *)&hdr, hdr.header_size) != crc) {
+		ploop_err(0, "GPT header validation failed");
+		return SYSEXIT_PARAM;
+	}
+
+	if (hdr.size_partition_entry < sizeof(struct GptEntry) ||
+			(__u64)hdr.num_partition_entries *
+				hdr.size_partition_entry > sizeof(buf)) {
+		ploop_err(0, "Unsupported GPT partition entries %u x %u",
+				hdr.num_partition_entries,
+				hdr.size_partition_entry);
+		return SYSEXIT_PARAM;
+	}
+
+	ret = read_safe(fd, buf, sizeof(buf),
+			hdr.partition_entry_lba * sector_size,
+			"Failed to read the GPT partition entries");
+	if (ret)
+		return ret;
+
+	if (ploop_crc32(buf, hdr.num_partition_entries *
+				hdr.size_partition_entry) !=
+			hdr.partition_entry_array_crc32) {
+		ploop_err(0, "GPT partition entries validation failed");
+		return SYSEXIT_PARAM;
+	}
+
+	nr = 0;
+	for (i = 0; i < hdr.num_partition_entries && nr < GPT_MAX_PARTS; i++) {
+		static const guid_t unused;
+		struct GptEntry *pe = (struct GptEntry *)
+			(buf + i * hdr.size_partition_entry);
+
+		if (!memcmp(&pe->partition_type_guid, &unused, sizeof(unused)))
+			continue;
+		parts[nr].num = i + 1;
+		parts[nr].start = pe->starting_lba;
+		parts[nr].end = pe->ending_lba;
+		nr++;
+	}
+	*n = nr;
+
+	return 0;
+}
+
+static int get_gpt_parts(const char *device, int *sector_size,
+		struct gpt_part *parts, int *n)
+{
+	int fd, ret;
+
+	fd = open(device, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", device);
+		return SYSEXIT_OPEN;
+	}
+
+	ret = get_sector_size(fd, sector_size);
+	if (ret == 0)
+		ret = read_gpt_parts(fd, *sector_size, parts, n);
+	close(fd);
+
+	return ret;
+}
+
+int get_last_partition_num(const char *device, int *part_num)
+{
+	int ret, n, sector_size;
+	struct gpt_part parts[GPT_MAX_PARTS];
+
+	ret = get_gpt_parts(device, &sector_size, parts, &n);
+	if (ret)
+		return ret;
+
+	if (n <= 0) {
+		ploop_err(0, "Can't find the last partition");
+		return SYSEXIT_SYS;
+	}
+	*part_num = parts[n - 1].num;
+
+	return 0;
+}
+
+int get_partition_range(const char *device, int part_num,
+		unsigned long long *part_start, unsigned long long *part_end)
+{
+	int ret, i, n, sector_size;
+	struct gpt_part parts[GPT_MAX_PARTS];
+
+	ret = get_gpt_parts(device, &sector_size, parts, &n);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < n; i++) {
+		if (parts[i].num == part_num) {
+			*part_start = parts[i].start;
+			*part_end = parts[i].end;
+			return 0;
+		}
+	}
+
+	ploop_err(0, "Can't get a range of partition %d", part_num);
+	return SYSEXIT_SYS;
+}
+
+static void get_part_name(const char *device, int num, char *out, int size)
+{
+	int len = strlen(device);
+
+	/* the same naming as the kernel and kpartx use */
+	snprintf(out, size, "%s%s%d", device,
+			len && isdigit(device[len - 1]) ? "p" : "", num);
+}
+
+/* Create or resize the partition devices by the GPT: device-mapper
+ * devices get linear mappings, others are updated via BLKPG.
+ * Returns -1 if the partitions can't be handled natively.
+ */
+static int update_part_devices(const char *device)
+{
+	int fd, ret, i, n, ro = 0, sector_size, dm;
+	struct gpt_part parts[GPT_MAX_PARTS];
+	char name[64];
+	struct stat st;
+
+	dm = is_device_from_devmapper(device);
+	if (dm == -1)
+		return -1;
+
+	fd = open(device, O_RDONLY|O_CLOEXEC);
+	if (fd == -1)
+		return -1;
+
+	if (fstat(fd, &st) || get_sector_size(fd, &sector_size) ||
+			read_gpt_parts(fd, sector_size, parts, &n) ||
+			n == -1) {
+		ret = -1;
+		goto out;
+	}
+
+	ioctl(fd, BLKROGET, &ro);
+	for (i = 0; i < n; i++) {
+		__u64 start = parts[i].start * sector_size;
+		__u64 len = (parts[i].end - parts[i].start + 1) * sector_size;
+
+		if (dm) {
+			get_part_name(get_basename(device), parts[i].num,
+					name, sizeof(name));
+			ret = dm_set_linear(name, st.st_rdev, B2S(start),
+					B2S(len), ro);
+		} else {
+			struct blkpg_partition p = {
+				.start = start,
+				.length = len,
+				.pno = parts[i].num,
+			};
+			struct blkpg_ioctl_arg a = {
+				.op = BLKPG_ADD_PARTITION,
+				.datalen = sizeof(p),
+				.data = &p,
+			};
+
+			get_part_name(get_basename(device), parts[i].num,
+					p.devname, sizeof(p.devname));
+			ret = ioctl(fd, BLKPG, &a);
+			if (ret && errno == EBUSY) {
+				a.op = BLKPG_RESIZE_PARTITION;
+				ret = ioctl(fd, BLKPG, &a);
+			}
+			if (ret)
+				ploop_log(1, "BLKPG %s partition %d: %s",
+						device, parts[i].num, strerror(errno));
+		}
+		if (ret) {
+			ret = -1;
+			goto out;
+		}
+		ploop_log(1, "Partition %d of %s: start=%llu length=%llu",
+				parts[i].num, device,
+				(unsigned long long)start,
+				(unsigned long long)len);
+	}
+	ret = 0;
+out:
+	close(fd);
+
+	return ret;
+}
+
+int reread_part(const char *device)
+{
+	if (update_part_devices(device) == 0)
+		return 0;
+
+	return partprobe(device);
+}
+
 static void update_protective_mbr(int fd, __u64 new_size)
 {
 	char buf[SECTOR_SIZE];
@@ -224,7 +454,8 @@ static void update_protective_mbr(int fd, __u64 new_size)
 }
 
 static int update_gpt_partition(int fd, const char *devname, __u64 new_size512,
-		int sector_size, int image_sector_size, __u32 blocksize512)
+		int sector_size, int image_sector_size, __u32 blocksize512,
+		int part_num)
 {
 	unsigned char buf[GPT_PT_ENTRY_SIZE];
 	int ret;
@@ -274,7 +505,19 @@ static int update_gpt_partition(int fd, const char *devname, __u64 new_size512,
 			"Failed to read the GPT partition entries");
 	if (ret)
 		return ret;
-	pe = (struct GptEntry *)buf;
+	if (hdr.size_partition_entry < sizeof(struct GptEntry) ||
+			(__u64)hdr.num_partition_entries *
+				hdr.size_partition_entry > sizeof(buf)) {
+		ploop_err(0, "Unsupported GPT partition entries %u x %u",
+				hdr.num_partition_entries,
+				hdr.size_partition_entry);
+		return SYSEXIT_PARAM;
+	}
+	if (part_num < 1 || part_num > hdr.num_partition_entries) {
+		ploop_err(0, "Invalid GPT partition number %d", part_num);
+		return SYSEXIT_PARAM;
+	}
+	pe = (struct GptEntry *)(buf + (part_num - 1) * hdr.size_partition_entry);
 
 	/* Validate crc */
 	orig_crc = hdr.header_crc32;
@@ -311,7 +554,8 @@ static int update_gpt_partition(int fd, const char *devname, __u64 new_size512,
 	}
 
 	/* Recalculate crc32 */
-	pe_crc32 = ploop_crc32((unsigned char *)pe, GPT_PT_ENTRY_SIZE);
+	pe_crc32 = ploop_crc32(buf, hdr.num_partition_entries *
+			hdr.size_partition_entry);
 	hdr.partition_entry_array_crc32 = pe_crc32;
 
 	hdr.header_crc32 = 0;
@@ -395,7 +639,7 @@ int resize_gpt_partition(const char *device, const char *partname,
 		goto err;
 	/* resize is performed only on mounted fs so sectors are equals */
 	ret = update_gpt_partition(fd, device, new_size512, sector_size,
-			sector_size, blocksize512);
+			sector_size, blocksize512, 1);
 	if (ret)
 		goto err;
 
@@ -410,6 +654,26 @@ err:
 	return ret;
 }
 
+/* Extend the GPT and the partition part_num up to the end of device */
+int resize_gpt_partition_num(const char *device, int part_num)
+{
+	int fd, ret, sector_size;
+
+	fd = open(device, O_RDWR|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Failed to open %s", device);
+		return SYSEXIT_OPEN;
+	}
+
+	ret = get_sector_size(fd, &sector_size);
+	if (ret == 0)
+		ret = update_gpt_partition(fd, device, 0, sector_size,
+				sector_size, 0, part_num);
+	close(fd);
+
+	return ret;
+}
+
 /* Detect image sector size by GPT signature mark
  * support up to 4K sector size.
  */
@@ -482,7 +746,7 @@ int check_and_repair_gpt(const char *device, __u32 blocksize512)
 	ploop_log(0, "GPT sector size incompatibility detected %d/%d",
 			image_sector_size, sector_size);
 	ret = update_gpt_partition(fd, device, 0, sector_size,
-			image_sector_size, blocksize512);
+			image_sector_size, blocksize512, 1);
 
 err:
 	close(fd);
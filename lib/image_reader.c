@@ -0,0 +1,377 @@
+/*
+ *  Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Offline reader of the virtual disk of a snapshot chain.
+ *
+ * The index of all deltas is flattened once on open into a per cluster
+ * map <delta level, image block>, so a read costs one lookup and one
+ * pread per run of clusters which are contiguous in the same delta.
+ * Partial cluster reads go through a small cluster cache, sequential
+ * reads trigger readahead of the following clusters.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <sys/param.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+
+/* Level of clusters which are not mapped in any delta */
+#define READER_HOLE		0xffff
+#define READER_CACHE_SIZE	16
+#define READER_READAHEAD	32
+
+struct reader_cache {
+	__u32 clu;
+	int valid;
+	void *buf;
+};
+
+struct ploop_image_reader {
+	int nr_deltas;
+	struct delta *deltas;	/* top delta first */
+	int raw_fd;		/* raw base image or -1 */
+	__u64 cluster;
+	__u64 size;
+	__u32 nr_clusters;
+	__u16 *level;
+	__u32 *iblk;
+	__u32 last_clu;
+	__u32 ra_clu;
+	struct reader_cache cache[READER_CACHE_SIZE];
+};
+
+/* Fill the cluster map from the index of delta at level, clusters
+ * which are mapped in upper deltas are not touched.
+ */
+static int reader_map_delta(struct ploop_image_reader *r, int level)
+{
+	struct delta *d = &r->deltas[level];
+	__u32 n = r->cluster / sizeof(__u32);
+	__u32 clu, l2_cluster, l2_slot, nr;
+
+	nr = MIN(d->l2_size, r->nr_clusters);
+	for (clu = 0; clu < nr; clu++) {
+		l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
+		l2_slot = (clu + PLOOP_MAP_OFFSET) % n;
+
+		if (l2_cluster >= d->l1_size)
+			break;
+
+		if (d->l2_cache != l2_cluster) {
+			if (PREAD(d, d->l2, r->cluster, (off_t)l2_cluster * r->cluster))
+				return SYSEXIT_READ;
+			d->l2_cache = l2_cluster;
+		}
+
+		if (d->l2[l2_slot] == 0 || r->level[clu] != READER_HOLE)
+			continue;
+
+		r->level[clu] = level;
+		r->iblk[clu] = ploop_ioff_to_sec(d->l2[l2_slot],
+				d->blocksize, d->version) / d->blocksize;
+	}
+
+	return 0;
+}
+
+void ploop_image_reader_close(struct ploop_image_reader *r)
+{
+	int i;
+
+	if (r == NULL)
+		return;
+
+	for (i = 0; i < r->nr_deltas; i++)
+		close_delta(&r->deltas[i]);
+	if (r->raw_fd != -1)
+		close(r->raw_fd);
+	for (i = 0; i < READER_CACHE_SIZE; i++)
+		free(r->cache[i].buf);
+	free(r->deltas);
+	free(r->level);
+	free(r->iblk);
+	free(r);
+}
+
+int ploop_image_reader_open(struct ploop_disk_images_data *di,
+		const char *guid, struct ploop_image_reader **out)
+{
+	char dev[64];
+	char **images = NULL;
+	struct ploop_image_reader *r;
+	int i, n, ret;
+
+	if (guid == NULL)
+		guid = di->top_guid;
+
+	if (ploop_lock_dd(di))
+		return SYSEXIT_LOCK;
+
+	/* the top delta of a running device is changing */
+	if (strcmp(guid, di->top_guid) == 0) {
+		ret = ploop_find_dev_by_dd(di, dev, sizeof(dev));
+		if (ret == -1) {
+			ret = SYSEXIT_SYS;
+			goto err_unlock;
+		} else if (ret == 0) {
+			ploop_err(0, "Image is in use by %s, only snapshots"
+					" can be read", dev);
+			ret = SYSEXIT_PARAM;
+			goto err_unlock;
+		}
+	}
+
+	images = make_images_list(di, guid, 1);
+	if (images == NULL) {
+		ret = SYSEXIT_DISKDESCR;
+		goto err_unlock;
+	}
+	n = get_list_size(images);
+
+	r = calloc(1, sizeof(struct ploop_image_reader));
+	if (r == NULL) {
+		ret = SYSEXIT_MALLOC;
+		goto err_unlock;
+	}
+	r->raw_fd = -1;
+
+	if (di->mode == PLOOP_RAW_MODE) {
+		r->raw_fd = open(images[--n], O_RDONLY|O_CLOEXEC);
+		if (r->raw_fd == -1) {
+			ploop_err(errno, "Can't open %s", images[n]);
+			ret = SYSEXIT_OPEN;
+			goto err;
+		}
+	}
+
+	r->deltas = calloc(n, sizeof(struct delta));
+	if (r->deltas == NULL) {
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (open_delta(&r->deltas[i], images[i], O_RDONLY, OD_ALLOW_DIRTY)) {
+			ret = SYSEXIT_OPEN;
+			goto err;
+		}
+		r->nr_deltas++;
+	}
+
+	if (n) {
+		struct ploop_pvd_header *vh = (struct ploop_pvd_header *)r->deltas[0].hdr0;
+
+		r->cluster = S2B(r->deltas[0].blocksize);
+		r->size = S2B(get_SizeInSectors(vh));
+	} else {
+		struct stat st;
+
+		if (fstat(r->raw_fd, &st)) {
+			ploop_err(errno, "Can't stat %s", images[0]);
+			ret = SYSEXIT_FSTAT;
+			goto err;
+		}
+		r->cluster = S2B(di->blocksize);
+		r->size = st.st_size;
+	}
+
+	r->nr_clusters = (r->size + r->cluster - 1) / r->cluster;
+	r->level = malloc((size_t)r->nr_clusters * sizeof(__u16));
+	r->iblk = malloc((size_t)r->nr_clusters * sizeof(__u32));
+	if (r->level == NULL || r->iblk == NULL) {
+		ploop_err(ENOMEM, "Can't allocate cluster map");
+		ret = SYSEXIT_MALLOC;
+		goto err;
+	}
+	memset(r->level, 0xff, (size_t)r->nr_clusters * sizeof(__u16));
+
+	for (i = 0; i < r->nr_deltas; i++) {
+		if (r->deltas[i].blocksize != r->deltas[0].blocksize) {
+			ploop_err(0, "Deltas with different cluster size"
+					" are not supported");
+			ret = SYSEXIT_PARAM;
+			goto err;
+		}
+		ret = reader_map_delta(r, i);
+		if (ret)
+			goto err;
+	}
+
+	for (i = 0; i < READER_CACHE_SIZE; i++) {
+		if (p_memalign(&r->cache[i].buf, 4096, r->cluster)) {
+			ret = SYSEXIT_MALLOC;
+			goto err;
+		}
+	}
+	r->last_clu = r->ra_clu = UINT_MAX;
+
+	ploop_unlock_dd(di);
+	ploop_free_array(images);
+	*out = r;
+
+	return 0;
+
+err:
+	ploop_image_reader_close(r);
+err_unlock:
+	ploop_unlock_dd(di);
+	ploop_free_array(images);
+
+	return ret;
+}
+
+__u64 ploop_image_reader_get_size(struct ploop_image_reader *r)
+{
+	return r->size;
+}
+
+/* Read len bytes of cluster clu data at offset off, no caching */
+static int reader_read(struct ploop_image_reader *r, __u32 clu,
+		void *buf, __u64 len, __u64 off)
+{
+	if (r->level[clu] == READER_HOLE) {
+		ssize_t n = 0;
+
+		if (r->raw_fd != -1) {
+			n = pread(r->raw_fd, buf, len, (off_t)clu * r->cluster + off);
+			if (n == -1) {
+				ploop_err(errno, "Can't read raw image");
+				return SYSEXIT_READ;
+			}
+		}
+		/* the raw image may be shorter than the disk */
+		memset((char *)buf + n, 0, len - n);
+		return 0;
+	}
+
+	return PREAD(&r->deltas[r->level[clu]], buf, len,
+			(off_t)r->iblk[clu] * r->cluster + off) ? SYSEXIT_READ : 0;
+}
+
+static void reader_readahead(struct ploop_image_reader *r, __u32 clu)
+{
+	__u32 i, end;
+
+	if (clu != r->last_clu + 1 || (r->ra_clu != UINT_MAX && clu < r->ra_clu))
+		goto out;
+
+	end = MIN(clu + READER_READAHEAD, r->nr_clusters);
+	for (i = clu; i < end; i++) {
+		if (r->level[i] == READER_HOLE)
+			continue;
+		posix_fadvise(r->deltas[r->level[i]].fd,
+				(off_t)r->iblk[i] * r->cluster, r->cluster,
+				POSIX_FADV_WILLNEED);
+	}
+	r->ra_clu = end;
+out:
+	r->last_clu = clu;
+}
+
+static void *reader_get_cached(struct ploop_image_reader *r, __u32 clu)
+{
+	struct reader_cache *c = &r->cache[clu % READER_CACHE_SIZE];
+
+	if (c->valid && c->clu == clu)
+		return c->buf;
+
+	c->valid = 0;
+	if (reader_read(r, clu, c->buf, r->cluster, 0))
+		return NULL;
+	c->clu = clu;
+	c->valid = 1;
+
+	return c->buf;
+}
+
+ssize_t ploop_image_reader_pread(struct ploop_image_reader *r, void *buf,
+		size_t size, off_t pos)
+{
+	__u64 done = 0;
+
+	if (pos < 0) {
+		errno = EINVAL;
+		return -1;
+	}
+	if ((__u64)pos >= r->size)
+		return 0;
+	size = MIN(size, r->size - pos);
+
+	while (done < size) {
+		__u32 clu = (pos + done) / r->cluster;
+		__u64 off = (pos + done) % r->cluster;
+		__u64 len = MIN(r->cluster - off, size - done);
+
+		reader_readahead(r, clu);
+
+		if (len < r->cluster) {
+			void *c = reader_get_cached(r, clu);
+
+			if (c == NULL)
+				return -1;
+			memcpy((char *)buf + done, (char *)c + off, len);
+		} else {
+			__u32 last = clu;
+
+			/* coalesce clusters contiguous in the same delta */
+			while (last + 1 < r->nr_clusters &&
+					size - done >= len + r->cluster &&
+					r->level[last + 1] == r->level[clu] &&
+					(r->level[clu] == READER_HOLE ||
+					 r->iblk[last + 1] == r->iblk[last] + 1)) {
+				last++;
+				len += r->cluster;
+			}
+
+			if (reader_read(r, clu, (char *)buf + done, len, 0))
+				return -1;
+			r->last_clu = last;
+		}
+		done += len;
+	}
+
+	return done;
+}
+
+ssize_t ploop_image_reader_preadv(struct ploop_image_reader *r,
+		const struct iovec *iov, int iovcnt, off_t pos)
+{
+	ssize_t n, total = 0;
+	int i;
+
+	for (i = 0; i < iovcnt; i++) {
+		n = ploop_image_reader_pread(r, iov[i].iov_base,
+				iov[i].iov_len, pos + total);
+		if (n == -1)
+			return -1;
+		total += n;
+		if ((size_t)n < iov[i].iov_len)
+			break;
+	}
+
+	return total;
+}
@@ -30,6 +30,7 @@
 #include <signal.h>
 #include <time.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #include "ploop.h"
 
@@ -82,6 +83,26 @@ int do_open(const char *fname, int flags)
 	return -1;
 }
 
+/* The locks are open file description (OFD) locks, so threads of one
+ * process exclude each other, and closing some other descriptor of the
+ * file does not drop the lock. A thread may lock a file it already holds,
+ * e.g. volumes sharing the base delta: such a nested lock is not taken
+ * on the file, it only keeps the descriptor until ploop_unlock().
+ */
+struct held_lock {
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	pthread_t owner;
+	int nested;
+	struct held_lock *next;
+};
+
+static struct held_lock *held_locks;
+static pthread_mutex_t held_locks_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* cleared if the kernel has no OFD locks */
+static volatile int use_ofd = 1;
+
 static int lock_fcntl(int fd, int cmd, off_t start, off_t len,
 		short type, struct flock *out)
 {
@@ -93,7 +114,16 @@ static int lock_fcntl(int fd, int cmd, off_t start, off_t len,
 		.l_type = type,
 	};
 
-	rc = TEMP_FAILURE_RETRY(fcntl(fd, cmd, &fl));
+	if (use_ofd) {
+		rc = TEMP_FAILURE_RETRY(fcntl(fd, cmd == F_GETLK ?
+					F_OFD_GETLK : F_OFD_SETLK, &fl));
+		if (rc && errno == EINVAL) {
+			ploop_log(0, "OFD locks are not supported, use POSIX locks");
+			use_ofd = 0;
+		}
+	}
+	if (!use_ofd)
+		rc = TEMP_FAILURE_RETRY(fcntl(fd, cmd, &fl));
 	if (rc) {
 		ploop_err(errno, "Can not lock");
 		return rc;
@@ -137,7 +167,11 @@ static int lock_test(int fd, off_t start, unsigned int tm)
 			sleep(1);
 	} while (tm--);
 
-	ploop_err(0, "Already locked by pid %d", fl.l_pid);
+	/* the pid is not known for OFD locks */
+	if (fl.l_pid > 0)
+		ploop_err(0, "Already locked by pid %d", fl.l_pid);
+	else
+		ploop_err(0, "Already locked");
 
 	return -1;
 }
@@ -163,15 +197,90 @@ static int do_lock_unlock(int fd)
 	return rc;
 }
 
+/* Returns 1 if the calling thread already holds the lock of st */
+static int is_held(const struct stat *st)
+{
+	struct held_lock *h;
+	int ret = 0;
+
+	pthread_mutex_lock(&held_locks_mutex);
+	for (h = held_locks; h != NULL; h = h->next) {
+		if (!h->nested && h->dev == st->st_dev && h->ino == st->st_ino &&
+				pthread_equal(h->owner, pthread_self())) {
+			ret = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&held_locks_mutex);
+
+	return ret;
+}
+
+static int add_held(int fd, const struct stat *st, int nested)
+{
+	struct held_lock *h;
+
+	h = malloc(sizeof(*h));
+	if (h == NULL) {
+		ploop_err(ENOMEM, "Can not lock");
+		return -1;
+	}
+	h->fd = fd;
+	h->dev = st->st_dev;
+	h->ino = st->st_ino;
+	h->owner = pthread_self();
+	h->nested = nested;
+
+	pthread_mutex_lock(&held_locks_mutex);
+	h->next = held_locks;
+	held_locks = h;
+	pthread_mutex_unlock(&held_locks_mutex);
+
+	return 0;
+}
+
+/* Returns 1 if fd is a nested lock, 0 otherwise */
+static int del_held(int fd)
+{
+	struct held_lock **p, *h;
+	int nested = 0;
+
+	pthread_mutex_lock(&held_locks_mutex);
+	for (p = &held_locks; *p != NULL; p = &(*p)->next) {
+		if ((*p)->fd == fd) {
+			h = *p;
+			*p = h->next;
+			nested = h->nested;
+			free(h);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&held_locks_mutex);
+
+	return nested;
+}
+
 int lock(const char *fname, int long_op, unsigned int timeout)
 {
 	int fd, r;
+	struct stat st;
 
 	if ((fd = do_open(fname, O_RDONLY | O_CLOEXEC)) == -1) {
 		ploop_err(errno, "Can not open %s", fname);
 		return -1;
 	}
 
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can not stat %s", fname);
+		goto err_close;
+	}
+
+	if (is_held(&st)) {
+		if (add_held(fd, &st, 1))
+			goto err_close;
+		return fd;
+	}
+
 	r = do_lock_test(fd, timeout);
 	if (r)
 		goto err_close;
@@ -184,6 +293,9 @@ int lock(const char *fname, int long_op, unsigned int timeout)
 	if (r)
 		goto err;
 
+	if (add_held(fd, &st, 0))
+		goto err;
+
 	return fd;
 
 err:
@@ -196,7 +308,8 @@ err_close:
 void ploop_unlock(int *lckfd)
 {
 	if (*lckfd != -1) {
-		do_lock_unlock(*lckfd);
+		if (!del_held(*lckfd))
+			do_lock_unlock(*lckfd);
 		close(*lckfd);
 		*lckfd = -1;
 	}
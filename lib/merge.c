@@ -107,7 +107,7 @@ static int grow_lower_delta(const char *device, int top,
 {
 	off_t src_size = 0; /* bdsize of source delta to merge */
 	off_t dst_size = 0; /* bdsize of destination delta for merge */
-	int i;
+	int i, j;
 	struct ploop_pvd_header *vh;
 	struct grow_maps grow_maps;
 	int fmt;
@@ -178,14 +178,14 @@ static int grow_lower_delta(const char *device, int top,
 		if (ret)
 			goto done;
 
-		/* nullify relocated blocks on disk */
-		memset(buf, 0, cluster);
-		for (i = 0; i < grow_maps.ctl->n_maps; i++) {
-			if (PWRITE(&odelta, buf, cluster,
-						(off_t)(grow_maps.zblks[i]) * cluster)) {
-				ret = SYSEXIT_WRITE;
+		/* nullify relocated blocks on disk, zblks are sorted */
+		for (i = 0; i < grow_maps.ctl->n_maps; i = j) {
+			for (j = i + 1; j < grow_maps.ctl->n_maps &&
+					grow_maps.zblks[j] == grow_maps.zblks[j - 1] + 1; j++)
+				;
+			ret = zero_clusters(&odelta, grow_maps.zblks[i], j - i);
+			if (ret)
 				goto done;
-			}
 		}
 	}
 
@@ -213,8 +213,20 @@ done:
 	return ret;
 }
 
+/* Check if the cluster at pos in delta has the same content as buf */
+static int is_same_cluster(struct delta *delta, void *buf, void *cmp,
+		__u64 cluster, off_t pos, int *same)
+{
+	if (PREAD(delta, cmp, cluster, pos))
+		return SYSEXIT_READ;
+
+	*same = memcmp(buf, cmp, cluster) == 0;
+
+	return 0;
+}
+
 int merge_image(const char *device, int start_level, int end_level, int raw,
-		int merge_top, char **images, const char *new_image)
+		int merge_top, char **images, const char *new_image, int flags)
 {
 	int last_delta = 0;
 	char **names = NULL;
@@ -225,6 +237,8 @@ int merge_image(const char *device, int start_level, int end_level, int raw,
 	__u32 allocated = 0;
 	__u64 cluster;
 	void *data_cache = NULL;
+	void *cmp_cache = NULL;
+	__u32 skipped = 0;
 	__u32 blocksize;
 	int version = PLOOP_FMT_UNDEFINED;
 	const char *merged_image;
@@ -357,6 +371,15 @@ rm_delta:
 		goto merge_done2;
 	}
 
+	/* Nothing to compare with in a newly created image */
+	if (new_image)
+		flags &= ~PLOOP_MERGE_SKIP_IDENTICAL;
+	if ((flags & PLOOP_MERGE_SKIP_IDENTICAL) &&
+			p_memalign(&cmp_cache, 4096, cluster)) {
+		ret = SYSEXIT_MALLOC;
+		goto merge_done2;
+	}
+
 	if (!device && !new_image) {
 		struct ploop_pvd_header *vh;
 		vh = (struct ploop_pvd_header *)da.delta_arr[0].hdr0;
@@ -443,6 +466,19 @@ rm_delta:
 			if (raw) {
 				off_t opos;
 				opos = i * (cluster/4) + k - PLOOP_MAP_OFFSET;
+				if (cmp_cache) {
+					int same;
+
+					ret = is_same_cluster(&odelta, data_cache,
+							cmp_cache, cluster,
+							opos * cluster, &same);
+					if (ret)
+						goto merge_done;
+					if (same) {
+						skipped++;
+						continue;
+					}
+				}
 				if (PWRITE(&odelta, data_cache, cluster,
 					   opos*cluster)) {
 					ret = SYSEXIT_WRITE;
@@ -489,6 +525,20 @@ rm_delta:
 				}
 				odelta.l2_dirty = 1;
 				allocated++;
+			} else if (cmp_cache) {
+				int same;
+
+				ret = is_same_cluster(&odelta, data_cache,
+						cmp_cache, cluster,
+						S2B(ploop_ioff_to_sec(odelta.l2[k],
+								blocksize, version)),
+						&same);
+				if (ret)
+					goto merge_done;
+				if (same) {
+					skipped++;
+					continue;
+				}
 			}
 			if (PWRITE(&odelta, data_cache, cluster,
 						S2B(ploop_ioff_to_sec(odelta.l2[k],
@@ -499,6 +549,9 @@ rm_delta:
 		}
 	}
 
+	if (cmp_cache)
+		ploop_log(0, "Skipped %u identical clusters", skipped);
+
 	if (fsync(odelta.fd)) {
 		ploop_err(errno, "fsync");
 		ret = SYSEXIT_FSYNC;
@@ -572,6 +625,7 @@ merge_done2:
 		ploop_move_cbt(images[0], images[1]);
 
 	free(data_cache);
+	free(cmp_cache);
 	free(hb);
 	deinit_delta_array(&da);
 	close_delta(&odelta);
@@ -822,7 +876,7 @@ err1:
 }
 
 int ploop_delete_snapshot_by_guid(struct ploop_disk_images_data *di,
-		const char *guid, const char *new_delta)
+		const char *guid, const char *new_delta, int flags)
 {
 	char conf[PATH_MAX];
 	char conf_tmp[PATH_MAX];
@@ -841,6 +895,7 @@ int ploop_delete_snapshot_by_guid(struct ploop_disk_images_data *di,
 	int online = 0;
 	int sid, child_idx; /* parent and child snapshot ids */
 	int i, nelem;
+	__u64 t;
 
 	ret = SYSEXIT_PARAM;
 	sid = find_snapshot_by_guid(di, guid);
@@ -903,7 +958,9 @@ int ploop_delete_snapshot_by_guid(struct ploop_disk_images_data *di,
 			return SYSEXIT_FSTAT;
 		}
 
+		t = timing_begin();
 		ret = complete_running_operation(di, dev);
+		timing_end("complete_running_operation", t);
 		if (ret)
 			return ret;
 		if ((ret = ploop_get_names(dev, &names)))
@@ -1020,8 +1077,10 @@ int ploop_delete_snapshot_by_guid(struct ploop_disk_images_data *di,
 	if (ret)
 		goto err;
 
+	t = timing_begin();
 	ret = merge_image(device, start_level, end_level, raw, merge_top_online,
-			names, new_delta);
+			names, new_delta, flags);
+	timing_end("merge_image", t);
 	if (ret)
 		goto err;
 
@@ -1094,9 +1153,14 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 {
 	int ret = SYSEXIT_PARAM;
 	int idx;
+	__u64 t;
 
-	if (ploop_lock_dd(di))
+	t = timing_begin();
+	ret = ploop_lock_dd(di);
+	timing_end("lock", t);
+	if (ret)
 		return SYSEXIT_LOCK;
+	ret = SYSEXIT_PARAM;
 
 	if (param->merge_all) {
 		int i;
@@ -1113,7 +1177,7 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 			}
 
 			ret = ploop_delete_snapshot_by_guid(di, di->snapshots[i]->guid,
-							param->new_delta);
+							param->new_delta, param->flags);
 		}
 		if (ret == SYSEXIT_PARAM)
 			ploop_err(0, "Cannot find any snapshot by uuid %s", param->guid);
@@ -1127,7 +1191,7 @@ int ploop_merge_snapshot(struct ploop_disk_images_data *di, struct ploop_merge_p
 	}
 
 	ret = ploop_delete_snapshot_by_guid(di, di->snapshots[idx]->parent_guid,
-					param->new_delta);
+					param->new_delta, param->flags);
 err:
 	ploop_unlock_dd(di);
 
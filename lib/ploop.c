@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/mount.h>
+#include <sys/param.h>
 #include <sys/sysmacros.h>
 #include <limits.h>
 #include <sys/file.h>
@@ -39,6 +40,8 @@
 #include <stdint.h>
 #include <time.h>
 #include <sched.h>
+#include <pthread.h>
+#include <dirent.h>
 
 #include "ploop.h"
 #include "cleanup.h"
@@ -1395,11 +1398,6 @@ int ploop_is_mounted(struct ploop_disk_images_data *di)
 }
 
 
-int reread_part(const char *device)
-{
-	return partprobe(device);
-}
-
 static int mount_fs(struct ploop_disk_images_data *di,
 		const char *partname, struct ploop_mount_param *param)
 {
@@ -1529,6 +1527,79 @@ int mknod_with_name(const char *name)
 	return get_free_minor(name, NULL, 0);
 }
 
+#define MINOR_FIRST	1000
+#define MINOR_LAST	(0xffff + MINOR_FIRST - 1)
+
+/* Reserve device nodes for all params with no device set, with a single
+ * /sys/block scan and a single global lock. Returns the number of nodes
+ * reserved, reserved[i] is set for the params a node was reserved for.
+ */
+static int get_free_minors(struct ploop_mount_param *param, int n,
+		int *reserved)
+{
+	unsigned char *used;
+	struct dirent *de;
+	struct timespec ts = {0, 0};
+	DIR *dp;
+	int i, m, start, g_lock, nr = 0;
+
+	memset(reserved, 0, n * sizeof(int));
+	used = calloc(MINOR_LAST + 1, 1);
+	if (used == NULL)
+		return -1;
+
+	dp = opendir("/sys/block");
+	if (dp == NULL) {
+		ploop_err(errno, "Can't open /sys/block");
+		free(used);
+		return -1;
+	}
+	while ((de = readdir(dp)) != NULL)
+		if (sscanf(de->d_name, "dm-%d", &m) == 1 &&
+				m >= MINOR_FIRST && m <= MINOR_LAST)
+			used[m] = 1;
+	closedir(dp);
+
+	g_lock = ploop_global_lock();
+	if (g_lock == -1) {
+		free(used);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	start = ts.tv_nsec % (MINOR_LAST - MINOR_FIRST + 1);
+	m = 0;
+	for (i = 0; i < n; i++) {
+		if (param[i].device[0] != '\0')
+			continue;
+
+		for (; m <= MINOR_LAST - MINOR_FIRST; m++) {
+			int minor = (start + m) % (MINOR_LAST - MINOR_FIRST + 1) +
+					MINOR_FIRST;
+
+			if (used[minor])
+				continue;
+			snprintf(param[i].device, sizeof(param[i].device),
+					"/dev/mapper/ploop%d", minor);
+			if (mknod(param[i].device, S_IFBLK, makedev(253, minor)) == 0) {
+				reserved[i] = 1;
+				nr++;
+				m++;
+				break;
+			}
+		}
+		if (!reserved[i]) {
+			/* let ploop_mount() allocate it */
+			param[i].device[0] = '\0';
+			break;
+		}
+	}
+	ploop_unlock(&g_lock);
+	free(used);
+
+	return nr;
+}
+
 static int blockdev_set_untrusted(const char *devname)
 {
 	int fd;
@@ -2233,6 +2304,7 @@ static int add_deltas(struct ploop_disk_images_data *di,
 	int n = 0, ret = 0;
 	int format_extension_loaded = 0;
 	struct ext_context *ctx = NULL;
+	__u64 t;
 
 	int ro = param->ro || (di && di->vol && di->vol->ro) ? 1: 0;
 	for (n = 0; images[n] != NULL; ++n);
@@ -2251,7 +2323,9 @@ static int add_deltas(struct ploop_disk_images_data *di,
 			goto err;
 		}
 
+		t = timing_begin();
 		rc = read_optional_header_from_image(ctx, images[n-1], DIRTY_BITMAP_TRUNCATE);
+		timing_end("read_cbt", t);
 		if (rc)
 			ploop_log(0, "Error while loding optional header: %d", rc);
 		else
@@ -2259,7 +2333,9 @@ static int add_deltas(struct ploop_disk_images_data *di,
 	}
 
 
+	t = timing_begin();
 	ret = add_delta(images, param->device, 0, blocksize, raw, ro, sizeof(param->device));
+	timing_end("add_delta", t);
 	if (ret)
 		goto err;
 
@@ -2267,8 +2343,11 @@ static int add_deltas(struct ploop_disk_images_data *di,
 //			(ret = set_max_delta_size(*lfd_p, di->max_delta_size)))
 //		goto err1;
 
-	if (format_extension_loaded)
+	if (format_extension_loaded) {
+		t = timing_begin();
 		send_dirty_bitmap_to_kernel(ctx, param->device, images[n-1]);
+		timing_end("send_dirty_bitmap_to_kernel", t);
+	}
 
 //	ret = check_and_repair_gpt(param->device, blocksize);
 //	if (ret)
@@ -2437,6 +2516,7 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 	const char *guid;
 	char buf [PATH_MAX];
 	char *target = param->target;
+	__u64 t;
 
 	if (param->guid != NULL) {
 		if (find_image_by_guid(di, param->guid) == NULL) {
@@ -2476,18 +2556,25 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 		images = i;
 	}
 
-	if (check_mount_restrictions(images)) {
+	t = timing_begin();
+	ret = check_mount_restrictions(images);
+	timing_end("check_mount_restrictions", t);
+	if (ret) {
 		ret = SYSEXIT_MOUNT;
 		goto err;
 	}
 
 	if (di && di->runtime->image_fmt == QCOW_FMT) {
+		t = timing_begin();
 		ret = qcow_mount(di, param);
+		timing_end("qcow_mount", t);
 		if (ret)
 			goto err;
 	} else {
+		t = timing_begin();
 		ret = check_deltas(di, images, raw, &blocksize, &load_cbt,
 			di ? CHECK_DROPINUSE : 0);
+		timing_end("check_deltas", t);
 		if (ret)
 			goto err;
 
@@ -2497,27 +2584,36 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 	}
 
 	if (di && di->enc) {
+		t = timing_begin();
 		ret = crypt_open(param->device, di->enc->keyid);
+		timing_end("crypt_open", t);
 		if (ret)
 			goto err_stop;
 	} else {
 		/* Dummy call to recreate devices */
-		if(!param->noprobe)
+		if(!param->noprobe) {
+			t = timing_begin();
 			reread_part(param->device);
+			timing_end("reread_part", t);
+		}
 	}
 
 	if (param->noprobe)
 		goto out_no_partprobe;
 
+	t = timing_begin();
 	ret = get_part_devname(di, param->device, devname, sizeof(devname),
 			partname, sizeof(partname));
+	timing_end("get_part_devname", t);
 	if (ret)
 		goto err_stop;
 	/*
 	 * Disallow accidental code execution from a newly created block device
 	 * from an image.
 	 */
+	t = timing_begin();
 	ret = blockdev_set_untrusted(partname);
+	timing_end("blockdev_set_untrusted", t);
 	if (ret)
 		goto err_stop;
 
@@ -2542,7 +2638,9 @@ int ploop_mount(struct ploop_disk_images_data *di, char **images,
 	if (target != NULL || param->fsck) {
 		char *x = param->target;
 		param->target = target;
+		t = timing_begin();
 		ret = mount_fs(di, partname, param);
+		timing_end("mount_fs", t);
 		param->target = x;
 		if (ret)
 			goto err_stop;
@@ -2561,7 +2659,9 @@ err_stop:
 err:
 out_no_partprobe:
 	if (ret == 0) {
+		t = timing_begin();
 		ret = cn_register(param->device, di);
+		timing_end("cn_register", t);
 		if (ret)
 			goto err_stop;
 		if (di && di->runtime->component_name == NULL &&
@@ -2744,8 +2844,12 @@ int ploop_mount_image(struct ploop_disk_images_data *di,
 {
 	int ret;
 	char dev[64];
+	__u64 t;
 
-	if (ploop_lock_dd(di))
+	t = timing_begin();
+	ret = ploop_lock_dd(di);
+	timing_end("lock", t);
+	if (ret)
 		return SYSEXIT_LOCK;
 
 	ret = ploop_find_dev_by_dd(di, dev, sizeof(dev));
@@ -2767,8 +2871,11 @@ int ploop_mount_image(struct ploop_disk_images_data *di,
 	}
 
 	ret = ploop_mount(di, NULL, param, (di->mode == PLOOP_RAW_MODE));
-	if (ret == 0 && di->runtime->component_name == NULL)
+	if (ret == 0 && di->runtime->component_name == NULL) {
+		t = timing_begin();
 		merge_temporary_snapshots(di);
+		timing_end("merge_temporary_snapshots", t);
+	}
 err:
 	ploop_unlock_dd(di);
 
@@ -2784,6 +2891,142 @@ int ploop_mount_snapshot(struct ploop_disk_images_data *di, struct ploop_mount_p
 	return ploop_mount_image(di, param);
 }
 
+struct mount_sched {
+	struct ploop_disk_images_data **di;
+	struct ploop_mount_param *param;
+	int *reserved;
+	int *result;
+	int nr_disks;
+	int next;
+	pthread_mutex_t lock;
+	const struct ploop_mount_many_param *mp;
+};
+
+/* Remove a node reserved by get_free_minors() unless it is in use */
+static void release_minor(char *device)
+{
+	int m;
+	char b[64];
+
+	if (sscanf(get_basename(device), "ploop%d", &m) != 1)
+		return;
+	snprintf(b, sizeof(b), "/sys/block/dm-%d", m);
+	if (access(b, F_OK) && unlink(device) && errno != ENOENT)
+		ploop_err(errno, "Can't remove %s", device);
+	device[0] = '\0';
+}
+
+static void *mount_worker_thread(void *arg)
+{
+	struct mount_sched *s = arg;
+	int n, ret;
+
+	while (1) {
+		pthread_mutex_lock(&s->lock);
+		if (s->next == s->nr_disks ||
+				(s->mp->stop && *s->mp->stop)) {
+			pthread_mutex_unlock(&s->lock);
+			break;
+		}
+		n = s->next++;
+		pthread_mutex_unlock(&s->lock);
+
+		ret = ploop_mount_image(s->di[n], &s->param[n]);
+		if (ret && s->reserved[n]) {
+			release_minor(s->param[n].device);
+			s->reserved[n] = 0;
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->result[n] = ret;
+		if (s->mp->complete)
+			s->mp->complete(n, ret, &s->param[n], s->mp->data);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+/* Mount n images by up to mp->max_jobs workers. Device minors are
+ * reserved for all of them at once, then check, device setup, partition
+ * discovery and file system mount of different images run in parallel.
+ * result[i] gets the ploop_mount_image() result of di[i], mp->complete
+ * is called as soon as each image is processed. mp may be NULL.
+ */
+int ploop_mount_many(struct ploop_disk_images_data **di,
+		struct ploop_mount_param *param, int n, int *result,
+		const struct ploop_mount_many_param *mp)
+{
+	int i, nr_workers, ret = 0;
+	pthread_t *th = NULL;
+	const struct ploop_mount_many_param def_mp = {};
+	struct mount_sched s = {
+		.di = di,
+		.param = param,
+		.result = result,
+		.nr_disks = n,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.mp = mp != NULL ? mp : &def_mp,
+	};
+
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		result[i] = SYSEXIT_ABORT;
+
+	s.reserved = malloc(n * sizeof(int));
+	if (s.reserved == NULL)
+		return SYSEXIT_MALLOC;
+
+	if (get_free_minors(param, n, s.reserved) == -1)
+		ploop_log(0, "Warning: can't reserve device minors");
+
+	nr_workers = s.mp->max_jobs > 0 ? s.mp->max_jobs : sysconf(_SC_NPROCESSORS_ONLN);
+	if (nr_workers <= 0)
+		nr_workers = 1;
+	nr_workers = MIN(nr_workers, n);
+
+	th = calloc(nr_workers, sizeof(pthread_t));
+	if (th == NULL) {
+		ret = SYSEXIT_MALLOC;
+		nr_workers = 0;
+		goto out;
+	}
+
+	for (i = 0; i < nr_workers; i++) {
+		int err = pthread_create(&th[i], NULL, mount_worker_thread, &s);
+
+		if (err) {
+			ploop_err(err, "Can't create mount thread");
+			break;
+		}
+	}
+	nr_workers = i;
+	/* no threads, do it ourselves */
+	if (nr_workers == 0)
+		mount_worker_thread(&s);
+
+out:
+	for (i = 0; i < nr_workers; i++)
+		pthread_join(th[i], NULL);
+
+	for (i = 0; i < n; i++) {
+		if (result[i] == 0)
+			continue;
+		if (ret == 0)
+			ret = result[i];
+		/* not processed */
+		if (s.reserved[i])
+			release_minor(param[i].device);
+	}
+
+	free(th);
+	free(s.reserved);
+
+	return ret;
+}
+
 static int ploop_umount_fs(const char *mnt, struct ploop_disk_images_data *di)
 {
 	int ret;
@@ -2800,10 +3043,15 @@ static int ploop_umount_fs(const char *mnt, struct ploop_disk_images_data *di)
 	return ret;
 }
 
+/* Grab the dirty bitmap from the kernel and store it into the top delta
+ * in background, so the device teardown is not delayed by the bitmap
+ * serialization. The writer is to be completed by cbt_write_wait().
+ */
 static int save_cbt(struct ploop_disk_images_data *di, const char *device,
-			struct delta *d)
+			struct delta *d, struct cbt_writer **w)
 {
 	int lfd, ret, rc;
+	void *data = NULL;
 
 	if (di && di->runtime->image_fmt == QCOW_FMT)
 		return 0;
@@ -2823,7 +3071,11 @@ static int save_cbt(struct ploop_disk_images_data *di, const char *device,
 		return SYSEXIT_DEVICE;
 	}
 
-	rc = delta_save_optional_header(lfd, d, NULL, NULL);
+	rc = cbt_get_and_clear(lfd, &data);
+	if (rc == 0)
+		rc = cbt_write_async(d, data, w);
+	else if (rc == SYSEXIT_NOCBT)
+		rc = 0;
 	if (rc)
 		ploop_err(errno, "Warning: saving format extension failed: %d", rc);
 
@@ -2848,7 +3100,9 @@ int ploop_umount(const char *device, struct ploop_disk_images_data *di)
 	int fmt;
 	struct delta d = {.fd = -1};
 	struct ploop_pvd_header *vh;
+	struct cbt_writer *w = NULL;
 	int image_fmt;
+	__u64 t;
 
 	if (!device) {
 		ploop_err(0, "ploop_umount: device is not specified");
@@ -2862,17 +3116,22 @@ int ploop_umount(const char *device, struct ploop_disk_images_data *di)
 		return ret;
 
 	if (get_mount_dir(partname, 0, mnt, sizeof(mnt)) == 0) {
+		t = timing_begin();
 		ret = ploop_umount_fs(mnt, di);
+		timing_end("umount_fs", t);
 		if (ret)
 			return ret;
 	}
 
 	if (get_crypt_layout(devname, partname)) {
+		t = timing_begin();
 		ret = crypt_close(devname, partname);
+		timing_end("crypt_close", t);
 		if (ret)
 			return ret;
 	}
 
+	t = timing_begin();
 	do {
 		ret = get_part_devname_from_sys(device, devname, sizeof(devname),
 				partname, sizeof(partname));
@@ -2886,6 +3145,7 @@ int ploop_umount(const char *device, struct ploop_disk_images_data *di)
 				return ret;
 		}
 	} while (!last);
+	timing_end("remove_partitions", t);
 
 	ret = get_image_param_online(di, device, &top, NULL, NULL,
 			&fmt, &image_fmt);
@@ -2894,18 +3154,24 @@ int ploop_umount(const char *device, struct ploop_disk_images_data *di)
 
 	if (image_fmt == PLOOP_FMT) {
 		if (open_delta(&d, top, O_RDWR, OD_ALLOW_DIRTY) == 0) {
-			ret = save_cbt(di, device, &d);
+			t = timing_begin();
+			ret = save_cbt(di, device, &d, &w);
+			timing_end("save_cbt", t);
 			if (ret)
 				goto err;
 		}
 	} else if (image_fmt == QCOW_FMT) {
+		t = timing_begin();
 		ret = qcow_umount(di, device, top);
+		timing_end("qcow_umount", t);
 		if (ret)
 			goto err;
 	}
 
 	cn_find_name(device, cn, sizeof(cn), 1);
+	t = timing_begin();
 	ret = ploop_stop(device, di);
+	timing_end("ploop_stop", t);
 	if (ret)
 		goto err;
 
@@ -2920,18 +3186,29 @@ int ploop_umount(const char *device, struct ploop_disk_images_data *di)
 			rmdir(mnt);
 	}
 
+	t = timing_begin();
+	if (cbt_write_wait(w))
+		ploop_err(0, "Warning: saving format extension failed");
+	w = NULL;
+	timing_end("write_cbt", t);
+
 	if (image_fmt == PLOOP_FMT && d.hdr0) {
+		t = timing_begin();
 		vh = (struct ploop_pvd_header *) d.hdr0;
 		if (vh->m_DiskInUse == SIGNATURE_DISK_IN_USE) {
 			ret = clear_delta(&d);
 			if (ret)
 				goto err;
 		}
+		timing_end("clear_delta", t);
 	}
 
+	t = timing_begin();
 	ret = check_deltas_live(di, NULL);
+	timing_end("check_deltas_live", t);
 err:
-
+	if (cbt_write_wait(w))
+		ploop_err(0, "Warning: saving format extension failed");
 	close_delta(&d);
 	free(top);
 
@@ -2942,8 +3219,12 @@ int ploop_umount_image(struct ploop_disk_images_data *di)
 {
 	int ret;
 	char dev[64];
+	__u64 t;
 
-	if (ploop_lock_dd(di))
+	t = timing_begin();
+	ret = ploop_lock_dd(di);
+	timing_end("lock", t);
+	if (ret)
 		return SYSEXIT_LOCK;
 
 	ret = ploop_find_dev_by_dd(di, dev, sizeof(dev));
@@ -3489,23 +3770,16 @@ err:
 int ploop_resize_blkdev(const char *device, off_t new_size)
 {
 	int ret, part_num;
-	unsigned long long part_start, part_end;
 	char partname[64];
 
 	ret = get_last_partition_num(device, &part_num);
 	if (ret)
 		return ret;
 
-	ret = get_partition_range(device, part_num, &part_start, &part_end);
+	ret = resize_gpt_partition_num(device, part_num);
 	if (ret)
 		return ret;
 
-	ret = sgdisk_resize_gpt(device, part_num, part_start);
-	if (ret)
-		return ret;
-
-	reread_part(device);
-
 	ret = get_partition_device_name_by_num(device, part_num, partname, sizeof(partname));
 	if (ret)
 		return ret;
@@ -3518,13 +3792,132 @@ int ploop_resize_blkdev(const char *device, off_t new_size)
 	return ret;
 }
 
+#define CONVERT_THREADS		4
+/* Max length of one copy request, bytes */
+#define CONVERT_MAX_RUN		(64 << 20)
+
+struct convert_run {
+	off_t src;
+	off_t dst;
+	__u64 len;
+};
+
+struct convert_copy {
+	pthread_t th;
+	int ifd;
+	int ofd;
+	struct convert_run *runs;
+	int n;
+	int rc;
+};
+
+static int copy_range(int ifd, int ofd, off_t src, off_t dst, __u64 len)
+{
+	void *buf = NULL;
+	int ret = 0;
+
+	while (len) {
+		loff_t s = src, d = dst;
+		ssize_t r = copy_file_range(ifd, &s, ofd, &d, len, 0);
+
+		if (r <= 0) {
+			if (r < 0 && (errno == EXDEV || errno == ENOSYS ||
+					errno == EINVAL || errno == EOPNOTSUPP))
+				break;
+			ploop_err(errno, "copy_file_range");
+			return SYSEXIT_WRITE;
+		}
+		len -= r;
+		src += r;
+		dst += r;
+	}
+
+	if (len == 0)
+		return 0;
+
+	/* copy_file_range is not supported, fall back to read/write */
+	if (p_memalign(&buf, 4096, MIN(len, (__u64)CONVERT_MAX_RUN)))
+		return SYSEXIT_MALLOC;
+
+	while (len) {
+		size_t n = MIN(len, (__u64)CONVERT_MAX_RUN);
+
+		ret = read_safe(ifd, buf, n, src, "Can't read image");
+		if (ret)
+			break;
+		ret = write_safe(ofd, buf, n, dst, "Can't write image");
+		if (ret)
+			break;
+		len -= n;
+		src += n;
+		dst += n;
+	}
+	free(buf);
+
+	return ret;
+}
+
+static void *convert_copy_thread(void *arg)
+{
+	int i;
+	struct convert_copy *c = arg;
+
+	for (i = 0; i < c->n && c->rc == 0; i++)
+		c->rc = copy_range(c->ifd, c->ofd, c->runs[i].src,
+				c->runs[i].dst, c->runs[i].len);
+
+	return NULL;
+}
+
+/* Copy runs using up to CONVERT_THREADS threads, each thread gets
+ * an equal share of bytes.
+ */
+static int copy_runs(int ifd, int ofd, struct convert_run *runs, int n)
+{
+	struct convert_copy c[CONVERT_THREADS] = {};
+	__u64 total = 0, share, acc;
+	int i, first, nr = 0, ret = 0;
+
+	for (i = 0; i < n; i++)
+		total += runs[i].len;
+	share = total / CONVERT_THREADS + 1;
+
+	for (i = 0, first = 0, acc = 0; i < n; i++) {
+		acc += runs[i].len;
+		if (acc < share && i != n - 1)
+			continue;
+
+		c[nr].ifd = ifd;
+		c[nr].ofd = ofd;
+		c[nr].runs = runs + first;
+		c[nr].n = i - first + 1;
+		if (pthread_create(&c[nr].th, NULL, convert_copy_thread, &c[nr])) {
+			ploop_err(errno, "Can't create copy thread");
+			ret = SYSEXIT_SYS;
+			break;
+		}
+		nr++;
+		first = i + 1;
+		acc = 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		pthread_join(c[i].th, NULL);
+		if (c[i].rc && ret == 0)
+			ret = c[i].rc;
+	}
+
+	return ret;
+}
+
 static int expanded2raw(struct ploop_disk_images_data *di)
 {
 	struct delta delta = {};
 	struct delta odelta = {};
+	struct convert_run *runs = NULL;
 	__u32 clu;
-	void *buf = NULL;
 	char tmp[PATH_MAX] = "";
+	int n = 0, alloc = 0;
 	int ret = -1;
 	__u64 cluster;
 
@@ -3534,17 +3927,16 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 		return SYSEXIT_OPEN;
 	cluster = S2B(delta.blocksize);
 
-	if (p_memalign(&buf, 4096, cluster))
-		goto err;
-
 	snprintf(tmp, sizeof(tmp), "%s.tmp",
 			di->images[0]->file);
 	if (open_delta_simple(&odelta, tmp, O_RDWR|O_CREAT|O_EXCL|O_TRUNC, OD_OFFLINE))
 		goto err;
 
+	/* Collect mapped clusters coalesced into runs, holes are skipped */
 	for (clu = 0; clu < delta.l2_size; clu++) {
 		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
 		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+		off_t src;
 
 		if (l2_cluster >= delta.l1_size) {
 			ploop_err(0, "abort: l2_cluster >= delta.l1_size");
@@ -3563,18 +3955,42 @@ static int expanded2raw(struct ploop_disk_images_data *di)
 					l2_slot, delta.l2[l2_slot]);
 			goto err;
 		}
-		if (delta.l2[l2_slot] != 0) {
-			if (PREAD(&delta, buf, cluster, S2B(ploop_ioff_to_sec(delta.l2[l2_slot],
-								delta.blocksize, delta.version))))
+		if (delta.l2[l2_slot] == 0)
+			continue;
+
+		src = S2B(ploop_ioff_to_sec(delta.l2[l2_slot],
+					delta.blocksize, delta.version));
+		if (n && runs[n - 1].src + runs[n - 1].len == src &&
+				runs[n - 1].dst + runs[n - 1].len == clu * cluster &&
+				runs[n - 1].len + cluster <= CONVERT_MAX_RUN) {
+			runs[n - 1].len += cluster;
+			continue;
+		}
+
+		if (n == alloc) {
+			struct convert_run *t;
+
+			alloc = alloc ? alloc * 2 : 1024;
+			t = realloc(runs, alloc * sizeof(struct convert_run));
+			if (t == NULL) {
+				ploop_err(ENOMEM, "Can't allocate runs");
 				goto err;
-		} else {
-			bzero(buf, cluster);
+			}
+			runs = t;
 		}
+		runs[n].src = src;
+		runs[n].dst = clu * cluster;
+		runs[n++].len = cluster;
+	}
 
-		if (PWRITE(&odelta, buf, cluster, clu * cluster))
-			goto err;
+	if (ftruncate(odelta.fd, (off_t)delta.l2_size * cluster)) {
+		ploop_err(errno, "Can't truncate %s", tmp);
+		goto err;
 	}
 
+	if (copy_runs(delta.fd, odelta.fd, runs, n))
+		goto err;
+
 	if (fsync(odelta.fd))
 		ploop_err(errno, "fsync");
 
@@ -3589,29 +4005,65 @@ err:
 	if (ret && tmp[0])
 		unlink(tmp);
 	close_delta(&delta);
-	free(buf);
+	free(runs);
 
 	return ret;
 }
 
+static int expand_delta(struct delta *delta, off_t off, off_t len)
+{
+	void *buf;
+	off_t n;
+
+	if (sys_fallocate(delta->fd, 0, off, len) == 0)
+		return 0;
+
+	if (errno != ENOTSUP) {
+		ploop_err(errno, "Failed to expand image");
+		return SYSEXIT_WRITE;
+	}
+
+	ploop_log(0, "Warning: fallocate is not supported,"
+			" using write instead");
+	buf = calloc(1, CONVERT_MAX_RUN);
+	if (buf == NULL) {
+		ploop_err(errno, "malloc");
+		return SYSEXIT_MALLOC;
+	}
+
+	for (; len; len -= n, off += n) {
+		n = MIN(len, CONVERT_MAX_RUN);
+		if (PWRITE(delta, buf, n, off)) {
+			free(buf);
+			return SYSEXIT_WRITE;
+		}
+	}
+	free(buf);
+
+	return 0;
+}
+
 static int expanded2preallocated(struct ploop_disk_images_data *di)
 {
 	struct delta delta = {};
-	__u32 clu;
+	__u32 clu, holes = 0;
 	off_t data_off;
 	int ret = -1;
 	__u64 cluster;
-	void *buf = NULL;
+	int dirty = 0;
 
 	ploop_log(0, "Converting image to preallocated...");
 	// FIXME: deny on snapshots
 	if (open_delta(&delta, di->images[0]->file, O_RDWR, OD_OFFLINE))
 		return SYSEXIT_OPEN;
 
+	/* the clusters are appended past the summary */
+	delta_drop_alloc_summary(&delta);
+
 	cluster = S2B(delta.blocksize);
 	data_off = delta.alloc_head;
 
-	// Second stage: update index
+	// First stage: count holes and allocate space for them at once
 	for (clu = 0; clu < delta.l2_size; clu++) {
 		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
 		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
@@ -3626,39 +4078,50 @@ static int expanded2preallocated(struct ploop_disk_images_data *di)
 				goto err;
 			delta.l2_cache = l2_cluster;
 		}
-		if (delta.l2[l2_slot] == 0) {
-			off_t idx_off = (off_t)l2_cluster * cluster + (l2_slot*sizeof(__u32));
-			int rc;
+		if (delta.l2[l2_slot] == 0)
+			holes++;
+	}
 
-			delta.l2[l2_slot] = ploop_sec_to_ioff(data_off * delta.blocksize,
-					delta.blocksize, delta.version);
+	if (holes == 0) {
+		ret = 0;
+		goto err;
+	}
 
-			rc = sys_fallocate(delta.fd, 0, data_off * cluster, cluster);
-			if (rc) {
-				if (errno == ENOTSUP) {
-					if (buf == NULL) {
-						ploop_log(0, "Warning: fallocate is not supported,"
-								" using write instead");
-						buf = calloc(1, cluster);
-						if (buf == NULL) {
-							ploop_err(errno, "malloc");
-							goto err;
-						}
-					}
-					rc = PWRITE(&delta, buf, cluster, data_off * cluster);
-				}
-				if (rc) {
-					ploop_err(errno, "Failed to expand %s", di->images[0]->file);
-					goto err;
-				}
-			}
+	if (expand_delta(&delta, data_off * cluster, (off_t)holes * cluster))
+		goto err;
+
+	if (fsync(delta.fd)) {
+		ploop_err(errno, "fsync");
+		goto err;
+	}
 
-			if (PWRITE(&delta, &delta.l2[l2_slot], sizeof(__u32), idx_off))
+	// Second stage: update index, one write per index cluster
+	delta.l2_cache = -1;
+	for (clu = 0; clu < delta.l2_size; clu++) {
+		int l2_cluster = (clu + PLOOP_MAP_OFFSET) / (cluster / sizeof(__u32));
+		__u32 l2_slot  = (clu + PLOOP_MAP_OFFSET) % (cluster / sizeof(__u32));
+
+		if (delta.l2_cache != l2_cluster) {
+			if (dirty && PWRITE(&delta, delta.l2, cluster,
+						(off_t)delta.l2_cache * cluster))
+				goto err;
+			dirty = 0;
+			if (PREAD(&delta, delta.l2, cluster, (off_t)l2_cluster * cluster))
 				goto err;
+			delta.l2_cache = l2_cluster;
+		}
+		if (delta.l2[l2_slot] == 0) {
+			delta.l2[l2_slot] = ploop_sec_to_ioff(data_off * delta.blocksize,
+					delta.blocksize, delta.version);
 			data_off++;
+			dirty = 1;
 		}
 	}
 
+	if (dirty && PWRITE(&delta, delta.l2, cluster,
+				(off_t)delta.l2_cache * cluster))
+		goto err;
+
 	if (fsync(delta.fd)) {
 		ploop_err(errno, "fsync");
 		goto err;
@@ -3666,7 +4129,6 @@ static int expanded2preallocated(struct ploop_disk_images_data *di)
 	ret = 0;
 err:
 	close_delta(&delta);
-	free(buf);
 	return ret;
 }
 
@@ -3722,7 +4184,7 @@ static int backup_idx_table(struct delta *d, const char *image)
 {
 	char fname[PATH_MAX];
 	int fd, ret;
-	__u32 clu, cluster;
+	__u32 cluster;
 
 	BACKUP_IDX_FNAME(fname, image);
 
@@ -3734,17 +4196,10 @@ static int backup_idx_table(struct delta *d, const char *image)
 	}
 
 	cluster = S2B(d->blocksize);
-	for (clu = 0; clu < d->l1_size; clu++) {
-		if (PREAD(d, d->l2, cluster, (off_t)clu * cluster)) {
-			ret = SYSEXIT_WRITE;
-			goto err;
-		}
+	ret = copy_range(d->fd, fd, 0, 0, (__u64)d->l1_size * cluster);
+	if (ret)
+		goto err;
 
-		if (WRITE(fd, d->l2, cluster)) {
-			ret = SYSEXIT_READ;
-			goto err;
-		}
-	}
 	if (fsync(fd)) {
 		ploop_err(errno, "Failed to sync %s", fname);
 		ret = SYSEXIT_FSYNC;
@@ -3756,65 +4211,81 @@ err:
 	return ret;
 }
 
-/* Write index table */
-static int writeback_idx(struct delta *delta)
+/* Index table is converted and restored by chunks of this size */
+#define IDX_CHUNK_SIZE		(16 << 20)
+
+static __u32 idx_chunk_clusters(__u32 cluster)
 {
-	__u32 l1_cluster = delta->l2_cache;
-	__u8 *buf = (__u8 *)delta->l2;
-	int skip = l1_cluster == 0 ? sizeof(struct ploop_pvd_header) : 0;
+	return IDX_CHUNK_SIZE > cluster ? IDX_CHUNK_SIZE / cluster : 1;
+}
 
-	if (PWRITE(delta, (__u8 *)buf + skip, S2B(delta->blocksize) - skip,
-				(off_t)l1_cluster * S2B(delta->blocksize) + skip))
-		return SYSEXIT_WRITE;
+/* Convert index entries in place: V1 keeps sector offsets,
+ * V2 keeps cluster numbers. Holes (0) stay holes.
+ */
+static void convert_idx(__u32 *idx, __u32 n, __u32 blocksize, int new_version)
+{
+	__u32 i;
 
-	delta->dirtied = 0;
-	return 0;
+	if (new_version == PLOOP_FMT_V1) {
+		for (i = 0; i < n; i++)
+			idx[i] *= blocksize;
+	} else if ((blocksize & (blocksize - 1)) == 0) {
+		int shift = ffs(blocksize) - 1;
+
+		for (i = 0; i < n; i++)
+			idx[i] >>= shift;
+	} else {
+		for (i = 0; i < n; i++)
+			idx[i] /= blocksize;
+	}
 }
 
 static int change_fmt_version(struct delta *d, int new_version)
 {
-	__u32 clu, l2_cluster, l2_slot;
-	int ret, n;
-	off_t off;
+	__u32 clu, nr, chunk, i, max;
 	__u32 cluster = S2B(d->blocksize);
+	__u32 *buf = NULL;
+	int ret;
 
-	n = cluster / sizeof(__u32);
-	d->dirtied = 0;
-	for (clu = 0; clu < d->l1_size * n - PLOOP_MAP_OFFSET; clu++) {
-		l2_cluster = (clu + PLOOP_MAP_OFFSET) / n;
-		l2_slot    = (clu + PLOOP_MAP_OFFSET) % n;
+	chunk = idx_chunk_clusters(cluster);
+	if (p_memalign((void **)&buf, 4096, (size_t)chunk * cluster))
+		return SYSEXIT_MALLOC;
 
-		if (d->l2_cache != l2_cluster) {
-			if (d->dirtied && (ret = writeback_idx(d)))
-				goto err;
+	for (clu = 0; clu < d->l1_size; clu += nr) {
+		__u32 skip = clu == 0 ? PLOOP_MAP_OFFSET : 0;
+		__u32 n;
 
-			if (PREAD(d, d->l2, cluster, (off_t)l2_cluster * cluster)) {
-				ret = SYSEXIT_READ;
+		nr = MIN(chunk, d->l1_size - clu);
+		n = nr * cluster / sizeof(__u32) - skip;
+		if (PREAD(d, buf, (size_t)nr * cluster, (off_t)clu * cluster)) {
+			ret = SYSEXIT_READ;
+			goto err;
+		}
+
+		if (new_version == PLOOP_FMT_V1 && d->version != PLOOP_FMT_V1) {
+			for (i = 0, max = 0; i < n; i++)
+				max = MAX(max, buf[skip + i]);
+			if (check_size(ploop_ioff_to_sec(max, d->blocksize, d->version),
+						d->blocksize, new_version)) {
+				ret = SYSEXIT_PARAM;
 				goto err;
 			}
-
-			d->l2_cache = l2_cluster;
 		}
-		if (d->l2[l2_slot] == 0)
-			continue;
+		if (new_version != d->version)
+			convert_idx(buf + skip, n, d->blocksize, new_version);
 
-		off = ploop_ioff_to_sec(d->l2[l2_slot], d->blocksize, d->version);
-		if (new_version == PLOOP_FMT_V1 && check_size(off, d->blocksize, new_version)) {
-			ret = SYSEXIT_PARAM;
+		if (PWRITE(d, buf + skip, (size_t)nr * cluster - skip * sizeof(__u32),
+					(off_t)clu * cluster + skip * sizeof(__u32))) {
+			ret = SYSEXIT_WRITE;
 			goto err;
 		}
-		d->l2[l2_slot] = ploop_sec_to_ioff(off, d->blocksize, new_version);
-		d->dirtied = 1;
 	}
-
-	if (d->dirtied && (ret = writeback_idx(d)))
-		goto err;
+	d->l2_cache = -1;
 
 	/* update header and sync */
 	ret = change_delta_version(d, new_version);
-	if (ret)
-		goto err;
 err:
+	free(buf);
 	return ret;
 }
 
@@ -3942,7 +4413,7 @@ static int do_restore_fmt_version(struct delta *d, struct delta *idelta)
 {
 	int ret = 1;
 	__u32 cluster;
-	__u32 clu;
+	__u32 clu, nr, chunk;
 	void *buf = NULL;
 
 	if (d->l1_size != idelta->l1_size ||
@@ -3955,15 +4426,17 @@ static int do_restore_fmt_version(struct delta *d, struct delta *idelta)
 	}
 
 	cluster = S2B(idelta->blocksize);
-	if (p_memalign(&buf, 4096, cluster)) {
+	chunk = idx_chunk_clusters(cluster);
+	if (p_memalign(&buf, 4096, (size_t)chunk * cluster)) {
 		ret = SYSEXIT_MALLOC;
 		goto err;
 	}
 
-	for (clu = 0; clu < idelta->l1_size; clu++) {
-		off_t off = clu * cluster;
+	for (clu = 0; clu < idelta->l1_size; clu += nr) {
+		off_t off = (off_t)clu * cluster;
 
-		if (PREAD(idelta, buf, cluster, off)) {
+		nr = MIN(chunk, idelta->l1_size - clu);
+		if (PREAD(idelta, buf, (size_t)nr * cluster, off)) {
 			ret = SYSEXIT_READ;
 			goto err;
 		}
@@ -3974,7 +4447,7 @@ static int do_restore_fmt_version(struct delta *d, struct delta *idelta)
 			vh->m_Flags |= CIF_FmtVersionConvert;
 		}
 
-		if (PWRITE(d, buf, cluster, off)) {
+		if (PWRITE(d, buf, (size_t)nr * cluster, off)) {
 			ret = SYSEXIT_WRITE;
 			goto err;
 		}
@@ -3,6 +3,7 @@
 
 #include <linux/types.h>
 #include <string.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <assert.h>
@@ -120,6 +121,12 @@ struct delta_array
 	__u64		bd_size;
 };
 
+struct defrag_move {
+	__u32 clu;
+	__u32 src;
+	__u32 dst;
+};
+
 struct grow_maps
 {
 	struct ploop_index_update_ctl *ctl;
@@ -179,12 +186,23 @@ struct xfer_desc
 	__u64	pos;
 };
 
+struct di_index;
 struct ploop_disk_images_runtime_data {
 	int lckfd;
 	char *xml_fname;
 	char *component_name;
 	int umount_timeout;
 	int image_fmt;
+	struct di_index *index;	/* lookup index, see di.c */
+};
+
+/* Descriptor changes to be appended to the journal, see dd_journal.c */
+struct dd_journal_rec {
+	char buf[PATH_MAX * 2];
+	int len;
+	int err;
+	int fd;		/* journal opened by prepare_dd_journal() */
+	off_t end;	/* offset to append the record at */
 };
 
 struct dump2fs_data {
@@ -278,6 +296,8 @@ int read_size_from_image(const char *img_name, int raw, off_t * res);
 int grow_delta(struct delta *odelta, off_t bdsize, void *buf,
 		struct grow_maps *gm);
 int grow_raw_delta(const char *image, off_t append_size, int sparse);
+int zero_clusters(struct delta *delta, __u32 start, __u32 n);
+int move_batch(struct delta *delta, struct defrag_move *moves, int n);
 PL_EXT int ploop_grow_image(struct ploop_disk_images_data *di, off_t size, int sparse);
 PL_EXT int ploop_grow_device(struct ploop_disk_images_data *di,
 		const char *device, off_t new_size);
@@ -393,6 +413,16 @@ int ploop_add_snapshot_entry(struct ploop_disk_images_data *di, const char *guid
 PL_EXT char *mntn2str(int mntn_type);
 PL_EXT int get_balloon(const char *mount_point, struct stat *st, int *outfd);
 PL_EXT int ploop_balloon_change_size(const char *device, int balloonfd, off_t new_size);
+struct ploop_balloon_param {
+	__u64 step;		/* bytes per step, 0 - default (1G) */
+	__u64 rate;		/* bytes per second, 0 - unlimited */
+	const volatile int *stop;
+	/* called after every step */
+	void (*progress)(__u64 done, __u64 total, void *data);
+	void *data;
+};
+PL_EXT int ploop_balloon_change_size_ex(const char *device, int balloonfd,
+		off_t new_size, const struct ploop_balloon_param *param);
 PL_EXT int ploop_discard_get_stat_by_dev(const char *device, const char *mount_point,
 		struct ploop_discard_stat *pd_stat);
 PL_EXT int ploop_discard_by_dev(const char *device, const char *mount_point,
@@ -424,7 +454,7 @@ int resize_gpt_partition(const char *devname, const char *partname,
 		__u64 new_size512, __u32 blocksize512);
 int check_and_repair_gpt(const char *device, __u32 blocksize512);
 int parted_mklabel_gpt(const char *device);
-int sgdisk_resize_gpt(const char *device, int part_num, off_t part_start);
+int resize_gpt_partition_num(const char *device, int part_num);
 int sgdisk_mkpart(const char *device, int part_num,
 		unsigned long long part_start, unsigned long long part_end);
 int get_partition_range(const char *device, int part_num,
@@ -472,9 +502,9 @@ int is_on_rotational(const char *image);
 
 // merge
 PL_EXT int merge_image(const char *device, int start_level, int end_level, int raw, int merge_top,
-		char **images, const char *new_delta);
+		char **images, const char *new_delta, int flags);
 int ploop_delete_snapshot_by_guid(struct ploop_disk_images_data *di,
-		const char *guid, const char *new_delta);
+		const char *guid, const char *new_delta, int flags);
 int merge_temporary_snapshots(struct ploop_disk_images_data *di);
 
 PL_EXT int ploop_change_fmt_version(struct ploop_disk_images_data *di,
@@ -523,6 +553,26 @@ int do_delete_snapshot(struct ploop_disk_images_data *di, const char *guid);
 const char *get_basename(const char *path);
 const char *get_top_delta_guid(struct ploop_disk_images_data *di);
 int read_dd(struct ploop_disk_images_data *di);
+int read_dd_cache(struct ploop_disk_images_data *di, const struct stat *st,
+		const char *basedir, __u32 *xml_crc);
+void write_dd_cache(struct ploop_disk_images_data *di, const struct stat *st,
+		const char *basedir, __u32 xml_crc);
+void journal_change_guid(struct dd_journal_rec *rec, const char *guid,
+		const char *new_guid);
+void journal_set_temporary(struct dd_journal_rec *rec, const char *guid);
+void journal_remove_image(struct dd_journal_rec *rec, const char *guid);
+void journal_add_image(struct dd_journal_rec *rec,
+		struct ploop_disk_images_data *di, const char *fname,
+		const char *guid, const char *parent_guid);
+int replay_dd_journal(struct ploop_disk_images_data *di, const char *basedir,
+		__u64 xml_size, __u32 xml_crc);
+int prepare_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec);
+int commit_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec);
+void abort_dd_journal(struct ploop_disk_images_data *di,
+		struct dd_journal_rec *rec);
+void drop_dd_journal(const char *xml_fname);
 void normalize_path(const char *path, char *out);
 int get_snap_file_name(struct ploop_disk_images_data *di, const char *snap_dir,
 		const char *file_guid, char *out, int size);
@@ -549,6 +599,8 @@ PL_EXT int ploop_is_devicemapper(void);
 int dm_remove(const char *devname, int tm_sec);
 int dm_create(const char *devname, int minor, const char *target,
 		__u64 start, __u64 size, int ro, const char *args);
+int dm_set_linear(const char *devname, dev_t dev, __u64 start, __u64 size,
+		int ro);
 int dm_resize(const char *devname, off_t size);
 int dm_setnoresume(const char *devname, int on);
 int dm_tracking_start(const char *devname);
@@ -585,6 +637,7 @@ int build_hole_bitmap(struct delta *delta, __u64 **hole_bitmap,
 		__u32 *hole_bitmap_size, int *nr_clusters);
 int build_alloc_bitmap(struct delta *delta, __u64 **bitmap,
 		__u32 *bitmap_size, int *nr_clusters);
+int calc_fragmentation(struct delta *delta, __u32 *runs);
 int image_defrag(struct delta *delta);
 int do_umount(const char *mnt, int tmo_sec);
 int get_part_devname(struct ploop_disk_images_data *di,
@@ -634,4 +687,8 @@ int qcow_alloc_active_bitmap(int fd, __u64 **bitmap, __u32 *bitmap_size,
 		int *nr_clusters);
 int qcow_alloc_bitmap(int fd, __u64 **bitmap, __u32 *bitmap_size,
 		int *nr_clusters);
+
+/* Phase timing, timing_begin() returns 0 if timing is not enabled */
+__u64 timing_begin(void);
+void timing_end(const char *name, __u64 start);
 #endif
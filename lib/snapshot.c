@@ -123,7 +123,7 @@ int do_delete_snapshot(struct ploop_disk_images_data *di, const char *guid)
 			ploop_log(0, "ploop snapshot %s has been successfully deleted",
 				guid);
 	} else if (nelem == 1) {
-		ret = ploop_delete_snapshot_by_guid(di, guid, NULL);
+		ret = ploop_delete_snapshot_by_guid(di, guid, NULL, 0);
 	} else if (!di->snapshots[snap_id]->temporary) {
 		ploop_log(1, "Warning: Unable to delete snapshot %s as there are %d references"
 				" to it; marking it as temporary instead",
@@ -305,8 +305,7 @@ int do_create_snapshot(struct ploop_disk_images_data *di,
 	char file_guid[UUID_SIZE];
 	char fname[PATH_MAX];
 	const char *prev_fname = NULL;
-	char conf[PATH_MAX];
-	char conf_tmp[PATH_MAX];
+	struct dd_journal_rec rec = {};
 	int online = 0;
 	int temporary = flags & SNAP_TYPE_TEMPORARY;
 	int n;
@@ -315,6 +314,7 @@ int do_create_snapshot(struct ploop_disk_images_data *di,
 	int version;
 	uuid_t u;
 	const __u8 *cbt_u = NULL;
+	__u64 t;
 
 	if (cbt_uuid != NULL) {
 		ploop_log(0, "Create snapshot CBT uuid=%s", cbt_uuid);
@@ -376,7 +376,9 @@ int do_create_snapshot(struct ploop_disk_images_data *di,
 	if (rc == 0) {
 		if (!(flags & SNAP_TYPE_OFFLINE)) {
 			online = 1;
+			t = timing_begin();
 			ret = complete_running_operation(di, dev);
+			timing_end("complete_running_operation", t);
 			if (ret)
 				return ret;
 		}
@@ -414,27 +416,33 @@ int do_create_snapshot(struct ploop_disk_images_data *di,
 		return SYSEXIT_PARAM;
 	}
 
+	journal_change_guid(&rec, di->top_guid, snap_guid);
 	ploop_di_change_guid(di, di->top_guid, snap_guid);
-	if (temporary)
+	if (temporary) {
+		journal_set_temporary(&rec, snap_guid);
 		ploop_di_set_temporary(di, snap_guid);
+	}
 
 	ret = ploop_di_add_image(di, fname, top_guid, snap_guid);
 	if (ret)
 		return ret;
+	journal_add_image(&rec, di, fname, top_guid, snap_guid);
 
-	get_disk_descriptor_fname(di, conf, sizeof(conf));
-	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
-	ret = ploop_store_diskdescriptor(conf_tmp, di);
+	ret = prepare_dd_journal(di, &rec);
 	if (ret)
 		return ret;
 
+	t = timing_begin();
 	fd = create_snapshot_delta(fname, blocksize, size, version);
+	timing_end("create_snapshot_delta", t);
 	if (fd < 0) {
-		ret = SYSEXIT_CREAT;
-		goto err;
+		abort_dd_journal(di, &rec);
+		return SYSEXIT_CREAT;
 	}
 	close(fd);
 
+	t = timing_begin();
+
 	if (!online) {
 		// offline snapshot
 		if (cbt_u != NULL)
@@ -447,27 +455,26 @@ int do_create_snapshot(struct ploop_disk_images_data *di,
 		}
 	} else
 		ret = create_snapshot(di, dev, cbt_u, fname, prev_fname);
-	if (ret)
-		goto err;
-
-
-	if (rename(conf_tmp, conf)) {
-		ploop_err(errno, "Can't rename %s %s",
-				conf_tmp, conf);
-		ret = SYSEXIT_RENAME;
+	timing_end(online ? "create_snapshot" : "move_cbt", t);
+	if (ret) {
+		abort_dd_journal(di, &rec);
+		return ret;
 	}
 
-	if (ret && !online && unlink(fname))
-		ploop_err(errno, "Can't unlink %s",
-				fname);
+	t = timing_begin();
+	ret = commit_dd_journal(di, &rec);
+	timing_end("store_dd", t);
+	if (ret) {
+		if (!online && unlink(fname))
+			ploop_err(errno, "Can't unlink %s",
+					fname);
+		return ret;
+	}
 
 	ploop_log(0, "ploop %s %s has been successfully created",
 			get_snap_str(temporary), snap_guid);
-err:
-	if (ret && unlink(conf_tmp))
-		ploop_err(errno, "Can't unlink %s", conf_tmp);
 
-	return ret;
+	return 0;
 }
 
 
@@ -475,8 +482,12 @@ int ploop_create_snapshot(struct ploop_disk_images_data *di,
 		struct ploop_snapshot_param *param)
 {
 	int ret;
+	__u64 t;
 
-	if (ploop_lock_dd(di))
+	t = timing_begin();
+	ret = ploop_lock_dd(di);
+	timing_end("lock", t);
+	if (ret)
 		return SYSEXIT_LOCK;
 
 	ret = do_create_snapshot(di, param->guid, param->snap_dir,
@@ -574,7 +585,7 @@ err:
 	ploop_umount(mount_param.device, di);
 
 err_merge:
-	ploop_delete_snapshot_by_guid(di, param->guid, NULL);
+	ploop_delete_snapshot_by_guid(di, param->guid, NULL, 0);
 
 err_unlock:
 	ploop_unlock_dd(di);
@@ -671,28 +682,24 @@ static int reset_top_delta(struct ploop_disk_images_data *di,
 {
 	int ret;
 	char *old_top_delta_fname = NULL;
-	char conf[PATH_MAX];
-	char conf_tmp[PATH_MAX];
+	struct dd_journal_rec rec = {};
 	const char *guid = param->guid;
 
+	journal_remove_image(&rec, di->top_guid);
 	ret = ploop_di_remove_image(di, di->top_guid, 0, &old_top_delta_fname);
 	if (ret)
 		return ret;
 
+	journal_change_guid(&rec, guid, TOPDELTA_UUID);
 	ploop_di_change_guid(di, guid, TOPDELTA_UUID);
 
-	get_disk_descriptor_fname(di, conf, sizeof(conf));
-	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
-	ret = ploop_store_diskdescriptor(conf_tmp, di);
+	ret = prepare_dd_journal(di, &rec);
 	if (ret)
 		goto err;
 
-	if (rename(conf_tmp, conf)) {
-		ploop_err(errno, "Can't rename %s %s",
-				conf_tmp, conf);
-		ret = SYSEXIT_RENAME;
+	ret = commit_dd_journal(di, &rec);
+	if (ret)
 		goto err;
-	}
 
 	/* destroy precached info */
 	drop_statfs_info(di->images[0]->file);
@@ -705,9 +712,6 @@ static int reset_top_delta(struct ploop_disk_images_data *di,
 	}
 
 err:
-	if (ret && unlink(conf_tmp))
-		ploop_err(errno, "Can't unlink %s", conf_tmp);
-
 	free(old_top_delta_fname);
 
 	return ret;
@@ -723,8 +727,7 @@ int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di,
 	char file_uuid[UUID_SIZE];
 	char new_top_delta_fname[PATH_MAX] = "";
 	char *old_top_delta_fname = NULL;
-	char conf[PATH_MAX];
-	char conf_tmp[PATH_MAX];
+	struct dd_journal_rec rec = {};
 	off_t size;
 	const char *guid = param->guid;
 	int flags = param->flags;
@@ -797,6 +800,7 @@ int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di,
 					dev);
 			goto err_cleanup1;
 		}
+		journal_remove_image(&rec, di->top_guid);
 		ret = ploop_di_remove_image(di, di->top_guid, 0, &old_top_delta_fname);
 		if (ret)
 			goto err_cleanup1;
@@ -814,6 +818,7 @@ int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di,
 			goto err_cleanup1;
 		}
 
+		journal_change_guid(&rec, di->top_guid, param->guid_old);
 		ploop_di_change_guid(di, di->top_guid, param->guid_old);
 	}
 
@@ -822,27 +827,24 @@ int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di,
 	ret = ploop_di_add_image(di, new_top_delta_fname, TOPDELTA_UUID, guid);
 	if (ret)
 		goto err_cleanup1;
+	journal_add_image(&rec, di, new_top_delta_fname, TOPDELTA_UUID, guid);
 
-	get_disk_descriptor_fname(di, conf, sizeof(conf));
-	snprintf(conf_tmp, sizeof(conf_tmp), "%s.tmp", conf);
-	ret = ploop_store_diskdescriptor(conf_tmp, di);
+	ret = prepare_dd_journal(di, &rec);
 	if (ret)
 		goto err_cleanup1;
 
 	// offline snapshot
 	fd = create_snapshot_delta(new_top_delta_fname, blocksize, size, version);
 	if (fd == -1) {
+		abort_dd_journal(di, &rec);
 		ret = SYSEXIT_CREAT;
-		goto err_cleanup2;
+		goto err_cleanup1;
 	}
 	close(fd);
 
-	if (rename(conf_tmp, conf)) {
-		ploop_err(errno, "Can't rename %s %s",
-				conf_tmp, conf);
-		ret = SYSEXIT_RENAME;
-		goto err_cleanup3;
-	}
+	ret = commit_dd_journal(di, &rec);
+	if (ret)
+		goto err_cleanup2;
 
 	if (old_top_delta_fname != NULL) {
 		ploop_log(0, "Removing %s", old_top_delta_fname);
@@ -852,14 +854,10 @@ int ploop_switch_snapshot_ex(struct ploop_disk_images_data *di,
 	}
 
 	ploop_log(0, "ploop snapshot has been successfully switched");
-err_cleanup3:
-	if (ret && unlink(new_top_delta_fname))
-		ploop_err(errno, "Can't unlink %s",
-				conf_tmp);
 err_cleanup2:
-	if (ret && unlink(conf_tmp))
+	if (ret && unlink(new_top_delta_fname))
 		ploop_err(errno, "Can't unlink %s",
-				conf_tmp);
+				new_top_delta_fname);
 err_cleanup1:
 	ploop_unlock_dd(di);
 	free(old_top_delta_fname);
@@ -25,12 +25,15 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
 
 #include <libploop.h> 
 #include "libvolume.h"
 #include "ploop.h"
 
 #define SNAP_DIR	"children"
+#define SIBLING_INDEX	"children.idx"
 
 const char *get_ddxml_fname(const char *dir, char *buf, int size)
 {
@@ -199,26 +202,266 @@ static int get_delta_storage_dir(struct ploop_disk_images_data *d, char *buf,
 	return 0;
 }
 
+/*
+ * Children of a volume are registered as symlinks in SNAP_DIR, and the
+ * sibling index duplicates them as "<name>\t<path>" lines of a single
+ * file, so listing does not need a directory walk and realpath() for
+ * every child. Volumes without the index (created by older versions)
+ * are scanned, the index is built on the next change of the children.
+ * Delete and switch check the symlinks themselves and fix the index.
+ */
+static int scan_siblings(const char *path, char **out[])
+{
+	DIR *dir;
+	char buf[PATH_MAX];
+	char x[PATH_MAX];
+	struct dirent *de;
+	int n = 0;
+
+	snprintf(buf, sizeof(buf), "%s/"SNAP_DIR, path);
+	errno = 0;
+	dir = opendir(buf);
+	if (dir == NULL) {
+		if (errno == ENOENT)
+			return 0;
+		ploop_err(errno, "Cannot open %s", path);
+		return -1;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+			continue;
+
+		if (de->d_type != DT_LNK)
+			continue;
+
+		snprintf(x, sizeof(x), "%s/%s", buf, de->d_name);
+		char *f = realpath(x, NULL);
+		if (f == NULL) {
+			ploop_err(errno, "realpath(%s)", x);
+			goto err;
+		}
+
+		snprintf(x, sizeof(x), "%s\t%s", de->d_name, f);
+		free(f);
+		n = append_array_entry(x, out, n);
+		if (n == -1)
+			goto err;
+	}
+	closedir(dir);
+
+	return 0;
+
+err:
+	closedir(dir);
+	ploop_free_array(*out);
+	*out = NULL;
+
+	return -1;
+}
+
+/* Returns 0 on success, 1 if there is no index, -1 on error */
+static int read_sibling_index(const char *path, char **out[])
+{
+	FILE *fp;
+	char fname[PATH_MAX];
+	char *line = NULL;
+	size_t len = 0;
+	ssize_t r;
+	int n = 0, rc = 0;
+
+	snprintf(fname, sizeof(fname), "%s/"SIBLING_INDEX, path);
+	fp = fopen(fname, "r");
+	if (fp == NULL) {
+		if (errno == ENOENT)
+			return 1;
+		ploop_err(errno, "Can't open %s", fname);
+		return -1;
+	}
+
+	while ((r = getline(&line, &len, fp)) != -1) {
+		if (r > 0 && line[r - 1] == '\n')
+			line[r - 1] = '\0';
+		if (strchr(line, '\t') == NULL) {
+			ploop_err(0, "Corrupted %s", fname);
+			rc = -1;
+			break;
+		}
+		n = append_array_entry(line, out, n);
+		if (n == -1) {
+			rc = -1;
+			break;
+		}
+	}
+	if (rc == 0 && ferror(fp)) {
+		ploop_err(errno, "Can't read %s", fname);
+		rc = -1;
+	}
+	free(line);
+	fclose(fp);
+
+	if (rc) {
+		ploop_free_array(*out);
+		*out = NULL;
+	}
+
+	return rc;
+}
+
+/* Get "<name>\t<path>" children entries, returns their number or -1 */
+static int get_siblings(const char *path, char **out[])
+{
+	int rc;
+
+	*out = NULL;
+	rc = read_sibling_index(path, out);
+	if (rc == 1)
+		rc = scan_siblings(path, out);
+	if (rc)
+		return -1;
+
+	return *out ? get_list_size(*out) : 0;
+}
+
+static int write_sibling_index(const char *path, char **list)
+{
+	FILE *fp;
+	char fname[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+	int rc = SYSEXIT_WRITE;
+
+	snprintf(fname, sizeof(fname), "%s/"SIBLING_INDEX, path);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", fname);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		ploop_err(errno, "Can't open %s", tmp);
+		return SYSEXIT_OPEN;
+	}
+
+	for (; list != NULL && *list != NULL; list++) {
+		if (fprintf(fp, "%s\n", *list) < 0) {
+			ploop_err(errno, "Can't write %s", tmp);
+			goto err;
+		}
+	}
+
+	if (fflush(fp) || fsync(fileno(fp))) {
+		ploop_err(errno, "Failed to sync %s", tmp);
+		rc = SYSEXIT_FSYNC;
+		goto err;
+	}
+	fclose(fp);
+	fp = NULL;
+
+	if (rename(tmp, fname)) {
+		ploop_err(errno, "Can't rename %s to %s", tmp, fname);
+		rc = SYSEXIT_RENAME;
+		goto err;
+	}
+
+	return 0;
+
+err:
+	if (fp)
+		fclose(fp);
+	unlink(tmp);
+
+	return rc;
+}
+
+/* Add (if path != NULL) or remove the child name in the parent index.
+ * The parent is not necessarily locked by the caller, so the update is
+ * serialized by flock on its SNAP_DIR.
+ */
+static int update_sibling_index(const char *parent, const char *name,
+		const char *path)
+{
+	char buf[PATH_MAX];
+	char **list = NULL, **p, **q;
+	int fd, n, rc;
+
+	snprintf(buf, sizeof(buf), "%s/"SNAP_DIR, parent);
+	fd = open(buf, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", buf);
+		return SYSEXIT_OPEN;
+	}
+
+	if (flock(fd, LOCK_EX)) {
+		ploop_err(errno, "Can't flock %s", buf);
+		rc = SYSEXIT_FLOCK;
+		goto err;
+	}
+
+	n = get_siblings(parent, &list);
+	if (n == -1) {
+		rc = SYSEXIT_SYS;
+		goto err;
+	}
+
+	/* drop the existing entry of the name */
+	snprintf(buf, sizeof(buf), "%s\t", name);
+	for (p = q = list; p != NULL && *p != NULL; p++) {
+		if (strncmp(*p, buf, strlen(buf)) == 0)
+			free(*p);
+		else
+			*q++ = *p;
+	}
+	if (list != NULL)
+		*q = NULL;
+
+	if (path != NULL) {
+		snprintf(buf, sizeof(buf), "%s\t%s", name, path);
+		n = list ? get_list_size(list) + 1 : 0;
+		if (append_array_entry(buf, &list, n) == -1) {
+			rc = SYSEXIT_MALLOC;
+			goto err;
+		}
+	}
+
+	rc = write_sibling_index(parent, list);
+
+err:
+	ploop_free_array(list);
+	close(fd);
+
+	return rc;
+}
+
 static int register_sibling(const char *parent, const char *child)
 {
+	int rc;
 	char x[PATH_MAX];
 	char dir[PATH_MAX];
+	char *path;
 
 	normalize_path(child, dir);
 
 	snprintf(x, sizeof(x), "%s/"SNAP_DIR"/%s",
 			parent, get_basename(dir));
 	ploop_log(0, "register sibling %s -> %s", x, dir);
+	if (strchr(dir, '\n') || strchr(dir, '\t')) {
+		ploop_err(0, "Unsupported volume path %s", dir);
+		return SYSEXIT_PARAM;
+	}
+
 	if (symlink(dir, x)) {
 		ploop_err(errno, "Cannot create symlink %s -> %s", x, dir);
 		return SYSEXIT_CREAT;
 	}
 
-	return 0;
+	path = realpath(dir, NULL);
+	rc = update_sibling_index(parent, get_basename(dir), path ?: dir);
+	free(path);
+	if (rc && unlink(x))
+		ploop_err(errno, "Cannot unlink %s", x);
+
+	return rc;
 }
 
 static int unregister_sibling(const char *parent, const char *child)
 {
+	int rc;
 	char x[PATH_MAX];
 	char dir[PATH_MAX];
 
@@ -231,7 +474,15 @@ static int unregister_sibling(const char *parent, const char *child)
 		return SYSEXIT_UNLINK;
 	}
 
-	return 0;
+	rc = update_sibling_index(parent, get_basename(dir), NULL);
+	if (rc) {
+		/* a stale index is worse than none, fall back to the scan */
+		snprintf(x, sizeof(x), "%s/"SIBLING_INDEX, parent);
+		if (unlink(x) && errno != ENOENT)
+			ploop_err(errno, "Cannot unlink %s", x);
+	}
+
+	return rc;
 }
 
 static int delete_images(const char *path, struct ploop_disk_images_data *d)
@@ -247,43 +498,66 @@ static int delete_images(const char *path, struct ploop_disk_images_data *d)
 	return destroy_layout(path, d);
 }
 
-static int get_first_sibling(const char *path, char *out, int size)
+static int cmp_sibling(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Get the children from the symlinks and rebuild the index if it does
+ * not match them, e.g. a child was added by an older version or by hand.
+ * Returns the number of children or -1.
+ */
+static int get_siblings_checked(const char *path, char **out[])
 {
-	DIR *dir;
 	char buf[PATH_MAX];
-	struct dirent *de;
-	int n = 0;
+	char **list = NULL;
+	int fd, i, n, rc;
 
-	snprintf(buf, sizeof(buf), "%s/"SNAP_DIR, path);
-	errno = 0;
-	dir = opendir(buf);
-	if (dir == NULL) {
-		if (errno == ENOENT)
-			return 0;
-		ploop_err(errno, "Cannot open %s", path);
+	*out = NULL;
+	if (scan_siblings(path, out))
 		return -1;
+	n = *out ? get_list_size(*out) : 0;
+
+	rc = read_sibling_index(path, &list);
+	if (rc == 1)
+		return n;
+	if (rc == 0 && (list ? get_list_size(list) : 0) == n) {
+		qsort(*out, n, sizeof(char *), cmp_sibling);
+		qsort(list, n, sizeof(char *), cmp_sibling);
+		for (i = 0; i < n && strcmp((*out)[i], list[i]) == 0; i++);
+		if (i == n)
+			goto out;
 	}
 
-	while ((de = readdir(dir)) != NULL) {
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
-
-		if (de->d_type != DT_LNK)
-			continue;
-		if (n == 0) {
-			snprintf(out, size, "%s/%s", buf, de->d_name);
-			char *f = realpath(out, NULL);
-			if (f == NULL) {
-				ploop_err(errno, "realpath(%s)", out);
-				return -1;
-			}
-			
-			snprintf(out, size, "%s", f);
-			free(f);
-		}
-		n++;
+	ploop_log(0, "Rebuild the sibling index of %s", path);
+	snprintf(buf, sizeof(buf), "%s/"SNAP_DIR, path);
+	fd = open(buf, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", buf);
+		goto out;
 	}
-	closedir(dir);
+	if (flock(fd, LOCK_EX) == 0)
+		write_sibling_index(path, *out);
+	else
+		ploop_err(errno, "Can't flock %s", buf);
+	close(fd);
+
+out:
+	ploop_free_array(list);
+
+	return n;
+}
+
+/* Used by the safety checks, so the symlinks are counted */
+static int get_first_sibling(const char *path, char *out, int size)
+{
+	char **list;
+	int n;
+
+	n = get_siblings_checked(path, &list);
+	if (n > 0)
+		snprintf(out, size, "%s", strchr(list[0], '\t') + 1);
+	ploop_free_array(list);
 
 	return n;
 }
@@ -657,11 +931,9 @@ void ploop_volume_clear_tree(struct ploop_volume_list_head *head)
 
 int ploop_volume_get_tree(const char *path, struct ploop_volume_list_head *out, int size)
 {
-	DIR *dir = NULL;
-	char spath[PATH_MAX];
 	char buf[PATH_MAX];
-	struct dirent *de;
-	int rc = 0;
+	char **list = NULL;
+	int rc = 0, i, n;
 	struct ploop_volume_tree_element *vol;
 	struct ploop_volume_list_head *children, head;
 	struct ploop_disk_images_data *d = NULL;
@@ -688,49 +960,32 @@ int ploop_volume_get_tree(const char *path, struct ploop_volume_list_head *out,
 
 	SLIST_INSERT_HEAD(&head, vol, next);
 
-	snprintf(spath, sizeof(spath), "%s/"SNAP_DIR, path);
-	errno = 0;
-	dir = opendir(spath);
-	if (dir == NULL) {
-		if (errno == ENOENT)
-			goto exit;
-		ploop_err(errno, "Cannot open %s", path);
+	n = get_siblings(path, &list);
+	if (n == -1) {
 		rc = SYSEXIT_SYS;
 		goto err;
 	}
 
-	while ((de = readdir(dir)) != NULL) {
-		if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
-			continue;
-
-		if (de->d_type != DT_LNK)
-			continue;
-
-		snprintf(buf, sizeof(buf), "%s/%s", spath, de->d_name);
-		char *f = realpath(buf, NULL);
-		if (f == NULL) {
-			ploop_err(errno, "realpath(%s)", buf);
-			rc = -1;
-			goto err;
-		}
-
+	for (i = 0; i < n; i++) {
 		vol = calloc(1, sizeof(struct ploop_volume_tree_element));
 		if (vol == NULL) {
-			free(f);
 			rc = SYSEXIT_MALLOC;
 			goto err;
 		}
 
-		vol->path = f;
+		vol->path = strdup(strchr(list[i], '\t') + 1);
 		SLIST_INSERT_HEAD(children, vol, next);
+		if (vol->path == NULL) {
+			rc = SYSEXIT_MALLOC;
+			goto err;
+		}
 	}
 
-exit:
 	SLIST_INSERT_HEAD(out, SLIST_FIRST(&head), next);
 	SLIST_INIT(&head);
 
 err:
-	closedir(dir);
+	ploop_free_array(list);
 	ploop_volume_clear_tree(&head);
 	ploop_close_dd(d);
 	return rc;
@@ -26,6 +26,8 @@
 #include <libxml/xmlwriter.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 
 #include "ploop.h"
 
@@ -531,11 +533,14 @@ static int validate_disk_descriptor(struct ploop_disk_images_data *di)
 
 int read_dd(struct ploop_disk_images_data *di)
 {
-	int ret;
+	int ret, fd;
 	char basedir[PATH_MAX+1];
 	const char *fname;
+	char *buf = NULL;
 	xmlDoc *doc = NULL;
 	xmlNode *root_element = NULL;
+	struct stat st;
+	__u32 crc;
 
 	LIBXML_TEST_VERSION
 
@@ -550,19 +555,52 @@ int read_dd(struct ploop_disk_images_data *di)
 	ploop_clear_dd(di);
 
 	fname = di->runtime->xml_fname;
-	doc = xmlReadFile(fname, NULL, 0);
-	if (doc == NULL) {
-		ploop_err(0, "Can't parse %s", fname);
+	get_basedir(fname, basedir, sizeof(basedir)-1);
+	fd = open(fname, O_RDONLY|O_CLOEXEC);
+	if (fd == -1) {
+		ploop_err(errno, "Can't open %s", fname);
 		return -1;
 	}
-	root_element = xmlDocGetRootElement(doc);
 
-	get_basedir(fname, basedir, sizeof(basedir)-1);
-	ret = parse_xml(basedir, root_element, di);
+	ret = -1;
+	if (fstat(fd, &st)) {
+		ploop_err(errno, "Can't stat %s", fname);
+		goto err;
+	}
+
+	if (read_dd_cache(di, &st, basedir, &crc)) {
+		buf = malloc(st.st_size + 1);
+		if (buf == NULL) {
+			ploop_err(ENOMEM, "Can't read %s", fname);
+			goto err;
+		}
+		if (read_safe(fd, buf, st.st_size, 0, "read DiskDescriptor.xml"))
+			goto err;
+
+		/* the crc binds the journal to this descriptor */
+		crc = ploop_crc32((unsigned char *)buf, st.st_size);
+		doc = xmlReadMemory(buf, st.st_size, fname, NULL, 0);
+		if (doc == NULL) {
+			ploop_err(0, "Can't parse %s", fname);
+			goto err;
+		}
+		root_element = xmlDocGetRootElement(doc);
+
+		ret = parse_xml(basedir, root_element, di);
+		if (ret)
+			goto err;
+		write_dd_cache(di, &st, basedir, crc);
+	}
+
+	ret = replay_dd_journal(di, basedir, st.st_size, crc);
 	if (ret == 0)
 		ret = validate_disk_descriptor(di);
 
-	xmlFreeDoc(doc);
+err:
+	if (doc)
+		xmlFreeDoc(doc);
+	free(buf);
+	close(fd);
 
 	return ret;
 }
@@ -691,6 +729,7 @@ int store_diskdescriptor(const char *fname, struct ploop_disk_images_data *di,
 	xmlDocPtr doc = NULL;
 	char tmp[PATH_MAX];
 	char basedir[PATH_MAX];
+	char gen[UUID_SIZE];
 	FILE *fp = NULL;
 
 	if (di->runtime->image_fmt == QCOW_FMT)
@@ -712,6 +751,9 @@ int store_diskdescriptor(const char *fname, struct ploop_disk_images_data *di,
 		return -1;
 	}
 
+	if (ploop_uuid_generate(gen, sizeof(gen)))
+		return -1;
+
 	doc = xmlNewDoc(BAD_CAST XML_DEFAULT_VERSION);
 	if (doc == NULL) {
 		ploop_err(0, "Error creating xml document tree");
@@ -738,6 +780,15 @@ int store_diskdescriptor(const char *fname, struct ploop_disk_images_data *di,
 		ploop_err(0, "Error at xmlTextWriterStartDocument");
 		goto err;
 	}
+	/* Every store differs from the previous one even if the content
+	 * is the same, so a journal based on the old XML is never replayed
+	 * on top of the new one, see dd_journal.c
+	 */
+	rc = xmlTextWriterWriteFormatComment(writer, "Generation %s", gen);
+	if (rc < 0) {
+		ploop_err(0, "Error at xmlTextWriterWriteComment");
+		goto err;
+	}
 	/*********************************************
 	 *	Disk_Parameters
 	 ********************************************/
@@ -1050,6 +1101,9 @@ int store_diskdescriptor(const char *fname, struct ploop_disk_images_data *di,
 		goto err;
 	}
 
+	if (!strcmp(fname, di->runtime->xml_fname))
+		drop_dd_journal(fname);
+
 	rc = 0;
 err:
 	if (fp)
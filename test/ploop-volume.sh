@@ -152,5 +152,48 @@ test -f $TEST_DIR/vol1-mnt/snap2
 $PLOOP_VOLUME delete $TEST_DIR/snap2
 $PLOOP_VOLUME delete $TEST_DIR/snap1
 $PLOOP_VOLUME delete $TEST_DIR/vol1
- 
+
+# A child missing from the sibling index (registered by an older
+# version) still keeps the parent from being destroyed
+$PLOOP_VOLUME create --image $IMAGES/vol1 $TEST_DIR/vol1 -s 10G
+$PLOOP_VOLUME snapshot $TEST_DIR/vol1 $TEST_DIR/snap1
+$PLOOP_VOLUME clone $TEST_DIR/snap1 $TEST_DIR/vol2
+test -f $TEST_DIR/snap1/children.idx
+grep -v "^vol2	" $TEST_DIR/snap1/children.idx > $TEST_DIR/children.idx || true
+mv $TEST_DIR/children.idx $TEST_DIR/snap1/children.idx
+$PLOOP_VOLUME delete $TEST_DIR/snap1 && exit 1 || true
+grep -q "^vol2	" $TEST_DIR/snap1/children.idx
+$PLOOP_VOLUME delete $TEST_DIR/vol2
+$PLOOP_VOLUME delete $TEST_DIR/snap1
+$PLOOP_VOLUME delete $TEST_DIR/vol1
+
+# Sibling index: list the children of a snapshot with NR_CLONES clones
+# (and vol1) from the index and by the directory scan. Each clone rewrites
+# the index, so the default is small; run with e.g. NR_CLONES=10000 to
+# compare the timings.
+NR_CLONES=${NR_CLONES:-10}
+TIMEFORMAT="%R"
+mkdir -p $TEST_DIR/clones
+$PLOOP_VOLUME create --image $IMAGES/vol1 $TEST_DIR/vol1 -s 10G
+$PLOOP_VOLUME snapshot $TEST_DIR/vol1 $TEST_DIR/snap1
+set +x
+for ((i = 0; i < NR_CLONES; i++)); do
+	$PLOOP_VOLUME clone $TEST_DIR/snap1 $TEST_DIR/clones/c$i
+done
+t_idx=$( { time $PLOOP_VOLUME tree $TEST_DIR/snap1 > $TEST_DIR/tree.idx; } 2>&1 )
+mv $TEST_DIR/snap1/children.idx $TEST_DIR/children.idx
+t_scan=$( { time $PLOOP_VOLUME tree $TEST_DIR/snap1 > $TEST_DIR/tree.scan; } 2>&1 )
+mv $TEST_DIR/children.idx $TEST_DIR/snap1/children.idx
+echo "tree of $NR_CLONES clones: index ${t_idx}s, scan ${t_scan}s"
+test `grep -c '"path"' $TEST_DIR/tree.idx` -eq $((NR_CLONES + 2))
+test `grep -c '"path"' $TEST_DIR/tree.scan` -eq $((NR_CLONES + 2))
+for ((i = 0; i < NR_CLONES; i++)); do
+	$PLOOP_VOLUME delete $TEST_DIR/clones/c$i
+done
+set -x
+test `wc -l < $TEST_DIR/snap1/children.idx` -eq 1
+rm -f $TEST_DIR/tree.idx $TEST_DIR/tree.scan
+$PLOOP_VOLUME delete $TEST_DIR/snap1
+$PLOOP_VOLUME delete $TEST_DIR/vol1
+
  exit 0
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stdio.h>
 #include <signal.h>
+#include <json-c/json.h>
 
 #include "ploop.h"
 
@@ -146,3 +147,30 @@ void init_signals(void)
 	sigaction(SIGINT, &act, NULL);
 	sigaction(SIGHUP, &act, NULL);
 }
+
+void print_timing(const struct ploop_timing *t)
+{
+	struct json_object *result, *phases, *p;
+	int i;
+
+	result = json_object_new_object();
+	phases = json_object_new_array();
+	for (i = 0; i < t->nr_phases; i++) {
+		p = json_object_new_object();
+		json_object_object_add(p, "name",
+				json_object_new_string(t->phases[i].name));
+		json_object_object_add(p, "start_us",
+				json_object_new_int64((int64_t) t->phases[i].start_us));
+		json_object_object_add(p, "duration_us",
+				json_object_new_int64((int64_t) t->phases[i].duration_us));
+		json_object_array_add(phases, p);
+	}
+	json_object_object_add(result, "total_us",
+			json_object_new_int64((int64_t) t->total_us));
+	json_object_object_add(result, "phases", phases);
+	if (t->dropped)
+		json_object_object_add(result, "dropped",
+				json_object_new_int(t->dropped));
+	printf("%s\n", json_object_to_json_string_ext(result, JSON_C_TO_STRING_PRETTY));
+	json_object_put(result);
+}
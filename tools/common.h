@@ -6,6 +6,8 @@ int parse_format_opt(const char *opt);
 char *parse_uuid(const char *opt);
 int is_xml_fname(const char *fname);
 void init_signals(void);
+struct ploop_timing;
+void print_timing(const struct ploop_timing *t);
 
 #define USAGE_FORMATS	"{ raw | ploop1 | expanded | preallocated }"
 #define USAGE_VERSIONS	"{ 1 | 2 } (default 2, if supported)"
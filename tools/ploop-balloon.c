@@ -156,22 +156,35 @@ static int pb_show(int argc, char **argv)
 
 static void usage_change(void)
 {
-	fprintf(stderr, "Usage: ploop-balloon change -s SIZE {-d DEVICE | -m MOUNT_POINT | DiskDescriptor.xml}\n"
+	fprintf(stderr, "Usage: ploop-balloon change -s SIZE [-S STEP] [-r RATE]\n"
+			"                    {-d DEVICE | -m MOUNT_POINT | DiskDescriptor.xml}\n"
 			"	SIZE	    := NUMBER[kmg] (new size of balloon)\n"
+			"	STEP	    := NUMBER[kmg] (size change per step, default 1G)\n"
+			"	RATE	    := NUMBER[kmg] (max size change per second)\n"
 			"	DEVICE	    := ploop device, e.g. /dev/ploop0\n"
 			"	MOUNT_POINT := path where fs living on ploop device mounted to\n"
 			"Action: inflate or truncate hidden balloon (dependently on new_size vs. old_size)\n"
 		);
 }
 
+static void print_progress(__u64 done, __u64 total, void *data)
+{
+	ploop_log(1, "Balloon change progress: %llu/%llu MB",
+			(unsigned long long)done >> 20,
+			(unsigned long long)total >> 20);
+}
+
 static int pb_change(int argc, char **argv)
 {
 	int    fd;
 	int    i, ret;
-	off_t  new_size = 0;
+	off_t  new_size = 0, val;
 	int    new_size_set = 0;
+	struct ploop_balloon_param param = {
+		.progress = print_progress,
+	};
 
-	while ((i = getopt(argc, argv, "s:d:m:")) != EOF) {
+	while ((i = getopt(argc, argv, "s:S:r:d:m:")) != EOF) {
 		switch (i) {
 		case 's':
 			/* NB: currently, new_size is in 'sector' units */
@@ -181,6 +194,20 @@ static int pb_change(int argc, char **argv)
 			}
 			new_size_set++;
 			break;
+		case 'S':
+			if (parse_size(optarg, &val, "-S")) {
+				usage_change();
+				return SYSEXIT_PARAM;
+			}
+			param.step = S2B(val);
+			break;
+		case 'r':
+			if (parse_size(optarg, &val, "-r")) {
+				usage_change();
+				return SYSEXIT_PARAM;
+			}
+			param.rate = S2B(val);
+			break;
 		case 'd':
 			device = optarg;
 			break;
@@ -205,7 +232,7 @@ static int pb_change(int argc, char **argv)
 	if (ret)
 		return ret;
 
-	return ploop_balloon_change_size(device, fd, new_size);
+	return ploop_balloon_change_size_ex(device, fd, new_size, &param);
 }
 
 static void usage_discard(void)
@@ -119,7 +119,7 @@ int plooptool_merge(int argc, char ** argv)
 #endif
 		}
 
-		ret = merge_image(device, start_level, end_level, raw, merge_top, names, new_delta);
+		ret = merge_image(device, start_level, end_level, raw, merge_top, names, new_delta, 0);
 	}
 
 	return ret;
@@ -0,0 +1,714 @@
+/*
+ *  Copyright (c) 2017-2019 Virtuozzo International GmbH. All rights reserved.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+/*
+ * Export a ploop chain over NBD (fixed newstyle handshake, simple
+ * replies) on a UNIX socket. The data is read with ploop_image_reader,
+ * no ploop device is needed. Every connection is served by its own
+ * thread with its own reader. In copy-on-write mode writes go to an
+ * unlinked temporary file and are dropped on exit.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <limits.h>
+#include <getopt.h>
+#include <endian.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <linux/types.h>
+
+#include "ploop.h"
+#include "common.h"
+
+#define NBD_MAGIC		0x4e42444d41474943ULL	/* NBDMAGIC */
+#define NBD_IHAVEOPT		0x49484156454F5054ULL	/* IHAVEOPT */
+#define NBD_REP_MAGIC		0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC	0x25609513
+#define NBD_REPLY_MAGIC		0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE	(1 << 0)
+#define NBD_FLAG_NO_ZEROES	(1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS	(1 << 0)
+#define NBD_FLAG_READ_ONLY	(1 << 1)
+#define NBD_FLAG_SEND_FLUSH	(1 << 2)
+#define NBD_FLAG_SEND_TRIM	(1 << 5)
+#define NBD_FLAG_CAN_MULTI_CONN	(1 << 8)
+
+#define NBD_OPT_EXPORT_NAME	1
+#define NBD_OPT_ABORT		2
+#define NBD_OPT_LIST		3
+#define NBD_OPT_INFO		6
+#define NBD_OPT_GO		7
+
+#define NBD_REP_ACK		1
+#define NBD_REP_SERVER		2
+#define NBD_REP_INFO		3
+#define NBD_REP_ERR_UNSUP	0x80000001
+#define NBD_REP_ERR_INVALID	0x80000003
+
+#define NBD_INFO_EXPORT		0
+
+#define NBD_CMD_READ		0
+#define NBD_CMD_WRITE		1
+#define NBD_CMD_DISC		2
+#define NBD_CMD_FLUSH		3
+#define NBD_CMD_TRIM		4
+
+/* Max request length, same as most NBD servers */
+#define NBD_MAX_REQUEST		(32 << 20)
+/* Granularity of the copy-on-write overlay */
+#define COW_BLOCK		4096
+
+struct nbd_request {
+	__u32 magic;
+	__u16 flags;
+	__u16 type;
+	__u64 handle;
+	__u64 from;
+	__u32 len;
+} __attribute__((packed));
+
+struct nbd_reply {
+	__u32 magic;
+	__u32 error;
+	__u64 handle;
+} __attribute__((packed));
+
+struct nbd_export {
+	struct ploop_disk_images_data *di;
+	const char *guid;
+	const char *name;
+	__u64 size;
+	int cow_fd;		/* -1 - read only export */
+	__u64 *cow_map;		/* set bit - block is in the overlay */
+	pthread_rwlock_t cow_lock;
+	pthread_mutex_t open_lock;
+	int nr_conns;
+};
+
+struct nbd_conn {
+	int fd;
+	struct nbd_export *exp;
+};
+
+static volatile int nbd_stop;
+
+static void nbd_stop_handler(int sig)
+{
+	nbd_stop = 1;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: ploop nbd-serve -s SOCKET [-u UUID] [-n NAME] [-w] DiskDescriptor.xml\n"
+			"       SOCKET := path of the UNIX socket to listen on\n"
+			"       UUID   := snapshot to export, default is the top one\n"
+			"       NAME   := export name, default is the disk descriptor path\n"
+			"       -w     - accept writes into a temporary copy-on-write overlay,\n"
+			"                which is dropped on exit\n"
+		);
+}
+
+static int read_full(int fd, void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = read(fd, buf, len);
+
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len)
+{
+	while (len) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const char *)buf + n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+static int skip_data(int fd, __u32 len)
+{
+	char buf[512];
+
+	while (len) {
+		__u32 n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (read_full(fd, buf, n))
+			return -1;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Send the option reply header, the len bytes of data have to follow */
+static int send_rep_hdr(int fd, __u32 opt, __u32 type, __u32 len)
+{
+	struct {
+		__u64 magic;
+		__u32 opt;
+		__u32 type;
+		__u32 len;
+	} __attribute__((packed)) rep = {
+		.magic = htobe64(NBD_REP_MAGIC),
+		.opt = htobe32(opt),
+		.type = htobe32(type),
+		.len = htobe32(len),
+	};
+
+	return write_full(fd, &rep, sizeof(rep));
+}
+
+static int send_rep(int fd, __u32 opt, __u32 type, const void *data, __u32 len)
+{
+	if (send_rep_hdr(fd, opt, type, len))
+		return -1;
+
+	return len ? write_full(fd, data, len) : 0;
+}
+
+static __u16 export_flags(struct nbd_export *exp)
+{
+	__u16 flags = NBD_FLAG_HAS_FLAGS | NBD_FLAG_SEND_FLUSH;
+
+	if (exp->cow_fd == -1)
+		flags |= NBD_FLAG_READ_ONLY | NBD_FLAG_CAN_MULTI_CONN;
+	else
+		flags |= NBD_FLAG_SEND_TRIM;
+
+	return flags;
+}
+
+static int send_info_export(int fd, __u32 opt, struct nbd_export *exp)
+{
+	struct {
+		__u16 type;
+		__u64 size;
+		__u16 flags;
+	} __attribute__((packed)) info = {
+		.type = htobe16(NBD_INFO_EXPORT),
+		.size = htobe64(exp->size),
+		.flags = htobe16(export_flags(exp)),
+	};
+
+	return send_rep(fd, opt, NBD_REP_INFO, &info, sizeof(info));
+}
+
+/* Returns 1 when the client moves to the transmission phase,
+ * 0 on NBD_OPT_ABORT and -1 on error
+ */
+static int nbd_handshake(int fd, struct nbd_export *exp)
+{
+	struct {
+		__u64 magic;
+		__u64 opt_magic;
+		__u16 flags;
+	} __attribute__((packed)) hello = {
+		.magic = htobe64(NBD_MAGIC),
+		.opt_magic = htobe64(NBD_IHAVEOPT),
+		.flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+	};
+	__u32 cflags;
+
+	if (write_full(fd, &hello, sizeof(hello)) ||
+			read_full(fd, &cflags, sizeof(cflags)))
+		return -1;
+	cflags = be32toh(cflags);
+
+	while (!nbd_stop) {
+		struct {
+			__u64 magic;
+			__u32 opt;
+			__u32 len;
+		} __attribute__((packed)) o;
+		char *data = NULL;
+		__u32 nlen;
+		int ret = 0;
+
+		if (read_full(fd, &o, sizeof(o)))
+			return -1;
+		if (be64toh(o.magic) != NBD_IHAVEOPT)
+			return -1;
+		o.opt = be32toh(o.opt);
+		o.len = be32toh(o.len);
+		if (o.len > 4096) {
+			if (skip_data(fd, o.len) ||
+					send_rep(fd, o.opt, NBD_REP_ERR_INVALID, NULL, 0))
+				return -1;
+			continue;
+		}
+		if (o.len) {
+			data = malloc(o.len);
+			if (data == NULL || read_full(fd, data, o.len)) {
+				free(data);
+				return -1;
+			}
+		}
+
+		switch (o.opt) {
+		case NBD_OPT_EXPORT_NAME: {
+			struct {
+				__u64 size;
+				__u16 flags;
+				char zero[124];
+			} __attribute__((packed)) e = {
+				.size = htobe64(exp->size),
+				.flags = htobe16(export_flags(exp)),
+			};
+
+			free(data);
+			if (write_full(fd, &e, (cflags & NBD_FLAG_NO_ZEROES) ?
+						sizeof(e) - sizeof(e.zero) : sizeof(e)))
+				return -1;
+			return 1;
+		}
+		case NBD_OPT_ABORT:
+			free(data);
+			send_rep(fd, o.opt, NBD_REP_ACK, NULL, 0);
+			return 0;
+		case NBD_OPT_LIST:
+			nlen = htobe32(strlen(exp->name));
+			ret = send_rep_hdr(fd, o.opt, NBD_REP_SERVER,
+					sizeof(nlen) + strlen(exp->name));
+			if (ret == 0)
+				ret = write_full(fd, &nlen, sizeof(nlen));
+			if (ret == 0)
+				ret = write_full(fd, exp->name, strlen(exp->name));
+			if (ret == 0)
+				ret = send_rep(fd, o.opt, NBD_REP_ACK, NULL, 0);
+			break;
+		case NBD_OPT_INFO:
+		case NBD_OPT_GO:
+			/* a single export is served whatever name is asked */
+			ret = send_info_export(fd, o.opt, exp);
+			if (ret == 0)
+				ret = send_rep(fd, o.opt, NBD_REP_ACK, NULL, 0);
+			if (ret == 0 && o.opt == NBD_OPT_GO) {
+				free(data);
+				return 1;
+			}
+			break;
+		default:
+			ret = send_rep(fd, o.opt, NBD_REP_ERR_UNSUP, NULL, 0);
+			break;
+		}
+		free(data);
+		if (ret)
+			return -1;
+	}
+
+	return -1;
+}
+
+static int cow_test(struct nbd_export *exp, __u64 blk)
+{
+	return (exp->cow_map[blk / 64] >> (blk % 64)) & 1;
+}
+
+static void cow_set(struct nbd_export *exp, __u64 blk)
+{
+	exp->cow_map[blk / 64] |= 1ULL << (blk % 64);
+}
+
+/* Read from the chain and the overlay, runs of blocks with the same
+ * location are read at once
+ */
+static int nbd_read(struct nbd_export *exp, struct ploop_image_reader *r,
+		char *buf, __u64 off, __u32 len)
+{
+	__u64 end = off + len;
+
+	if (exp->cow_fd == -1)
+		return ploop_image_reader_pread(r, buf, len, off) == len ? 0 : EIO;
+
+	pthread_rwlock_rdlock(&exp->cow_lock);
+	while (off < end) {
+		__u64 blk = off / COW_BLOCK;
+		int cow = cow_test(exp, blk);
+		__u64 next = (blk + 1) * COW_BLOCK;
+		ssize_t n;
+
+		while (next < end && cow_test(exp, next / COW_BLOCK) == cow)
+			next += COW_BLOCK;
+		if (next > end)
+			next = end;
+
+		if (cow)
+			n = pread(exp->cow_fd, buf, next - off, off);
+		else
+			n = ploop_image_reader_pread(r, buf, next - off, off);
+		if (n != (ssize_t)(next - off)) {
+			pthread_rwlock_unlock(&exp->cow_lock);
+			return EIO;
+		}
+		buf += next - off;
+		off = next;
+	}
+	pthread_rwlock_unlock(&exp->cow_lock);
+
+	return 0;
+}
+
+static int nbd_write(struct nbd_export *exp, struct ploop_image_reader *r,
+		const char *buf, __u64 off, __u32 len)
+{
+	char blk_buf[COW_BLOCK];
+	__u64 end = off + len;
+	int ret = 0;
+
+	pthread_rwlock_wrlock(&exp->cow_lock);
+	while (off < end) {
+		__u64 blk = off / COW_BLOCK;
+		__u64 start = blk * COW_BLOCK;
+		__u32 in = off - start;
+		__u32 n = COW_BLOCK - in;
+
+		if (n > end - off)
+			n = end - off;
+
+		/* a partial write of a block not yet in the overlay */
+		if (n != COW_BLOCK && !cow_test(exp, blk)) {
+			if (ploop_image_reader_pread(r, blk_buf, COW_BLOCK, start) !=
+					COW_BLOCK) {
+				ret = EIO;
+				break;
+			}
+			memcpy(blk_buf + in, buf, n);
+			if (pwrite(exp->cow_fd, blk_buf, COW_BLOCK, start) != COW_BLOCK) {
+				ret = EIO;
+				break;
+			}
+		} else if (pwrite(exp->cow_fd, buf, n, off) != n) {
+			ret = EIO;
+			break;
+		}
+		cow_set(exp, blk);
+		buf += n;
+		off += n;
+	}
+	pthread_rwlock_unlock(&exp->cow_lock);
+
+	return ret;
+}
+
+static void *nbd_conn_thread(void *arg)
+{
+	struct nbd_conn *c = arg;
+	struct nbd_export *exp = c->exp;
+	struct ploop_image_reader *r = NULL;
+	char *buf = NULL;
+	int ret;
+
+	pthread_mutex_lock(&exp->open_lock);
+	ret = ploop_image_reader_open(exp->di, exp->guid, &r);
+	pthread_mutex_unlock(&exp->open_lock);
+	if (ret)
+		goto out;
+
+	if (nbd_handshake(c->fd, exp) != 1)
+		goto out;
+
+	buf = malloc(NBD_MAX_REQUEST);
+	if (buf == NULL)
+		goto out;
+
+	while (!nbd_stop) {
+		struct nbd_request req;
+		struct nbd_reply rep = {
+			.magic = htobe32(NBD_REPLY_MAGIC),
+		};
+		__u32 err = 0;
+
+		if (read_full(c->fd, &req, sizeof(req)))
+			break;
+		if (be32toh(req.magic) != NBD_REQUEST_MAGIC)
+			break;
+		req.type = be16toh(req.type);
+		req.from = be64toh(req.from);
+		req.len = be32toh(req.len);
+		rep.handle = req.handle;
+
+		if (req.type == NBD_CMD_DISC)
+			break;
+
+		if ((req.type == NBD_CMD_READ || req.type == NBD_CMD_WRITE) &&
+				(req.len > NBD_MAX_REQUEST ||
+				 req.from > exp->size ||
+				 req.len > exp->size - req.from)) {
+			if (req.type == NBD_CMD_WRITE && skip_data(c->fd, req.len))
+				break;
+			err = EINVAL;
+			req.type = -1;
+		}
+
+		switch (req.type) {
+		case NBD_CMD_READ:
+			err = nbd_read(exp, r, buf, req.from, req.len);
+			break;
+		case NBD_CMD_WRITE:
+			if (read_full(c->fd, buf, req.len))
+				goto out;
+			if (exp->cow_fd == -1)
+				err = EPERM;
+			else
+				err = nbd_write(exp, r, buf, req.from, req.len);
+			break;
+		case NBD_CMD_FLUSH:
+		case NBD_CMD_TRIM:
+			/* nothing is persistent */
+			break;
+		case (__u16)-1:
+			break;
+		default:
+			err = EINVAL;
+			break;
+		}
+
+		rep.error = htobe32(err);
+		if (write_full(c->fd, &rep, sizeof(rep)))
+			break;
+		if (req.type == NBD_CMD_READ && err == 0 &&
+				write_full(c->fd, buf, req.len))
+			break;
+	}
+
+out:
+	free(buf);
+	ploop_image_reader_close(r);
+	close(c->fd);
+	free(c);
+
+	pthread_mutex_lock(&exp->open_lock);
+	exp->nr_conns--;
+	pthread_mutex_unlock(&exp->open_lock);
+
+	return NULL;
+}
+
+static int nbd_listen(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct stat st;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Socket path %s is too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		ploop_err(errno, "socket");
+		return -1;
+	}
+
+	/* remove a stale socket, but never anything else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s exists and is not a socket\n", path);
+			close(fd);
+			return -1;
+		}
+		unlink(path);
+	}
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(fd, 16)) {
+		ploop_err(errno, "Can't listen on %s", path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int plooptool_nbd_serve(int argc, char **argv)
+{
+	int i, lfd, ret = 0, cow = 0;
+	const char *sock = NULL, *guid = NULL, *name = NULL;
+	struct ploop_disk_images_data *di;
+	struct ploop_image_reader *r;
+	struct nbd_export exp = {
+		.cow_fd = -1,
+		.cow_lock = PTHREAD_RWLOCK_INITIALIZER,
+		.open_lock = PTHREAD_MUTEX_INITIALIZER,
+	};
+	struct sigaction sa = {
+		.sa_handler = nbd_stop_handler,
+	};
+	pthread_attr_t attr;
+
+	while ((i = getopt(argc, argv, "s:u:n:w")) != EOF) {
+		switch (i) {
+		case 's':
+			sock = optarg;
+			break;
+		case 'u':
+			guid = parse_uuid(optarg);
+			if (!guid)
+				return SYSEXIT_PARAM;
+			break;
+		case 'n':
+			name = optarg;
+			break;
+		case 'w':
+			cow = 1;
+			break;
+		default:
+			usage();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1 || sock == NULL || !is_xml_fname(argv[0])) {
+		usage();
+		return SYSEXIT_PARAM;
+	}
+
+	ret = ploop_open_dd(&di, argv[0]);
+	if (ret)
+		return ret;
+
+	/* check the chain and get the size */
+	ret = ploop_image_reader_open(di, guid, &r);
+	if (ret)
+		goto out;
+	exp.size = ploop_image_reader_get_size(r);
+	ploop_image_reader_close(r);
+
+	exp.di = di;
+	exp.guid = guid;
+	exp.name = name ? name : argv[0];
+
+	if (cow) {
+		char tmp[] = "/var/tmp/ploop-nbd-XXXXXX";
+
+		exp.cow_fd = mkstemp(tmp);
+		if (exp.cow_fd == -1) {
+			ploop_err(errno, "Can't create %s", tmp);
+			ret = SYSEXIT_CREAT;
+			goto out;
+		}
+		unlink(tmp);
+		exp.cow_map = calloc((exp.size / COW_BLOCK + 64) / 64, sizeof(__u64));
+		if (exp.cow_map == NULL) {
+			ret = SYSEXIT_MALLOC;
+			goto out;
+		}
+	}
+
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	lfd = nbd_listen(sock);
+	if (lfd == -1) {
+		ret = SYSEXIT_SYS;
+		goto out;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+	ploop_log(0, "Exporting %s (%llu bytes%s) on %s", exp.name,
+			(unsigned long long)exp.size, cow ? ", copy-on-write" : "",
+			sock);
+	while (!nbd_stop) {
+		struct nbd_conn *c;
+		pthread_t th;
+		int fd;
+
+		fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+		if (fd == -1) {
+			if (errno == EINTR)
+				continue;
+			ploop_err(errno, "accept");
+			ret = SYSEXIT_SYS;
+			break;
+		}
+
+		c = malloc(sizeof(struct nbd_conn));
+		if (c == NULL) {
+			close(fd);
+			continue;
+		}
+		c->fd = fd;
+		c->exp = &exp;
+		pthread_mutex_lock(&exp.open_lock);
+		exp.nr_conns++;
+		pthread_mutex_unlock(&exp.open_lock);
+		if (pthread_create(&th, &attr, nbd_conn_thread, c)) {
+			ploop_err(errno, "Can't create connection thread");
+			pthread_mutex_lock(&exp.open_lock);
+			exp.nr_conns--;
+			pthread_mutex_unlock(&exp.open_lock);
+			close(fd);
+			free(c);
+		}
+	}
+
+	pthread_attr_destroy(&attr);
+	close(lfd);
+	unlink(sock);
+
+	/* Connection threads are detached and may be blocked on a client,
+	 * leave their data to the process exit then
+	 */
+	pthread_mutex_lock(&exp.open_lock);
+	i = exp.nr_conns;
+	pthread_mutex_unlock(&exp.open_lock);
+	if (i)
+		return ret;
+out:
+	if (exp.cow_fd != -1)
+		close(exp.cow_fd);
+	free(exp.cow_map);
+	ploop_close_dd(di);
+
+	return ret;
+}
@@ -29,12 +29,13 @@
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: ploop shuffle [-n <num>] IMAGE\n");
+	fprintf(stderr, "Usage: ploop shuffle [-n <num>] IMAGE\n"
+			"       ploop linearize [-n <max moves>] IMAGE\n");
 }
 
 int main(int argc, char **argv)
 {
-	int n = 1, i;
+	int n = -1, i;
 	const char *cmd;
 
 
@@ -64,7 +65,9 @@ int main(int argc, char **argv)
 
 	ploop_set_verbose_level(3);
 	if (strcmp(cmd, "shuffle") == 0)
-		return ploop_image_shuffle(argv[0], n, 0);
+		return ploop_image_shuffle(argv[0], n == -1 ? 1 : n, 0);
+	if (strcmp(cmd, "linearize") == 0)
+		return ploop_image_linearize(argv[0], n == -1 ? 0 : n);
 	
 	usage();
 	return SYSEXIT_PARAM;
@@ -43,6 +43,7 @@ extern int plooptool_grow(int argc, char **argv);
 extern int plooptool_merge(int argc, char ** argv);
 extern int plooptool_stat(int argc, char ** argv);
 extern int plooptool_copy(int argc, char ** argv);
+extern int plooptool_nbd_serve(int argc, char **argv);
 
 static void usage_summary(void)
 {
@@ -63,6 +64,9 @@ static void usage_summary(void)
 			"       ploop restore-descriptor [-f FORMAT] [-b BLOCKSIZE] IMAGE_DIR BASE_DELTA\n"
 			"       ploop replace -i DELTA DiskDescriptor.xml\n"
 			"       ploop encrypt [-k KEY] [-w] DiskDescriptor.xml\n"
+			"       ploop dedup [-n] [-i INDEX] DiskDescriptor.xml ...\n"
+			"       ploop compact-online [-r RATE] [-t] DiskDescriptor.xml\n"
+			"       ploop nbd-serve -s SOCKET [-u UUID] [-n NAME] [-w] DiskDescriptor.xml\n"
 			"       ploop tg-init DEVICE NAME TG_BLOCKSIZE\n"
 			"       ploop tg-deinit DEVICE\n"
 			"       ploop tg-status DEVICE\n"
@@ -245,8 +249,8 @@ static void usage_mount(void)
 {
 	fprintf(stderr, "Usage: ploop mount [-r] [-n] [-f FORMAT] [-b BLOCKSIZE] [-d DEVICE]\n"
 			"             [-m MOUNT_POINT] [-t FSTYPE] [-o MOUNT_OPTS] [--sparse]\n"
-			"             BASE_DELTA [ ... TOP_DELTA ]\n"
-			"       ploop mount [-r] [-m MOUNT_POINT] [-u UUID] DiskDescriptor.xml\n"
+			"             [-T] BASE_DELTA [ ... TOP_DELTA ]\n"
+			"       ploop mount [-r] [-m MOUNT_POINT] [-u UUID] [-T] DiskDescriptor.xml\n"
 			"       FORMAT := { raw | ploop1 }\n"
 			"       BLOCKSIZE := block size (for raw image format)\n"
 			"       DEVICE := ploop device, e.g. /dev/ploop0\n"
@@ -257,6 +261,7 @@ static void usage_mount(void)
 			"       -r     - mount images read-only\n"
 			"       -F     - run fsck on inner filesystem before mounting it\n"
 			"       -n     - do not run partprobe during mount\n"
+			"       -T     - print mount phases timing in JSON\n"
 		);
 }
 
@@ -266,8 +271,10 @@ static int plooptool_mount(int argc, char **argv)
 	int raw = 0;
 	struct ploop_mount_param mountopts = {};
 	const char *component_name = NULL;
+	struct ploop_timing timing;
+	int print_tm = 0;
 
-	while ((i = getopt(argc, argv, "nrFf:d:m:t:u:o:b:c:q")) != EOF) {
+	while ((i = getopt(argc, argv, "nrFf:d:m:t:u:o:b:c:qT")) != EOF) {
 		switch (i) {
 		case 'd':
 			strncpy(mountopts.device, optarg, sizeof(mountopts.device)-1);
@@ -320,6 +327,9 @@ static int plooptool_mount(int argc, char **argv)
 		case 'q':
 			mountopts.quota = PLOOP_JQUOTA;
 			break;
+		case 'T':
+			print_tm = 1;
+			break;
 		default:
 			usage_mount();
 			return SYSEXIT_PARAM;
@@ -334,6 +344,9 @@ static int plooptool_mount(int argc, char **argv)
 		return SYSEXIT_PARAM;
 	}
 
+	if (print_tm)
+		ploop_timing_start(&timing);
+
 	if (argc == 1)
 	{
 		struct ploop_disk_images_data *di;
@@ -351,6 +364,11 @@ static int plooptool_mount(int argc, char **argv)
 	else
 		ret = ploop_mount(NULL, argv, &mountopts, raw);
 
+	if (print_tm) {
+		ploop_timing_stop();
+		print_timing(&timing);
+	}
+
 	return ret;
 }
 
@@ -508,12 +526,13 @@ static int plooptool_clear(int argc, char **argv)
 
 static void usage_umount(void)
 {
-	fprintf(stderr, "Usage: ploop umount -d DEVICE\n"
-			"       ploop umount -m DIR\n"
-			"       ploop umount DiskDescriptor.xml\n"
+	fprintf(stderr, "Usage: ploop umount [-T] -d DEVICE\n"
+			"       ploop umount [-T] -m DIR\n"
+			"       ploop umount [-T] DiskDescriptor.xml\n"
 			"       DEVICE := ploop device, e.g. /dev/ploop0\n"
 			"       DIR := mount point\n"
-			"       DELTA := path to (mounted) image file\n");
+			"       DELTA := path to (mounted) image file\n"
+			"       -T     - print umount phases timing in JSON\n");
 }
 
 static int plooptool_umount(int argc, char **argv)
@@ -525,8 +544,10 @@ static int plooptool_umount(int argc, char **argv)
 		char * device;
 	} umountopts = { };
 	const char *component_name = NULL;
+	struct ploop_timing timing;
+	int print_tm = 0;
 
-	while ((i = getopt(argc, argv, "d:m:c:")) != EOF) {
+	while ((i = getopt(argc, argv, "d:m:c:T")) != EOF) {
 		switch (i) {
 		case 'd':
 			umountopts.device = optarg;
@@ -537,6 +558,9 @@ static int plooptool_umount(int argc, char **argv)
 		case 'c':
 			component_name = optarg;
 			break;
+		case 'T':
+			print_tm = 1;
+			break;
 		default:
 			usage_umount();
 			return SYSEXIT_PARAM;
@@ -551,6 +575,9 @@ static int plooptool_umount(int argc, char **argv)
 		return SYSEXIT_PARAM;
 	}
 
+	if (print_tm)
+		ploop_timing_start(&timing);
+
 	if (umountopts.device != NULL) {
 		int len = strlen(umountopts.device);
 
@@ -581,6 +608,11 @@ static int plooptool_umount(int argc, char **argv)
 		ploop_close_dd(di);
 	}
 
+	if (print_tm) {
+		ploop_timing_stop();
+		print_timing(&timing);
+	}
+
 	return ret;
 }
 
@@ -643,12 +675,13 @@ static int plooptool_rm(int argc, char **argv)
 
 static void usage_snapshot(void)
 {
-	fprintf(stderr, "Usage: ploop snapshot [-u UUID] DiskDescriptor.xml\n"
+	fprintf(stderr, "Usage: ploop snapshot [-u UUID] [-T] DiskDescriptor.xml\n"
 			"       ploop snapshot [-F] [-o] -d DEVICE DELTA\n"
 			"       DEVICE := ploop device, e.g. /dev/ploop0\n"
 			"       DELTA := path to new image file\n"
 			"       -F     - synchronize file system before taking snapshot\n"
 			"       -o     - create an offline snapshot\n"
+			"       -T     - print snapshot phases timing in JSON\n"
 		);
 }
 
@@ -657,8 +690,10 @@ static int plooptool_snapshot(int argc, char **argv)
 	int i, ret;
 	int offline = 0;
 	struct ploop_snapshot_param param = {};
+	struct ploop_timing timing;
+	int print_tm = 0;
 
-	while ((i = getopt(argc, argv, "Fd:u:b:o")) != EOF) {
+	while ((i = getopt(argc, argv, "Fd:u:b:oT")) != EOF) {
 		switch (i) {
 		case 'd':
 			break;
@@ -675,6 +710,9 @@ static int plooptool_snapshot(int argc, char **argv)
 		case 'o':
 			offline = 1;
 			break;
+		case 'T':
+			print_tm = 1;
+			break;
 		default:
 			usage_snapshot();
 			return SYSEXIT_PARAM;
@@ -694,9 +732,17 @@ static int plooptool_snapshot(int argc, char **argv)
 	if (ret)
 		return ret;
 
+	if (print_tm)
+		ploop_timing_start(&timing);
+
 	ret = offline ? ploop_create_snapshot_offline(di, &param) :
 		ploop_create_snapshot(di, &param);
 
+	if (print_tm) {
+		ploop_timing_stop();
+		print_timing(&timing);
+	}
+
 	ploop_close_dd(di);
 
 	return ret;
@@ -850,17 +896,21 @@ static int plooptool_snapshot_delete(int argc, char **argv)
 
 static void usage_snapshot_merge(void)
 {
-	fprintf(stderr, "Usage: ploop snapshot-merge [-u UUID | -A] [-n DELTA] DiskDescriptor.xml\n"
+	fprintf(stderr, "Usage: ploop snapshot-merge [-u UUID | -A] [-n DELTA] [-S] [-T] DiskDescriptor.xml\n"
 			"       -u UUID       snapshot to merge (top delta if not specified)\n"
-			"       -n DELTA      new delta file to merge to\n");
+			"       -n DELTA      new delta file to merge to\n"
+			"       -S            do not rewrite clusters identical to parent ones\n"
+			"       -T            print merge phases timing in JSON\n");
 }
 
 static int plooptool_snapshot_merge(int argc, char ** argv)
 {
 	int i, ret;
 	struct ploop_merge_param param = {};
+	struct ploop_timing timing;
+	int print_tm = 0;
 
-	while ((i = getopt(argc, argv, "u:n:A")) != EOF) {
+	while ((i = getopt(argc, argv, "u:n:AST")) != EOF) {
 		switch (i) {
 		case 'u':
 			param.guid = parse_uuid(optarg);
@@ -873,6 +923,12 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 		case 'n':
 			param.new_delta = strdup(optarg);
 			break;
+		case 'S':
+			param.flags |= PLOOP_MERGE_SKIP_IDENTICAL;
+			break;
+		case 'T':
+			print_tm = 1;
+			break;
 		default:
 			usage_snapshot_merge();
 			return SYSEXIT_PARAM;
@@ -894,8 +950,16 @@ static int plooptool_snapshot_merge(int argc, char ** argv)
 		if (ret)
 			return ret;
 
+		if (print_tm)
+			ploop_timing_start(&timing);
+
 		ret = ploop_merge_snapshot(di, &param);
 
+		if (print_tm) {
+			ploop_timing_stop();
+			print_timing(&timing);
+		}
+
 		ploop_close_dd(di);
 	} else {
 		usage_snapshot_merge();
@@ -1057,7 +1121,7 @@ static int plooptool_convert(int argc, char **argv)
 
 static void usage_info(void)
 {
-	fprintf(stderr, "Usage: ploop info [-s [-b]] [-d] DiskDescriptor.xml\n");
+	fprintf(stderr, "Usage: ploop info [-s [-b]] [-d] [-a] DiskDescriptor.xml\n");
 }
 
 static void print_info(struct ploop_info *info)
@@ -1080,10 +1144,14 @@ static int plooptool_info(int argc, char **argv)
 	int spec = 0;
 	int device = 0;
 	int bat = 0;
+	int alloc = 0;
 	struct ploop_info info = {};
 
-	while ((i = getopt(argc, argv, "sdb")) != EOF) {
+	while ((i = getopt(argc, argv, "sdba")) != EOF) {
 		switch (i) {
+		case 'a':
+			alloc = 1;
+			break;
 		case 's':
 			spec = 1;
 			break;
@@ -1108,7 +1176,7 @@ static int plooptool_info(int argc, char **argv)
 	}
 
 	ploop_set_verbose_level(PLOOP_LOG_NOCONSOLE);
-	if (spec || device) {
+	if (spec || device || alloc) {
 		struct ploop_disk_images_data *di;
 
 		ret = ploop_open_dd(&di, argv[0]);
@@ -1151,6 +1219,29 @@ static int plooptool_info(int argc, char **argv)
 			printf("partition:\t%s\n", part);
 		}
 
+		if (alloc && di->nimages == 0 && ploop_read_dd(di)) {
+			ret = SYSEXIT_DISKDESCR;
+			goto exit;
+		}
+
+		for (i = 0; alloc && i < di->nimages; i++) {
+			struct ploop_alloc_stat st;
+
+			ret = ploop_get_image_alloc_stat(di->images[i]->file, &st);
+			if (ret)
+				goto exit;
+
+			printf("%s:\n\tsize:\t\t%llu\n\tallocated:\t%llu\n"
+					"\tfree:\t\t%llu\n\ttail_free:\t%llu\n"
+					"\tfragments:\t%u\n",
+					di->images[i]->file,
+					(unsigned long long)st.size,
+					(unsigned long long)st.allocated,
+					(unsigned long long)st.free,
+					(unsigned long long)st.tail_free,
+					st.fragments);
+		}
+
 exit:
 		ploop_close_dd(di);
 	} else {
@@ -1515,6 +1606,119 @@ static int plooptool_encrypt(int argc, char **argv)
 	return ret;
 }
 
+static void usage_compact_online(void)
+{
+	fprintf(stderr, "Usage: ploop compact-online [-r RATE] [-t] DiskDescriptor.xml\n"
+			"       RATE := NUMBER[KMGT] relocation rate per second\n"
+			"       -t     compact the top delta too\n"
+		);
+}
+
+static int plooptool_compact_online(int argc, char **argv)
+{
+	int ret, i;
+	off_t rate;
+	struct ploop_disk_images_data *di;
+	struct ploop_online_compact_param param = {};
+
+	while ((i = getopt(argc, argv, "r:t")) != EOF) {
+		switch (i) {
+		case 't':
+			param.top = 1;
+			break;
+		case 'r':
+			if (parse_size(optarg, &rate, "-r")) {
+				usage_compact_online();
+				return SYSEXIT_PARAM;
+			}
+			param.rate = S2B(rate);
+			break;
+		default:
+			usage_compact_online();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		usage_compact_online();
+		return SYSEXIT_PARAM;
+	}
+
+	ret = ploop_open_dd(&di, argv[0]);
+	if (ret)
+		return ret;
+
+	ret = ploop_compact_online(di, &param);
+
+	ploop_close_dd(di);
+
+	return ret;
+}
+
+static void usage_dedup(void)
+{
+	fprintf(stderr, "Usage: ploop dedup [-n] [-i INDEX] DiskDescriptor.xml ...\n"
+			"       -n     dry run, only count duplicate clusters\n"
+			"       INDEX  file to keep cluster hashes between runs\n"
+		);
+}
+
+static int plooptool_dedup(int argc, char **argv)
+{
+	int ret, i, n;
+	struct ploop_disk_images_data **di;
+	struct ploop_dedup_param param = {};
+	struct ploop_dedup_stat stat;
+
+	while ((i = getopt(argc, argv, "ni:")) != EOF) {
+		switch (i) {
+		case 'n':
+			param.dry = 1;
+			break;
+		case 'i':
+			param.index = optarg;
+			break;
+		default:
+			usage_dedup();
+			return SYSEXIT_PARAM;
+		}
+	}
+
+	argc -= optind;
+	argv += optind;
+
+	if (argc < 1) {
+		usage_dedup();
+		return SYSEXIT_PARAM;
+	}
+
+	di = calloc(argc, sizeof(*di));
+	if (di == NULL)
+		return SYSEXIT_MALLOC;
+
+	for (n = 0; n < argc; n++) {
+		ret = ploop_open_dd(&di[n], argv[n]);
+		if (ret)
+			goto out;
+	}
+
+	ret = ploop_dedup(di, n, &param, &stat);
+	if (ret == 0)
+		printf("Clusters: %llu duplicate: %llu shared bytes: %llu\n",
+				(unsigned long long)stat.clusters,
+				(unsigned long long)stat.dup_clusters,
+				(unsigned long long)stat.dedup_bytes);
+out:
+	for (i = 0; i < n; i++)
+		ploop_close_dd(di[i]);
+	free(di);
+
+	return ret;
+}
+
 static int plooptool_tg_init(int argc, char **argv)
 {
 	struct ploop_tg_data d;
@@ -1693,6 +1897,12 @@ int main(int argc, char **argv)
 		return plooptool_restore_descriptor(argc, argv);
 	if (strcmp(cmd, "encrypt") == 0)
 		return plooptool_encrypt(argc, argv);
+	if (strcmp(cmd, "compact-online") == 0)
+		return plooptool_compact_online(argc, argv);
+	if (strcmp(cmd, "nbd-serve") == 0)
+		return plooptool_nbd_serve(argc, argv);
+	if (strcmp(cmd, "dedup") == 0)
+		return plooptool_dedup(argc, argv);
 	if (strcmp(cmd, "tg-init") == 0)
 		return plooptool_tg_init(argc, argv);
 	if (strcmp(cmd, "tg-deinit") == 0)